@@ -0,0 +1,408 @@
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "acs.h"
+
+/* Score of channels which can not be used */
+#define ACS_SCORE_NONE		(INT32_MIN / 2)
+
+/* What doubling the width of a channel is worth, in dB */
+#define ACS_BW_BONUS		3
+
+/*
+ * Scores are computed for all channel numbers of a band at once, four
+ * of them per vector. The padding past the last channel number lets the
+ * windows below read past it without bounds checks, it is never usable.
+ */
+typedef int32_t acs_vec __attribute__((vector_size(16)));
+
+#define ACS_VEC_LANES		(sizeof(acs_vec) / sizeof(int32_t))
+#define ACS_LANES		(REGLIB_NUM_CHANS + 32)
+
+/* Windows of 1, 2, 4 and 8 20 MHz channels, for 20 MHz up to 160 MHz */
+#define ACS_NUM_WINDOWS		(REGLIB_NUM_BWS - REGLIB_BW_20)
+
+/* Devices a worker of acs_rank_many() takes on at a time */
+#define ACS_BATCH		16
+
+/**
+ * struct acs_band - the scores of all channels of a band
+ *
+ * 20 MHz channels on all bands are four channel numbers apart and the
+ * 20 MHz channels a wide channel spans are consecutive ones, so window
+ * n over channel number c covers the 2^n 20 MHz channels starting at c.
+ *
+ * @win: for each window and channel number the lowest score of the
+ *	20 MHz channels in the window
+ * @pwin: for each window and channel number the lowest max TX power of
+ *	the 20 MHz channels in the window
+ */
+struct acs_band {
+	int32_t win[ACS_NUM_WINDOWS][ACS_LANES];
+	int32_t pwin[ACS_NUM_WINDOWS][ACS_LANES];
+};
+
+static inline acs_vec acs_load(const int32_t *p)
+{
+	acs_vec v;
+
+	memcpy(&v, p, sizeof(acs_vec));
+	return v;
+}
+
+static inline void acs_store(int32_t *p, acs_vec v)
+{
+	memcpy(p, &v, sizeof(acs_vec));
+}
+
+static inline acs_vec acs_vec_min(acs_vec a, acs_vec b)
+{
+	acs_vec m = a < b;
+
+	return (a & m) | (b & ~m);
+}
+
+static void acs_fill(int32_t *p, unsigned int n, int32_t val)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		p[i] = val;
+}
+
+/*
+ * Scores every channel number of a band, from the max TX power and
+ * flags reglib_handle_channel() left on the device's channels and the
+ * caller's cost, and builds the windows wide channels are scored with.
+ */
+static void acs_band_score(struct ieee80211_dev_regulatory *reg,
+			   enum ieee80211_band band,
+			   const struct acs_params *params,
+			   struct acs_band *ab)
+{
+	const acs_vec none = (acs_vec) { 0 } + ACS_SCORE_NONE;
+	int32_t costs[ACS_LANES];
+	struct ieee80211_supported_band *sband = reg->bands[band];
+	struct ieee80211_channel *chan;
+	acs_vec power, score, m;
+	unsigned int i, n, off;
+	int nr;
+
+	acs_fill(&ab->win[0][0], ACS_NUM_WINDOWS * ACS_LANES, ACS_SCORE_NONE);
+	acs_fill(&ab->pwin[0][0], ACS_NUM_WINDOWS * ACS_LANES, ACS_SCORE_NONE);
+	memset(costs, 0, sizeof(costs));
+
+	for (i = 0; i < sband->n_channels; i++) {
+		chan = &sband->channels[i];
+		if (chan->flags & IEEE80211_CHAN_DISABLED)
+			continue;
+		nr = reglib_freq_to_chan(band, chan->center_freq);
+		if (nr < 0 || nr >= REGLIB_NUM_CHANS)
+			continue;
+		ab->pwin[0][nr] = chan->max_power;
+	}
+
+	if (params->cost)
+		params->cost(reg, band, costs, params->priv);
+
+	for (i = 0; i < REGLIB_NUM_CHANS; i += ACS_VEC_LANES) {
+		power = acs_load(&ab->pwin[0][i]);
+		score = power - acs_load(&costs[i]);
+		/* Unusable channels stay that way whatever they cost */
+		m = (power == none) | (score < none);
+		acs_store(&ab->win[0][i], (none & m) | (score & ~m));
+	}
+
+	for (n = 1; n < ACS_NUM_WINDOWS; n++) {
+		off = 4 << (n - 1);
+		for (i = 0; i < REGLIB_NUM_CHANS; i += ACS_VEC_LANES) {
+			acs_store(&ab->win[n][i],
+				  acs_vec_min(acs_load(&ab->win[n - 1][i]),
+					      acs_load(&ab->win[n - 1][i + off])));
+			acs_store(&ab->pwin[n][i],
+				  acs_vec_min(acs_load(&ab->pwin[n - 1][i]),
+					      acs_load(&ab->pwin[n - 1][i + off])));
+		}
+	}
+}
+
+/* Ranking order: score, then width, then frequency */
+static bool acs_is_better(const struct acs_candidate *a,
+			  const struct acs_candidate *b)
+{
+	if (a->score != b->score)
+		return a->score > b->score;
+	if (a->bw != b->bw)
+		return a->bw > b->bw;
+	if (a->center_freq != b->center_freq)
+		return a->center_freq < b->center_freq;
+	return a->chan < b->chan;
+}
+
+/* Keeps the best max_cands candidates sorted, best first */
+static void acs_insert(struct acs_candidate *cands,
+		       unsigned int max_cands,
+		       unsigned int *n_cands,
+		       const struct acs_candidate *cand)
+{
+	unsigned int pos = *n_cands;
+
+	while (pos && acs_is_better(cand, &cands[pos - 1]))
+		pos--;
+
+	if (pos >= max_cands)
+		return;
+
+	if (*n_cands < max_cands)
+		(*n_cands)++;
+
+	memmove(&cands[pos + 1], &cands[pos],
+		(*n_cands - pos - 1) * sizeof(struct acs_candidate));
+	cands[pos] = *cand;
+}
+
+/* Scores a channel spanning the window starting at channel number first */
+static void acs_consider(const struct acs_band *ab,
+			 enum ieee80211_band band,
+			 unsigned int chan,
+			 enum reglib_bw bw,
+			 int center_freq,
+			 int first,
+			 struct acs_candidate *cands,
+			 unsigned int max_cands,
+			 unsigned int *n_cands)
+{
+	struct acs_candidate cand;
+	unsigned int n;
+
+	n = bw > REGLIB_BW_20 ? bw - REGLIB_BW_20 : 0;
+
+	if (first < 0 || first >= REGLIB_NUM_CHANS ||
+	    ab->win[n][first] <= ACS_SCORE_NONE)
+		return;
+
+	cand.band = band;
+	cand.chan = chan;
+	cand.bw = bw;
+	cand.center_freq = center_freq;
+	cand.max_power = ab->pwin[n][first];
+	cand.score = ab->win[n][first] +
+		ACS_BW_BONUS * ((int) bw - REGLIB_BW_20);
+
+	acs_insert(cands, max_cands, n_cands, &cand);
+}
+
+static void acs_rank_band(struct ieee80211_dev_regulatory *reg,
+			  enum ieee80211_band band,
+			  const struct acs_params *params,
+			  struct acs_band *ab,
+			  struct acs_candidate *cands,
+			  unsigned int max_cands,
+			  unsigned int *n_cands)
+{
+	const struct reglib_chan_bitmap *maps = reg->chans[band];
+	struct reglib_chan_avail avail;
+	struct reglib_chan_bitmap primary;
+	enum reglib_bw bw;
+	unsigned int w, nr;
+	uint64_t bits;
+	int freq, center, width;
+
+	if (reglib_chan_avail_regd(reg, band, &avail, NULL))
+		return;
+
+	acs_band_score(reg, band, params, ab);
+
+	for (bw = 0; bw < REGLIB_NUM_BWS; bw++) {
+		if (params->bws && !(params->bws & (1 << bw)))
+			continue;
+
+		width = KHZ_TO_MHZ(REGLIB_BW_KHZ(bw));
+		reglib_chan_and(&primary, &avail.primary[bw],
+				&maps[REGLIB_CHANS_ENABLED]);
+
+		for (w = 0; w < REGLIB_CHAN_BITMAP_WORDS; w++) {
+			for (bits = primary.bits[w]; bits; bits &= bits - 1) {
+				nr = w * 64 + __builtin_ctzll(bits);
+				freq = reglib_chan_to_freq(band, nr);
+
+				if (bw <= REGLIB_BW_20) {
+					acs_consider(ab, band, nr, bw, freq, nr,
+						     cands, max_cands, n_cands);
+					continue;
+				}
+
+				if (band == IEEE80211_BAND_2GHZ) {
+					if (bw != REGLIB_BW_40)
+						continue;
+					if (reglib_chan_test(&avail.ht40plus, nr) &&
+					    !reglib_chan_test(&maps[REGLIB_CHANS_NO_HT40PLUS], nr))
+						acs_consider(ab, band, nr, bw,
+							     freq + 10, nr,
+							     cands, max_cands,
+							     n_cands);
+					if (reglib_chan_test(&avail.ht40minus, nr) &&
+					    !reglib_chan_test(&maps[REGLIB_CHANS_NO_HT40MINUS], nr))
+						acs_consider(ab, band, nr, bw,
+							     freq - 10,
+							     (int) nr - 4,
+							     cands, max_cands,
+							     n_cands);
+					continue;
+				}
+
+				if (reglib_chan_test(&maps[REGLIB_CHANS_NO_HT40PLUS], nr) &&
+				    reglib_chan_test(&maps[REGLIB_CHANS_NO_HT40MINUS], nr))
+					continue;
+
+				center = reglib_wide_chan_center(band, nr, bw);
+				if (!center)
+					continue;
+
+				acs_consider(ab, band, nr, bw, center,
+					     reglib_freq_to_chan(band,
+						center - width / 2 + 10),
+					     cands, max_cands, n_cands);
+			}
+		}
+	}
+}
+
+/**
+ * acs_rank - rank the channels an AP could use
+ * @reg: the AP's regulatory data
+ * @params: what to consider
+ * @cands: filled in with the best candidates, best first
+ * @max_cands: room in @cands
+ *
+ * Every channel the regulatory domain and the device permit, at each of
+ * the widths it may be the primary channel of, is a candidate. Scoring
+ * looks at whole bands at once rather than querying the regulatory
+ * domain channel by channel. The domain is only looked at in read-side
+ * critical sections, see reglib_read_lock(), so the regulatory core's
+ * lock is not needed and this may be called in a read-side critical
+ * section. The channels of @reg are read as reglib_regdev_update() left
+ * them though, the caller has to keep @reg from being updated meanwhile.
+ *
+ * Returns the number of candidates filled in.
+ */
+int acs_rank(struct ieee80211_dev_regulatory *reg,
+	     const struct acs_params *params,
+	     struct acs_candidate *cands,
+	     unsigned int max_cands)
+{
+	struct acs_band ab;
+	enum ieee80211_band band;
+	unsigned int n_cands = 0;
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		if (!reg->bands[band])
+			continue;
+		if (params->bands && !(params->bands & (1 << band)))
+			continue;
+		acs_rank_band(reg, band, params, &ab, cands, max_cands,
+			      &n_cands);
+	}
+
+	return n_cands;
+}
+
+/**
+ * struct acs_job - the work shared by the workers of acs_rank_many()
+ *
+ * @next: the next device no worker has taken on yet
+ */
+struct acs_job {
+	struct ieee80211_dev_regulatory **regs;
+	unsigned int n_regs;
+	const struct acs_params *params;
+	struct acs_candidate *cands;
+	unsigned int max_cands;
+	int *n_cands;
+	unsigned int next;
+};
+
+static void *acs_worker(void *arg)
+{
+	struct acs_job *job = arg;
+	unsigned int i, end;
+
+	while (true) {
+		i = __atomic_fetch_add(&job->next, ACS_BATCH, __ATOMIC_RELAXED);
+		if (i >= job->n_regs)
+			break;
+
+		end = i + ACS_BATCH;
+		if (end > job->n_regs)
+			end = job->n_regs;
+
+		for (; i < end; i++)
+			job->n_cands[i] = acs_rank(job->regs[i], job->params,
+						   &job->cands[i * job->max_cands],
+						   job->max_cands);
+	}
+
+	return NULL;
+}
+
+/**
+ * acs_rank_many - acs_rank() for many APs in parallel
+ * @regs: the APs' regulatory data
+ * @n_regs: number of APs
+ * @params: what to consider, the same for all APs
+ * @cands: room for @max_cands candidates for each AP, those of AP i
+ *	start at @cands[i * @max_cands]
+ * @max_cands: number of candidates to keep per AP
+ * @n_cands: filled in with the number of candidates of each AP
+ * @n_threads: number of threads to use including the calling one, 0 for
+ *	one per online CPU
+ *
+ * Like acs_rank() this needs no more than read-side critical sections,
+ * the workers enter their own. The APs must not be updated meanwhile.
+ *
+ * Returns 0, the APs are ranked even if no threads could be started.
+ */
+int acs_rank_many(struct ieee80211_dev_regulatory **regs,
+		  unsigned int n_regs,
+		  const struct acs_params *params,
+		  struct acs_candidate *cands,
+		  unsigned int max_cands,
+		  int *n_cands,
+		  unsigned int n_threads)
+{
+	struct acs_job job = {
+		.regs = regs,
+		.n_regs = n_regs,
+		.params = params,
+		.cands = cands,
+		.max_cands = max_cands,
+		.n_cands = n_cands,
+		.next = 0,
+	};
+	pthread_t threads[64];
+	unsigned int i, n_started = 0;
+	long n_cpus;
+
+	if (!n_threads) {
+		n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n_cpus > 0 ? n_cpus : 1;
+	}
+	if (n_threads > (n_regs + ACS_BATCH - 1) / ACS_BATCH)
+		n_threads = (n_regs + ACS_BATCH - 1) / ACS_BATCH;
+	if (n_threads > ARRAY_SIZE(threads) + 1)
+		n_threads = ARRAY_SIZE(threads) + 1;
+
+	for (i = 1; i < n_threads; i++) {
+		if (pthread_create(&threads[n_started], NULL, acs_worker, &job))
+			break;
+		n_started++;
+	}
+
+	acs_worker(&job);
+
+	for (i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
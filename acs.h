@@ -0,0 +1,83 @@
+#ifndef __ACS_H
+#define __ACS_H
+
+#include <stdint.h>
+
+#include "reglib.h"
+
+/*
+ * Automatic channel selection
+ *
+ * Picks the channels and widths an AP is best off with given what the
+ * regulatory core left it with on each of its channels and how busy
+ * the caller thinks each channel is.
+ */
+
+/**
+ * acs_cost_fn - tells how costly each channel of a band is to use
+ * @reg: the device's regulatory data
+ * @band: the band
+ * @costs: for each IEEE channel number of @band the cost of using that
+ *	20 MHz channel, in the same units as the score, that is dB. Comes
+ *	in zeroed, channels left alone cost nothing.
+ * @priv: the caller's private data from &struct acs_params
+ *
+ * This is where interference and load measurements come in. It may be
+ * called from several threads at once for different devices.
+ */
+typedef void (*acs_cost_fn)(struct ieee80211_dev_regulatory *reg,
+			    enum ieee80211_band band,
+			    int32_t *costs,
+			    void *priv);
+
+/**
+ * struct acs_params - what to consider when selecting channels
+ *
+ * @cost: the cost of each channel, or %NULL if all channels are as good
+ * @priv: passed to @cost
+ * @bands: the bands to consider as a bitmask of BIT(&enum ieee80211_band),
+ *	0 for all of them
+ * @bws: the widths to consider as a bitmask of BIT(&enum reglib_bw),
+ *	0 for all of them
+ */
+struct acs_params {
+	acs_cost_fn cost;
+	void *priv;
+	uint32_t bands;
+	uint32_t bws;
+};
+
+/**
+ * struct acs_candidate - a channel an AP could use
+ *
+ * @band: the band of the channel
+ * @chan: the IEEE channel number of the primary channel
+ * @bw: the width of the channel
+ * @center_freq: center frequency of the whole channel in MHz
+ * @max_power: the max TX power in dBm all of the channel allows
+ * @score: how good the channel is, higher is better. The lowest max TX
+ *	power less cost of the 20 MHz channels it spans, plus 3 dB for
+ *	each doubling of the width beyond 20 MHz.
+ */
+struct acs_candidate {
+	enum ieee80211_band band;
+	unsigned int chan;
+	enum reglib_bw bw;
+	int center_freq;
+	int max_power;
+	int32_t score;
+};
+
+int acs_rank(struct ieee80211_dev_regulatory *reg,
+	     const struct acs_params *params,
+	     struct acs_candidate *cands,
+	     unsigned int max_cands);
+int acs_rank_many(struct ieee80211_dev_regulatory **regs,
+		  unsigned int n_regs,
+		  const struct acs_params *params,
+		  struct acs_candidate *cands,
+		  unsigned int max_cands,
+		  int *n_cands,
+		  unsigned int n_threads);
+
+#endif /* __ACS_H */
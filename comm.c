@@ -1,22 +1,79 @@
 #include <os/mutex.h>
+#include <os/slab.h>
 #include <os/spinlock.h>
 #include <os/workqueue.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "list.h"
 #include "comm.h"
+#include "reg.h"
+#include "regdb.h"
+
+/*
+ * Where CRDA finds its regulatory database, REGSIM_REGDB overrides it.
+ * This can also be a compact database, as regdbc -z writes them.
+ */
+#define COMM_REGDB_PATH	"regulatory.db"
 
 struct crda_request {
 	char alpha2[2];
 	struct dl_list list;
 };
 
+/* A regulatory domain expanded from a compact database */
+struct crda_regd {
+	struct ieee80211_regdomain *rd;
+	struct dl_list list;
+};
+
+/**
+ * struct crda_db - a loaded regulatory database
+ *
+ * Lookups hold a reference to the database they started on so that a
+ * reload can publish a new one while they finish on the old one, which
+ * goes away with its last reference.
+ *
+ * A compact database is only expanded a country at a time, as CRDA
+ * hands the country to the regulatory core. The expanded domains go
+ * away with the database, just like the domains within a mapped one.
+ *
+ * @db: the database, %NULL for a compact database
+ * @blob: the compact database, %NULL for a database
+ * @blob_size: size of @blob
+ * @regds: the domains expanded from @blob so far, protected by
+ *	crda_apply_mutex
+ * @st: the database file when it was loaded, to tell when it changed
+ * @refs: references held, including the one of crda_db while published
+ */
+struct crda_db {
+	struct regdb *db;
+	uint8_t *blob;
+	size_t blob_size;
+	struct dl_list regds;
+	struct stat st;
+	unsigned int refs;
+};
+
 static struct mutex crda_mutex;
 static struct dl_list crda_list;
+static struct kmem_cache *crda_request_cache;
+
+/* Protects crda_db and the references to it */
+static spinlock_t crda_db_lock;
+static struct crda_db *crda_db;
+
+/*
+ * Serializes handing regulatory domains to the regulatory core, so that
+ * once a reload has switched the core over no CRDA run can hand it a
+ * domain of the old database anymore.
+ */
+static struct mutex crda_apply_mutex;
 
 static void *comm_todo(void *arg);
 static DECLARE_WORK(comm_work, comm_todo);
@@ -25,7 +82,7 @@ int comm_add_crda_request(const char *alpha2)
 {
 	struct crda_request *req;
 
-	req = malloc(sizeof(struct crda_request));
+	req = kmem_cache_alloc(crda_request_cache);
 	if (!req)
 		return -ENOMEM;
 
@@ -41,40 +98,385 @@ int comm_add_crda_request(const char *alpha2)
 	return 0;
 }
 
+static const char *comm_db_path(void)
+{
+	const char *path;
+
+	path = getenv("REGSIM_REGDB");
+	if (!path)
+		path = COMM_REGDB_PATH;
+
+	return path;
+}
+
+/**
+ * struct comm_db_check - what comm_db_problem() found wrong with a database
+ *
+ * @path: the database file
+ * @n_errors: number of problems which keep the database from being used
+ */
+struct comm_db_check {
+	const char *path;
+	unsigned int n_errors;
+};
+
+/*
+ * A shadowed rule is never looked at, but the domain is as good as it
+ * would be without it. Only malformed domains are errors.
+ */
+static void comm_db_problem(const struct regdb_problem *problem, void *priv)
+{
+	struct comm_db_check *check = priv;
+	const char *level = "";
+
+	if (problem->type == REGDB_PROBLEM_SHADOWED)
+		level = "warning: ";
+	else
+		check->n_errors++;
+
+	if (problem->rule < 0)
+		printf("CRDA: %s: %s%c%c %s\n", check->path, level,
+		       problem->alpha2[0], problem->alpha2[1],
+		       regdb_problem_str(problem->type));
+	else if (problem->other_rule < 0)
+		printf("CRDA: %s: %s%c%c rule %d %s\n", check->path, level,
+		       problem->alpha2[0], problem->alpha2[1], problem->rule,
+		       regdb_problem_str(problem->type));
+	else
+		printf("CRDA: %s: %s%c%c rule %d %s, rule %d\n", check->path,
+		       level, problem->alpha2[0], problem->alpha2[1],
+		       problem->rule, regdb_problem_str(problem->type),
+		       problem->other_rule);
+}
+
+/* Loads and validates the database, nothing malformed gets published */
+static int comm_db_open(const char *path, struct crda_db **cdb)
+{
+	struct comm_db_check check = {
+		.path = path,
+	};
+	struct crda_db *new_cdb;
+	int r;
+
+	new_cdb = malloc(sizeof(struct crda_db));
+	if (!new_cdb)
+		return -ENOMEM;
+	memset(new_cdb, 0, sizeof(struct crda_db));
+	dl_list_init(&new_cdb->regds);
+
+	/* If the file changes in between the next reload catches it */
+	if (stat(path, &new_cdb->st)) {
+		r = -errno;
+		free(new_cdb);
+		return r;
+	}
+
+	/* regdb_compact_load() checks all the rules of a compact database */
+	r = regdb_compact_load(path, &new_cdb->blob, &new_cdb->blob_size);
+	if (r != -EINVAL) {
+		if (r) {
+			free(new_cdb);
+			return r;
+		}
+		new_cdb->refs = 1;
+		*cdb = new_cdb;
+		return 0;
+	}
+
+	r = regdb_load(path, &new_cdb->db);
+	if (r) {
+		free(new_cdb);
+		return r;
+	}
+
+	r = regdb_validate(new_cdb->db, 0, comm_db_problem, &check);
+	if (r < 0 || check.n_errors) {
+		regdb_free(new_cdb->db);
+		free(new_cdb);
+		return r < 0 ? r : -EINVAL;
+	}
+
+	new_cdb->refs = 1;
+	*cdb = new_cdb;
+
+	return 0;
+}
+
+/* The published database with a reference held, or %NULL */
+static struct crda_db *comm_db_get(void)
+{
+	struct crda_db *cdb;
+
+	spin_lock(&crda_db_lock);
+	cdb = crda_db;
+	if (cdb)
+		cdb->refs++;
+	spin_unlock(&crda_db_lock);
+
+	return cdb;
+}
+
+static void comm_db_put(struct crda_db *cdb)
+{
+	struct crda_regd *regd, *tmp;
+	bool last;
+
+	if (!cdb)
+		return;
+
+	spin_lock(&crda_db_lock);
+	last = !--cdb->refs;
+	spin_unlock(&crda_db_lock);
+
+	if (!last)
+		return;
+
+	dl_list_for_each_safe(regd, tmp, &cdb->regds, struct crda_regd, list) {
+		dl_list_del(&regd->list);
+		free(regd->rd);
+		free(regd);
+	}
+
+	regdb_free(cdb->db);
+	free(cdb->blob);
+	free(cdb);
+}
+
+static unsigned int comm_db_n_countries(const struct crda_db *cdb)
+{
+	if (cdb->blob)
+		return regdb_compact_n_countries(cdb->blob);
+
+	return regdb_n_countries(cdb->db);
+}
+
+static bool comm_db_same_file(const struct crda_db *cdb,
+			      const struct stat *st)
+{
+	return cdb->st.st_dev == st->st_dev &&
+	       cdb->st.st_ino == st->st_ino &&
+	       cdb->st.st_size == st->st_size &&
+	       cdb->st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+	       cdb->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Expands a country of a compact database once, with crda_apply_mutex */
+static const struct ieee80211_regdomain *
+comm_db_expand(struct crda_db *cdb, const char *alpha2)
+{
+	struct regdb_compact_regd compact_regd;
+	struct ieee80211_regdomain *rd;
+	struct crda_regd *regd;
+
+	dl_list_for_each(regd, &cdb->regds, struct crda_regd, list)
+		if (!memcmp(regd->rd->alpha2, alpha2, 2))
+			return regd->rd;
+
+	if (regdb_compact_find(cdb->blob, cdb->blob_size, alpha2,
+			       &compact_regd))
+		return NULL;
+
+	regd = malloc(sizeof(struct crda_regd));
+	if (!regd)
+		return NULL;
+
+	if (regdb_compact_expand(&compact_regd, &rd)) {
+		free(regd);
+		return NULL;
+	}
+
+	regd->rd = rd;
+	dl_list_add_tail(&cdb->regds, &regd->list);
+
+	return rd;
+}
+
+/*
+ * The mapped database may be newer than the one regsim was built with,
+ * the domains of db.txt are only used for countries it does not have.
+ * Called with crda_apply_mutex held.
+ */
+static const struct ieee80211_regdomain *comm_find_regd(const char *alpha2,
+							void *priv)
+{
+	struct crda_db *cdb = priv;
+	const struct ieee80211_regdomain *rd = NULL;
+
+	if (cdb && cdb->blob)
+		rd = comm_db_expand(cdb, alpha2);
+	else if (cdb)
+		rd = regdb_find(cdb->db, alpha2);
+	if (!rd)
+		rd = regdb_static_find(alpha2);
+
+	return rd;
+}
+
+/**
+ * comm_reload_db - pick up changes to the regulatory database
+ *
+ * If the database file changed since it was loaded the new one is loaded
+ * and checked, without holding up lookups, then published for the CRDA
+ * runs to come and the regulatory core switched over to it. Lookups in
+ * flight finish on the database they started on.
+ *
+ * Returns 0 if the file did not change or was reloaded, or a negative
+ * error code if it could not be loaded, in which case the database
+ * loaded before stays in use.
+ */
+int comm_reload_db(void)
+{
+	struct crda_db *cdb, *old_cdb;
+	const char *path = comm_db_path();
+	struct stat st;
+	int r;
+
+	if (stat(path, &st))
+		return -errno;
+
+	cdb = comm_db_get();
+	if (cdb && comm_db_same_file(cdb, &st)) {
+		comm_db_put(cdb);
+		return 0;
+	}
+	comm_db_put(cdb);
+
+	r = comm_db_open(path, &cdb);
+	if (r) {
+		printf("CRDA could not reload %s: %d\n", path, r);
+		return r;
+	}
+
+	mutex_lock(&crda_apply_mutex);
+
+	/* Someone else may have beaten us to it */
+	if (crda_db && comm_db_same_file(crda_db, &cdb->st)) {
+		mutex_unlock(&crda_apply_mutex);
+		comm_db_put(cdb);
+		return 0;
+	}
+
+	spin_lock(&crda_db_lock);
+	old_cdb = crda_db;
+	crda_db = cdb;
+	spin_unlock(&crda_db_lock);
+
+	r = regulatory_reload_regdom(comm_find_regd, cdb);
+
+	mutex_unlock(&crda_apply_mutex);
+
+	comm_db_put(old_cdb);
+
+	if (r < 0) {
+		printf("CRDA could not switch over to %s: %d\n", path, r);
+		return r;
+	}
+
+	printf("CRDA reloaded %u regulatory domains from %s, "
+	       "%d devices updated\n", comm_db_n_countries(cdb), path, r);
+
+	return 0;
+}
+
+static void comm_run_crda(const char *alpha2)
+{
+	const struct ieee80211_regdomain *rd;
+	struct crda_db *cdb;
+	int r;
+
+	printf("CRDA being run for %c%c\n", alpha2[0], alpha2[1]);
+
+	mutex_lock(&crda_apply_mutex);
+
+	cdb = comm_db_get();
+	rd = comm_find_regd(alpha2, cdb);
+	if (rd) {
+		r = regulatory_set_regdom(rd);
+		if (r)
+			printf("CRDA failed to set regulatory domain %c%c: %d\n",
+			       alpha2[0], alpha2[1], r);
+	} else
+		printf("CRDA has no regulatory domain for %c%c\n",
+		       alpha2[0], alpha2[1]);
+	comm_db_put(cdb);
+
+	mutex_unlock(&crda_apply_mutex);
+}
+
+/*
+ * The regulatory core holds its lock while it adds requests, so the
+ * requests are taken off the list first and handed back to the core
+ * without holding crda_mutex.
+ */
 static void comm_process_crda_list(void)
 {
 	struct crda_request *req, *tmp;
+	struct dl_list todo;
+
+	dl_list_init(&todo);
 
+	/* Each batch of CRDA runs gets the latest database */
+	comm_reload_db();
+
+	mutex_lock(&crda_mutex);
 	dl_list_for_each_safe(req, tmp, &crda_list,
 			      struct crda_request, list) {
 		dl_list_del(&req->list);
-		printf("CRDA being run for %c%c\n",
-		       req->alpha2[0],
-		       req->alpha2[1]);
-		/* XXX: actually do the CRDA work */
-		sleep(3);
+		dl_list_add_tail(&todo, &req->list);
+	}
+	mutex_unlock(&crda_mutex);
+
+	dl_list_for_each_safe(req, tmp, &todo,
+			      struct crda_request, list) {
+		dl_list_del(&req->list);
+		comm_run_crda(req->alpha2);
+		kmem_cache_free(crda_request_cache, req);
 	}
 }
 
 static void *comm_todo(void *arg)
 {
-	mutex_lock(&crda_mutex);
 	comm_process_crda_list();
-	mutex_unlock(&crda_mutex);
 
-	pthread_exit(NULL);
+	return NULL;
 }
 
 int comm_init(void)
 {
+	const char *path = comm_db_path();
+	int r;
+
 	init_work(&comm_work);
 	dl_list_init(&crda_list);
 
+	crda_request_cache = kmem_cache_create("crda_request",
+					       sizeof(struct crda_request));
+	if (!crda_request_cache)
+		return -ENOMEM;
+
 	mutex_init(&crda_mutex);
+	mutex_init(&crda_apply_mutex);
+	spin_lock_init(&crda_db_lock);
+
+	/* Without a database CRDA only knows the domains of db.txt */
+	r = comm_db_open(path, &crda_db);
+	if (r) {
+		crda_db = NULL;
+		if (r != -ENOENT)
+			printf("CRDA could not load %s: %d\n", path, r);
+	} else
+		printf("CRDA loaded %u regulatory domains from %s\n",
+		       comm_db_n_countries(crda_db), path);
 
 	return 0;
 }
 
+/* Waits for the CRDA runs requested so far to be done */
+void comm_flush(void)
+{
+	flush_work(&comm_work);
+}
+
 void comm_stop(void)
 {
 	struct crda_request *req, *tmp;
@@ -82,13 +484,21 @@ void comm_stop(void)
 	cancel_work_sync(&comm_work);
 
 	mutex_lock(&crda_mutex);
-	if (!dl_list_empty(&crda_list)) {
-		dl_list_for_each_safe(req, tmp, &crda_list,
-				      struct crda_request, list) {
-			dl_list_del(&req->list);
-		}
+	dl_list_for_each_safe(req, tmp, &crda_list,
+			      struct crda_request, list) {
+		dl_list_del(&req->list);
+		kmem_cache_free(crda_request_cache, req);
 	}
 	mutex_unlock(&crda_mutex);
 
 	mutex_destroy(&crda_mutex);
+
+	kmem_cache_destroy(crda_request_cache);
+	crda_request_cache = NULL;
+
+	mutex_destroy(&crda_apply_mutex);
+
+	comm_db_put(crda_db);
+	crda_db = NULL;
+	spin_lock_destroy(&crda_db_lock);
 }
@@ -3,6 +3,8 @@
 
 int comm_add_crda_request(const char *alpha2);
 int comm_init(void);
+int comm_reload_db(void);
+void comm_flush(void);
 void comm_stop(void);
 
 #endif /* __COMM_H */
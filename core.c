@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -65,10 +66,16 @@ void wdev_free(struct wifi_dev *wdev)
 
 void register_wifi_dev(struct wifi_dev *wdev)
 {
+	regdev_register(&wdev->reg);
 	regdev_update(&wdev->reg);
 	printf("wlan%d registered\n", wdev->idx);
 }
 
+void unregister_wifi_dev(struct wifi_dev *wdev)
+{
+	regdev_unregister(&wdev->reg);
+}
+
 int main(void)
 {
 	int r = 0;
@@ -81,12 +88,26 @@ int main(void)
 	if (r)
 		goto comm_kill;
 
-	reg_core_test();
+	r = reg_core_test();
+	if (r)
+		goto out;
+
+	if (getenv("REGSIM_STRESS")) {
+		r = reg_stress_test();
+		if (r)
+			goto out;
+	}
 
 	r = probe_wifi_devices();
 	if (r)
 		goto out;
 
+	/*
+	 * Like userspace asking for the regulatory database to be reloaded,
+	 * if that fails the old one stays in use and CRDA says why.
+	 */
+	regulatory_reload_db();
+
 	remove_wifi_devices();
 
 	/*
@@ -8,5 +8,6 @@ struct wifi_dev *wdev_new(void);
 void wdev_free(struct wifi_dev *wdev);
 
 void register_wifi_dev(struct wifi_dev *wdev);
+void unregister_wifi_dev(struct wifi_dev *wdev);
 
 #endif /* __CORE_H */
@@ -139,6 +139,7 @@ static void acme_remove(struct device *dev, unsigned int idx)
 {
 	struct wifi_dev *wdev = dev->wdev;
 
+	unregister_wifi_dev(wdev);
 	wdev_free(wdev);
 	dev->wdev = NULL;
 }
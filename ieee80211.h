@@ -9,11 +9,15 @@
  *
  * @IEEE80211_BAND_2GHZ: 2.4GHz ISM band
  * @IEEE80211_BAND_5GHZ: around 5GHz band (4.9-5.7)
+ * @IEEE80211_BAND_60GHZ: around 60 GHz band (58.32 - 64.80 GHz)
+ * @IEEE80211_BAND_6GHZ: around 6 GHz band (5.9-7.2)
  * @IEEE80211_NUM_BANDS: number of defined bands
  */
 enum ieee80211_band {
 	IEEE80211_BAND_2GHZ,
 	IEEE80211_BAND_5GHZ,
+	IEEE80211_BAND_60GHZ,
+	IEEE80211_BAND_6GHZ,
 
 	/* keep last */
 	IEEE80211_NUM_BANDS,
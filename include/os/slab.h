@@ -0,0 +1,23 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Caches of objects of one size. Each thread keeps a few free objects
+ * of each cache to itself, so that allocating and freeing usually takes
+ * neither a lock nor a trip to malloc(). The rest are kept by the cache,
+ * which gets more from malloc() a slab at a time and gives them all back
+ * when it is destroyed.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void *kmem_cache_zalloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+long kmem_cache_in_use(struct kmem_cache *cache);
+
+#endif /* __SLAB_H */
@@ -1,16 +1,37 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#include "list.h"
+
 #ifndef __WORKQUEUE_H
 #define __WORKQUEUE_H
 
-
+/*
+ * Works run on a pool of worker threads shared by all works, with one
+ * queue per worker. Workers take works off the back of their own queue
+ * and, once it is empty, steal from the front of the others'.
+ */
+
+/* Set from schedule_work() until the work's callback is started */
+#define WORK_PENDING	0x1
+/* Set while a worker runs the work's callback */
+#define WORK_RUNNING	0x2
+
+struct worker;
+
+/**
+ * struct work - a callback to run on the worker pool
+ *
+ * @state: %WORK_PENDING and %WORK_RUNNING
+ * @worker: the worker whose queue the work is on, %NULL if none
+ * @entry: for inclusion in the worker's queue
+ * @arg: passed to @work_cb
+ * @work_cb: the callback
+ */
 struct work {
-	bool ready;
-
-	pthread_t thread;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	unsigned int state;
+	struct worker *worker;
+	struct dl_list entry;
 
 	void *arg;
 	void *(*work_cb)(void *arg);
@@ -22,29 +43,9 @@ struct work _w = { \
 	.arg = NULL, \
 };
 
-extern void *run_work(void *arg);
-
-static inline void init_work(struct work *w)
-{
-	w->ready = false;
-
-	pthread_mutex_init(&w->mutex, NULL);
-	pthread_cond_init(&w->cond, NULL);
-
-	pthread_create(&w->thread, NULL, run_work, (void *) w);
-
-	while (1) {
-		pthread_mutex_lock(&w->mutex);
-		if (w->ready) {
-			pthread_mutex_unlock(&w->mutex);
-			break;
-		}
-		pthread_mutex_unlock(&w->mutex);
-	}
-}
-
-void schedule_work(struct work *w);
-void cancel_work_sync(struct work *w);
 void init_work(struct work *w);
+bool schedule_work(struct work *w);
+bool flush_work(struct work *w);
+bool cancel_work_sync(struct work *w);
 
 #endif /* __WORKQUEUE_H */
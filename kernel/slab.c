@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <os/slab.h>
+
+#include "c-hacks.h"
+#include "list.h"
+
+/* Free objects each thread keeps of a cache */
+#define KMEM_MAG_SIZE	32
+/* Objects the cache gets from malloc() at a time */
+#define KMEM_SLAB_OBJS	64
+#define KMEM_ALIGN	16
+
+/**
+ * struct kmem_magazine - the free objects a thread keeps of a cache
+ *
+ * @cache: the cache
+ * @list: for inclusion in the cache's list of magazines
+ * @in_use: objects the thread allocated less those it freed, which may
+ *	well be negative
+ * @n_objs: number of entries in @objs
+ * @objs: the free objects
+ */
+struct kmem_magazine {
+	struct kmem_cache *cache;
+	struct dl_list list;
+	long in_use;
+	unsigned int n_objs;
+	void *objs[KMEM_MAG_SIZE];
+};
+
+/**
+ * struct kmem_slab - objects the cache got from malloc() in one go
+ *
+ * @list: for inclusion in the cache's list of slabs
+ * @objs: the objects
+ */
+struct kmem_slab {
+	struct dl_list list;
+	char objs[] __attribute__((aligned(KMEM_ALIGN)));
+};
+
+/**
+ * struct kmem_cache - a cache of objects of one size
+ *
+ * @name: the name to report leaks under
+ * @size: size of the objects, rounded up to %KMEM_ALIGN
+ * @key: the thread's magazine
+ * @lock: protects all below
+ * @free_objs: free objects no thread keeps, linked through their first
+ *	bytes
+ * @n_free: number of objects on @free_objs
+ * @slabs: the slabs of the cache
+ * @magazines: the magazines of the threads which have any
+ * @in_use: objects allocated less objects freed by threads whose
+ *	magazines are gone
+ */
+struct kmem_cache {
+	const char *name;
+	size_t size;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	void *free_objs;
+	unsigned int n_free;
+	struct dl_list slabs;
+	struct dl_list magazines;
+	long in_use;
+};
+
+/* Hands the objects of an exiting thread's magazine to its cache */
+static void kmem_magazine_release(struct kmem_cache *cache,
+				  struct kmem_magazine *mag)
+{
+	unsigned int i;
+
+	for (i = 0; i < mag->n_objs; i++) {
+		*(void **) mag->objs[i] = cache->free_objs;
+		cache->free_objs = mag->objs[i];
+	}
+	cache->n_free += mag->n_objs;
+	cache->in_use += mag->in_use;
+
+	dl_list_del(&mag->list);
+}
+
+static void kmem_magazine_destructor(void *data)
+{
+	struct kmem_magazine *mag = data;
+	struct kmem_cache *cache = mag->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	kmem_magazine_release(cache, mag);
+	pthread_mutex_unlock(&cache->lock);
+
+	free(mag);
+}
+
+/**
+ * kmem_cache_create - create a cache of objects
+ * @name: the name to report leaks under, must outlive the cache
+ * @size: size of the objects
+ *
+ * Returns the cache or %NULL if we ran out of memory.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size)
+{
+	struct kmem_cache *cache;
+
+	cache = malloc(sizeof(struct kmem_cache));
+	if (!cache)
+		return NULL;
+
+	memset(cache, 0, sizeof(struct kmem_cache));
+	cache->name = name;
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	cache->size = (size + KMEM_ALIGN - 1) & ~(size_t) (KMEM_ALIGN - 1);
+	dl_list_init(&cache->slabs);
+	dl_list_init(&cache->magazines);
+
+	if (pthread_key_create(&cache->key, kmem_magazine_destructor)) {
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return cache;
+}
+
+/**
+ * kmem_cache_in_use - count the objects of a cache allocated and not freed
+ * @cache: the cache
+ *
+ * Only exact while no other thread allocates or frees objects of @cache.
+ */
+long kmem_cache_in_use(struct kmem_cache *cache)
+{
+	struct kmem_magazine *mag;
+	long in_use;
+
+	pthread_mutex_lock(&cache->lock);
+	in_use = cache->in_use;
+	dl_list_for_each(mag, &cache->magazines, struct kmem_magazine, list)
+		in_use += __atomic_load_n(&mag->in_use, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache->lock);
+
+	return in_use;
+}
+
+/**
+ * kmem_cache_destroy - give all objects of a cache back
+ * @cache: the cache
+ *
+ * All objects of @cache have to be freed beforehand, those which were
+ * not are reported as leaked. No thread may use @cache anymore.
+ */
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	struct kmem_magazine *mag, *tmp_mag;
+	struct kmem_slab *slab, *tmp_slab;
+	long in_use;
+
+	if (!cache)
+		return;
+
+	in_use = kmem_cache_in_use(cache);
+	if (in_use)
+		printf("kmem_cache %s: %ld objects leaked\n",
+		       cache->name, in_use);
+
+	pthread_key_delete(cache->key);
+
+	dl_list_for_each_safe(mag, tmp_mag, &cache->magazines,
+			      struct kmem_magazine, list) {
+		dl_list_del(&mag->list);
+		free(mag);
+	}
+
+	dl_list_for_each_safe(slab, tmp_slab, &cache->slabs,
+			      struct kmem_slab, list) {
+		dl_list_del(&slab->list);
+		free(slab);
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static struct kmem_magazine *kmem_magazine_get(struct kmem_cache *cache)
+{
+	struct kmem_magazine *mag;
+
+	mag = pthread_getspecific(cache->key);
+	if (mag)
+		return mag;
+
+	mag = malloc(sizeof(struct kmem_magazine));
+	if (!mag)
+		return NULL;
+
+	mag->cache = cache;
+	mag->in_use = 0;
+	mag->n_objs = 0;
+
+	if (pthread_setspecific(cache->key, mag)) {
+		free(mag);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	dl_list_add(&cache->magazines, &mag->list);
+	pthread_mutex_unlock(&cache->lock);
+
+	return mag;
+}
+
+/* Gets half a magazine of objects from the cache, growing it if need be */
+static void kmem_magazine_fill(struct kmem_cache *cache,
+			       struct kmem_magazine *mag)
+{
+	struct kmem_slab *slab;
+	unsigned int i;
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (!cache->free_objs) {
+		slab = malloc(sizeof(struct kmem_slab) +
+			      KMEM_SLAB_OBJS * cache->size);
+		if (slab) {
+			dl_list_add(&cache->slabs, &slab->list);
+			for (i = 0; i < KMEM_SLAB_OBJS; i++) {
+				*(void **) &slab->objs[i * cache->size] =
+					cache->free_objs;
+				cache->free_objs = &slab->objs[i * cache->size];
+			}
+			cache->n_free += KMEM_SLAB_OBJS;
+		}
+	}
+
+	while (cache->free_objs && mag->n_objs < KMEM_MAG_SIZE / 2) {
+		mag->objs[mag->n_objs++] = cache->free_objs;
+		cache->free_objs = *(void **) cache->free_objs;
+		cache->n_free--;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Hands half a magazine of objects back to the cache */
+static void kmem_magazine_flush(struct kmem_cache *cache,
+				struct kmem_magazine *mag)
+{
+	pthread_mutex_lock(&cache->lock);
+	while (mag->n_objs > KMEM_MAG_SIZE / 2) {
+		mag->n_objs--;
+		*(void **) mag->objs[mag->n_objs] = cache->free_objs;
+		cache->free_objs = mag->objs[mag->n_objs];
+		cache->n_free++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * kmem_cache_alloc - allocate an object of a cache
+ * @cache: the cache
+ *
+ * Returns the object, whose contents are undefined, or %NULL if we ran
+ * out of memory.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	struct kmem_magazine *mag;
+
+	mag = kmem_magazine_get(cache);
+	if (!mag)
+		return NULL;
+
+	if (!mag->n_objs) {
+		kmem_magazine_fill(cache, mag);
+		if (!mag->n_objs)
+			return NULL;
+	}
+
+	/* Only ever read by others for kmem_cache_in_use() */
+	__atomic_store_n(&mag->in_use, mag->in_use + 1, __ATOMIC_RELAXED);
+
+	return mag->objs[--mag->n_objs];
+}
+
+/* kmem_cache_alloc(), with the object zeroed */
+void *kmem_cache_zalloc(struct kmem_cache *cache)
+{
+	void *obj;
+
+	obj = kmem_cache_alloc(cache);
+	if (obj)
+		memset(obj, 0, cache->size);
+
+	return obj;
+}
+
+/**
+ * kmem_cache_free - free an object of a cache
+ * @cache: the cache the object was allocated from
+ * @obj: the object, may be %NULL
+ *
+ * Objects may be freed by other threads than the one which allocated
+ * them.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	struct kmem_magazine *mag;
+
+	if (!obj)
+		return;
+
+	mag = kmem_magazine_get(cache);
+	if (!mag) {
+		/* Straight back to the cache then */
+		pthread_mutex_lock(&cache->lock);
+		*(void **) obj = cache->free_objs;
+		cache->free_objs = obj;
+		cache->n_free++;
+		cache->in_use--;
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	if (mag->n_objs == KMEM_MAG_SIZE)
+		kmem_magazine_flush(cache, mag);
+
+	__atomic_store_n(&mag->in_use, mag->in_use - 1, __ATOMIC_RELAXED);
+	mag->objs[mag->n_objs++] = obj;
+}
@@ -2,44 +2,355 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include <os/workqueue.h>
 
 #include "c-hacks.h"
 
-void schedule_work(struct work *w)
+/* Most workers the pool gets, however many CPUs there are */
+#define WQ_MAX_WORKERS	64
+/* Fewest workers, so that a work which blocks does not hold up all others */
+#define WQ_MIN_WORKERS	2
+
+/**
+ * struct worker - a thread of the worker pool
+ *
+ * @thread: the thread
+ * @lock: protects @queue and the worker of the works on it
+ * @queue: the works queued on this worker, oldest first
+ */
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct dl_list queue;
+} __attribute__((aligned(64)));
+
+/**
+ * struct worker_pool - the workers all works run on
+ *
+ * @workers: the workers
+ * @n_workers: number of workers started
+ * @next: the worker the next work scheduled outside the pool goes to
+ * @n_queued: number of works on the queues of all workers
+ * @n_idle: number of workers waiting on @more
+ * @lock: what @more and @done are waited on with
+ * @more: signaled when a work is queued while workers are idle
+ * @done: broadcast whenever a work's callback returns or a pending work
+ *	is cancelled
+ */
+static struct worker_pool {
+	struct worker workers[WQ_MAX_WORKERS];
+	unsigned int n_workers;
+	unsigned int next;
+	int n_queued;
+	int n_idle;
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	pthread_cond_t done;
+} wq_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.more = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_once_t wq_pool_once = PTHREAD_ONCE_INIT;
+
+/* The worker the current thread is, if it is one */
+static __thread struct worker *wq_self;
+
+static void wq_queue(struct worker *worker, struct work *w)
+{
+	pthread_mutex_lock(&worker->lock);
+	dl_list_add_tail(&worker->queue, &w->entry);
+	__atomic_store_n(&w->worker, worker, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&wq_pool.n_queued, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&worker->lock);
+
+	/* Pairs with the check of n_queued in wq_worker() */
+	if (!__atomic_load_n(&wq_pool.n_idle, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&wq_pool.lock);
+	pthread_cond_signal(&wq_pool.more);
+	pthread_mutex_unlock(&wq_pool.lock);
+}
+
+/* Takes w off the queue of worker, if it still is on it */
+static bool wq_dequeue(struct worker *worker, struct work *w)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&worker->lock);
+	if (w->worker == worker) {
+		dl_list_del(&w->entry);
+		__atomic_store_n(&w->worker, NULL, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&wq_pool.n_queued, 1, __ATOMIC_SEQ_CST);
+		__atomic_and_fetch(&w->state, ~WORK_PENDING, __ATOMIC_SEQ_CST);
+		found = true;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	/* Its callback never runs, flush_work() is waiting for nothing */
+	if (found) {
+		pthread_mutex_lock(&wq_pool.lock);
+		pthread_cond_broadcast(&wq_pool.done);
+		pthread_mutex_unlock(&wq_pool.lock);
+	}
+
+	return found;
+}
+
+/*
+ * Takes the newest work off the queue of worker if it is the calling
+ * worker's own, the oldest one otherwise, and marks it running.
+ */
+static struct work *wq_take(struct worker *worker, bool own)
+{
+	struct dl_list *entry;
+	struct work *w;
+
+	pthread_mutex_lock(&worker->lock);
+	if (dl_list_empty(&worker->queue)) {
+		pthread_mutex_unlock(&worker->lock);
+		return NULL;
+	}
+
+	entry = own ? worker->queue.prev : worker->queue.next;
+	w = dl_list_entry(entry, struct work, entry);
+	dl_list_del(&w->entry);
+	__atomic_store_n(&w->worker, NULL, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&wq_pool.n_queued, 1, __ATOMIC_SEQ_CST);
+
+	/*
+	 * Whoever schedules the work from here on has it run again. Pairs
+	 * with the one in schedule_work().
+	 */
+	__atomic_exchange_n(&w->state, WORK_RUNNING, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&worker->lock);
+
+	return w;
+}
+
+static struct work *wq_pick(struct worker *self)
 {
-	pthread_mutex_lock(&w->mutex);
-	pthread_cond_signal(&w->cond);
-	pthread_mutex_unlock(&w->mutex);
+	unsigned int i, n_workers, start;
+	struct work *w;
+
+	w = wq_take(self, true);
+	if (w)
+		return w;
+
+	n_workers = __atomic_load_n(&wq_pool.n_workers, __ATOMIC_ACQUIRE);
+	start = self - wq_pool.workers;
+
+	for (i = 1; i < n_workers; i++) {
+		if (!__atomic_load_n(&wq_pool.n_queued, __ATOMIC_RELAXED))
+			break;
+		w = wq_take(&wq_pool.workers[(start + i) % n_workers], false);
+		if (w)
+			return w;
+	}
+
+	return NULL;
 }
 
-void cancel_work_sync(struct work *w)
+static void wq_run(struct worker *self, struct work *w)
 {
-	pthread_exit(NULL);
+	unsigned int state = WORK_RUNNING;
+
+	w->work_cb(w->arg);
+
+	while (!__atomic_compare_exchange_n(&w->state, &state,
+					    state & ~WORK_RUNNING, false,
+					    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		;
+
+	/* Scheduled while it ran, it was left for us to queue */
+	if (state & WORK_PENDING)
+		wq_queue(self, w);
+
+	pthread_mutex_lock(&wq_pool.lock);
+	pthread_cond_broadcast(&wq_pool.done);
+	pthread_mutex_unlock(&wq_pool.lock);
 }
 
-void *run_work(void *arg)
+static void *wq_worker(void *arg)
 {
+	struct worker *self = arg;
 	struct work *w;
-	int r;
 
-	w = (struct work *) arg;
+	wq_self = self;
+
+	while (true) {
+		w = wq_pick(self);
+		if (w) {
+			wq_run(self, w);
+			continue;
+		}
+
+		pthread_mutex_lock(&wq_pool.lock);
+		__atomic_add_fetch(&wq_pool.n_idle, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&wq_pool.n_queued, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&wq_pool.more, &wq_pool.lock);
+		__atomic_sub_fetch(&wq_pool.n_idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&wq_pool.lock);
+	}
+
+	return NULL;
+}
+
+static void wq_pool_start(void)
+{
+	struct worker *worker;
+	long n_cpus;
+	unsigned int i, n;
+
+	n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = n_cpus > WQ_MAX_WORKERS ? WQ_MAX_WORKERS : n_cpus;
+	if (n < WQ_MIN_WORKERS)
+		n = WQ_MIN_WORKERS;
+
+	for (i = 0; i < n; i++) {
+		worker = &wq_pool.workers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		dl_list_init(&worker->queue);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&wq_pool.workers[i].thread, NULL,
+				   wq_worker, &wq_pool.workers[i]))
+			break;
+		__atomic_store_n(&wq_pool.n_workers, i + 1, __ATOMIC_RELEASE);
+	}
+
+	BUG_ON(!wq_pool.n_workers);
+}
+
+/* Waits until none of the bits in mask are set on w anymore */
+static bool wq_wait(struct work *w, unsigned int mask)
+{
+	bool waited = false;
+
+	pthread_mutex_lock(&wq_pool.lock);
+	while (__atomic_load_n(&w->state, __ATOMIC_ACQUIRE) & mask) {
+		pthread_cond_wait(&wq_pool.done, &wq_pool.lock);
+		waited = true;
+	}
+	pthread_mutex_unlock(&wq_pool.lock);
+
+	return waited;
+}
+
+void init_work(struct work *w)
+{
+	pthread_once(&wq_pool_once, wq_pool_start);
+
+	w->state = 0;
+	w->worker = NULL;
+	dl_list_init(&w->entry);
+}
+
+/**
+ * schedule_work - have a work run on the worker pool
+ * @w: the work
+ *
+ * Works scheduled from a worker go to that worker's queue, others are
+ * spread over all workers. Scheduling a work which is pending already
+ * does nothing, its callback runs once for all of them. A work scheduled
+ * while its callback runs is run again afterwards, on the same worker,
+ * so a work's callback never runs on two workers at once.
+ *
+ * Returns %false if the work was pending already, %true otherwise.
+ */
+bool schedule_work(struct work *w)
+{
+	struct worker *worker;
+	unsigned int state;
+
+	pthread_once(&wq_pool_once, wq_pool_start);
+
+	/* Pairs with the one in wq_take() */
+	state = __atomic_fetch_or(&w->state, WORK_PENDING, __ATOMIC_SEQ_CST);
+	if (state & WORK_PENDING)
+		return false;
+
+	/* The worker running it queues it once it is done */
+	if (state & WORK_RUNNING)
+		return true;
+
+	worker = wq_self;
+	if (!worker)
+		worker = &wq_pool.workers[__atomic_fetch_add(&wq_pool.next, 1,
+							     __ATOMIC_RELAXED) %
+					  __atomic_load_n(&wq_pool.n_workers,
+							  __ATOMIC_ACQUIRE)];
+
+	wq_queue(worker, w);
 
-	pthread_mutex_lock(&w->mutex);
+	return true;
+}
+
+/**
+ * flush_work - wait for a work to be done
+ * @w: the work
+ *
+ * Waits until the work is neither pending nor running anymore. Must not
+ * be called from the work's own callback.
+ *
+ * Returns %true if it had to wait, %false if the work was idle.
+ */
+bool flush_work(struct work *w)
+{
+	return wq_wait(w, WORK_PENDING | WORK_RUNNING);
+}
+
+/**
+ * cancel_work_sync - cancel a work and wait for it to be done
+ * @w: the work
+ *
+ * A pending work is taken off its queue without its callback being run,
+ * if the callback is running already this waits for it to return. Unless
+ * it is scheduled again the work is idle afterwards. Must not be called
+ * from the work's own callback.
+ *
+ * Returns %true if the work was pending, %false otherwise.
+ */
+bool cancel_work_sync(struct work *w)
+{
+	struct worker *worker;
+	unsigned int state;
+	bool pending = false;
 
 	while (true) {
-		if (!w->ready)
-			w->ready = true;
-		r = pthread_cond_wait(&w->cond, &w->mutex);
-		if (r != 0) {
-			printf("(%s)\n", strerror(r));
-			BUG_ON(r);
+		state = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+		if (!(state & WORK_PENDING))
+			break;
+
+		/* Not on a queue, the worker running it would queue it */
+		if (state & WORK_RUNNING) {
+			if (__atomic_compare_exchange_n(&w->state, &state,
+							WORK_RUNNING, false,
+							__ATOMIC_SEQ_CST,
+							__ATOMIC_SEQ_CST)) {
+				pending = true;
+				break;
+			}
+			continue;
 		}
-		w->work_cb(w->arg);
+
+		worker = __atomic_load_n(&w->worker, __ATOMIC_ACQUIRE);
+		if (worker && wq_dequeue(worker, w)) {
+			pending = true;
+			break;
+		}
+
+		/* Being put on or taken off a queue right now */
+		sched_yield();
 	}
 
-	pthread_mutex_unlock(&w->mutex);
+	wq_wait(w, WORK_RUNNING);
 
-	pthread_exit(NULL);
+	return pending;
 }
@@ -5,7 +5,7 @@
 #include <time.h>
 
 #include <os/mutex.h>
-#include <os/spinlock.h>
+#include <os/slab.h>
 #include <os/workqueue.h>
 
 #include "reg.h"
@@ -13,7 +13,9 @@
 #include "comm.h"
 
 static struct mutex regcore_mutex;
-static spinlock_t reg_requests_lock;
+
+/* Where all regulatory requests come from, hint storms included */
+static struct kmem_cache *reg_request_cache;
 
 void *reg_todo(void *arg);
 static DECLARE_WORK(reg_work, reg_todo);
@@ -45,25 +47,19 @@ static void send_reg_change_event(struct regulatory_request *request)
 	return;
 }
 
-static void reg_process_next_hint(void)
+static void free_request(struct regulatory_request *request)
 {
-	struct regulatory_request *request;
-
-	spin_lock(&reg_requests_lock);
-	request = reglib_next_request();
-	spin_unlock(&reg_requests_lock);
-
-	if (!request)
-		return;
-
-	reglib_process_hint(request);
+	kmem_cache_free(reg_request_cache, request);
 }
 
 static void reg_process_pending_hints(void)
 {
-
+	/*
+	 * Hints queued while we are at it schedule reg_work again, so we
+	 * are back for any not found in the queue yet.
+	 */
 	mutex_lock(&regcore_mutex);
-	reg_process_next_hint();
+	reglib_process_hints();
 	mutex_unlock(&regcore_mutex);
 }
 
@@ -77,25 +73,34 @@ void *reg_todo(void *arg)
 	reg_process_pending_hints();
 	reg_process_pending_beacon_hints();
 
-	pthread_exit(NULL);
+	return NULL;
 }
 
-static void queue_regulatory_request(struct regulatory_request *request)
+static int queue_regulatory_request(struct regulatory_request *request)
 {
+	int r;
+
 	if (isalpha(request->alpha2[0]))
 		request->alpha2[0] = toupper(request->alpha2[0]);
 	if (isalpha(request->alpha2[1]))
 		request->alpha2[1] = toupper(request->alpha2[1]);
 
 	/*
-	 * We use spin_lock for reg_requests_lock as the core request
-	 * cannot hold a mutex as __init work in kernel barfs at that.
+	 * Queueing takes no lock, as the core request cannot hold a mutex
+	 * as __init work in kernel barfs at that.
 	 */
-	spin_lock(&reg_requests_lock);
-	reglib_queue_request(request);
-	spin_unlock(&reg_requests_lock);
+	r = reglib_queue_request(request);
+	if (r) {
+		free_request(request);
+		/* A request just like it is queued already */
+		if (r == -EALREADY)
+			return 0;
+		return r;
+	}
 
 	schedule_work(&reg_work);
+
+	return 0;
 }
 
 /*
@@ -106,27 +111,105 @@ static int regulatory_hint_core(const char *alpha2)
 {
 	struct regulatory_request *request;
 
-	request = malloc(sizeof(struct regulatory_request));
+	request = kmem_cache_zalloc(reg_request_cache);
 	if (!request)
 		return -ENOMEM;
-	memset(request, 0, sizeof(struct regulatory_request));
 
 	request->alpha2[0] = alpha2[0];
 	request->alpha2[1] = alpha2[1];
 	request->initiator = IEEE80211_REGDOM_SET_BY_CORE;
 
-	queue_regulatory_request(request);
-	return 0;
+	return queue_regulatory_request(request);
 }
 
 static struct regcore_ops ops = {
 	.call_crda = call_crda,
 	.send_reg_change_event = send_reg_change_event,
+	.free_request = free_request,
 };
 
+/*
+ * This is where CRDA hands us the regulatory domain we asked it for
+ * through call_crda().
+ */
+int regulatory_set_regdom(const struct ieee80211_regdomain *rd)
+{
+	int r;
+
+	mutex_lock(&regcore_mutex);
+	r = reglib_set_regdom(rd);
+	mutex_unlock(&regcore_mutex);
+
+	return r;
+}
+
+/*
+ * CRDA calls this once it has published a reloaded database, see
+ * reglib_reload_regdom().
+ */
+int regulatory_reload_regdom(reglib_regd_find_fn find, void *priv)
+{
+	int r;
+
+	mutex_lock(&regcore_mutex);
+	r = reglib_reload_regdom(find, priv);
+	mutex_unlock(&regcore_mutex);
+
+	return r;
+}
+
+/*
+ * Has CRDA pick up changes to its database and switch the regulatory
+ * core over to them, as userspace asking for the database to be reloaded
+ * would. The switch over takes regcore_mutex, so do not hold it.
+ */
+int regulatory_reload_db(void)
+{
+	int r;
+
+	r = comm_reload_db();
+	/* Without a database there are only the domains of db.txt */
+	if (r == -ENOENT)
+		return 0;
+
+	return r;
+}
+
+int regulatory_set_queue_params(enum ieee80211_reg_initiator initiator,
+				const struct reglib_queue_params *params)
+{
+	int r;
+
+	mutex_lock(&regcore_mutex);
+	r = reglib_set_queue_params(initiator, params);
+	mutex_unlock(&regcore_mutex);
+
+	return r;
+}
+
+/*
+ * Updating a device writes the shared channel cache and the device's TX
+ * table, which the regulatory core's workers may be writing as well.
+ */
 void regdev_update(struct ieee80211_dev_regulatory *reg)
 {
+	mutex_lock(&regcore_mutex);
 	reglib_regdev_update(reg, IEEE80211_REGDOM_SET_BY_CORE);
+	mutex_unlock(&regcore_mutex);
+}
+
+void regdev_register(struct ieee80211_dev_regulatory *reg)
+{
+	mutex_lock(&regcore_mutex);
+	reglib_regdev_register(reg);
+	mutex_unlock(&regcore_mutex);
+}
+
+void regdev_unregister(struct ieee80211_dev_regulatory *reg)
+{
+	mutex_lock(&regcore_mutex);
+	reglib_regdev_unregister(reg);
+	mutex_unlock(&regcore_mutex);
 }
 
 int regulatory_init(void)
@@ -134,10 +217,14 @@ int regulatory_init(void)
 	int r = 0;
 
 	mutex_init(&regcore_mutex);
-	spin_lock_init(&reg_requests_lock);
 
 	init_work(&reg_work);
 
+	reg_request_cache = kmem_cache_create("regulatory_request",
+					      sizeof(struct regulatory_request));
+	if (!reg_request_cache)
+		return -ENOMEM;
+
 	r = reglib_core_init(&ops);
 	if (r)
 		return r;
@@ -151,15 +238,56 @@ int regulatory_init(void)
 
 void regulatory_exit(void)
 {
+	/* Let the hints queued so far, and the CRDA runs they need, finish */
+	flush_work(&reg_work);
+	comm_flush();
 	cancel_work_sync(&reg_work);
 
+	reglib_core_exit();
+
+	kmem_cache_destroy(reg_request_cache);
+	reg_request_cache = NULL;
+
 	mutex_destroy(&regcore_mutex);
-	spin_lock_destroy(&reg_requests_lock);
 }
 
-void reg_core_test(void)
+int reg_core_test(void)
 {
+	int r;
+
+	/* The queue tests need the core hint out of the queues */
+	flush_work(&reg_work);
+
 	mutex_lock(&regcore_mutex);
 	test_regdoms();
+	r = test_reg_queues(reg_request_cache);
+	if (!r)
+		r = test_tx();
+	if (!r)
+		r = test_acs();
+	if (!r)
+		r = test_intersect();
+	if (!r)
+		r = test_reload();
 	mutex_unlock(&regcore_mutex);
+
+	if (!r)
+		r = test_regdb_compact();
+
+	return r;
+}
+
+/*
+ * Tests which keep lots of threads busy for a while, only run when
+ * asked for, see the stress target of the Makefile.
+ */
+int reg_stress_test(void)
+{
+	int r;
+
+	r = test_workqueue();
+	if (!r)
+		r = test_rcu();
+
+	return r;
 }
@@ -3,9 +3,17 @@
 
 #include "reglib.h"
 
-void reg_core_test(void);
+int reg_core_test(void);
+int reg_stress_test(void);
 int regulatory_init(void);
 void regulatory_exit(void);
+int regulatory_set_regdom(const struct ieee80211_regdomain *rd);
+int regulatory_reload_regdom(reglib_regd_find_fn find, void *priv);
+int regulatory_reload_db(void);
+int regulatory_set_queue_params(enum ieee80211_reg_initiator initiator,
+				const struct reglib_queue_params *params);
 void regdev_update(struct ieee80211_dev_regulatory *reg);
+void regdev_register(struct ieee80211_dev_regulatory *reg);
+void regdev_unregister(struct ieee80211_dev_regulatory *reg);
 
 #endif /* __NET_REG_H */
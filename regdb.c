@@ -0,0 +1,1595 @@
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "regdb.h"
+#include "reglib-index.h"
+
+/**
+ * struct regdb - a loaded regulatory database
+ *
+ * @data: the mapping of the database file
+ * @size: size of @data
+ * @n_countries: number of entries in @countries
+ * @countries: the country directory, within @data
+ */
+struct regdb {
+	const uint8_t *data;
+	size_t size;
+	uint32_t n_countries;
+	const struct regdb_file_country *countries;
+	/* For each alpha2 slot 1 + the index of its country, 0 for none */
+	uint16_t slots[REGDB_ALPHA2_SLOTS];
+};
+
+/* Whether a table of n elements of size bytes at off is within the file */
+static bool regdb_in_file(const struct regdb *db, uint64_t off,
+			  uint64_t n, size_t size)
+{
+	return off <= db->size && n * size <= db->size - off;
+}
+
+/*
+ * Makes sure lookups never leave the mapping. The rules themselves are
+ * left to reglib_set_regdom(), which validates every domain applied.
+ */
+static int regdb_check(const struct regdb *db)
+{
+	const struct regdb_file_header *hdr;
+	const struct regdb_file_country *country;
+	const struct ieee80211_regdomain *rd;
+	unsigned int i;
+
+	if (db->size < sizeof(struct regdb_file_header))
+		return -EINVAL;
+
+	hdr = (const struct regdb_file_header *) db->data;
+	if (hdr->magic != REGDB_MAGIC || hdr->version != REGDB_VERSION)
+		return -EINVAL;
+
+	if (hdr->regd_size != sizeof(struct ieee80211_regdomain) ||
+	    hdr->rule_size != sizeof(struct ieee80211_reg_rule))
+		return -EINVAL;
+
+	if (hdr->countries_off % sizeof(uint32_t) ||
+	    !regdb_in_file(db, hdr->countries_off, hdr->n_countries,
+			   sizeof(struct regdb_file_country)))
+		return -EINVAL;
+
+	country = (const struct regdb_file_country *)
+		(db->data + hdr->countries_off);
+
+	for (i = 0; i < hdr->n_countries; i++, country++) {
+		if (i && memcmp(country[-1].alpha2, country->alpha2, 2) >= 0)
+			return -EINVAL;
+
+		if (regdb_alpha2_slot(country->alpha2) < 0)
+			return -EINVAL;
+
+		if (country->regd_off % REGDB_ALIGN ||
+		    !regdb_in_file(db, country->regd_off, 1,
+				   sizeof(struct ieee80211_regdomain)))
+			return -EINVAL;
+
+		rd = (const struct ieee80211_regdomain *)
+			(db->data + country->regd_off);
+		if (rd->index ||
+		    memcmp(rd->alpha2, country->alpha2, 2) ||
+		    rd->n_reg_rules > REGLIB_MAX_REG_RULES ||
+		    !regdb_in_file(db, country->regd_off +
+				   sizeof(struct ieee80211_regdomain),
+				   rd->n_reg_rules,
+				   sizeof(struct ieee80211_reg_rule)))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * regdb_load - map a regulatory database
+ * @path: the database file
+ * @db: set to the database
+ *
+ * The file is mapped read only and its directory checked so that any
+ * lookup stays within it, nothing else is read up front. Pages of the
+ * file get read in as the domains in them are used.
+ *
+ * Returns 0 on success, -EINVAL if the file is not a database this host
+ * can use or another negative error code if it can not be mapped.
+ */
+int regdb_load(const char *path, struct regdb **db)
+{
+	struct regdb *new_db;
+	struct stat st;
+	unsigned int i;
+	void *data;
+	int fd, r;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	if (!st.st_size) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	r = -errno;
+	close(fd);
+	if (data == MAP_FAILED)
+		return r;
+
+	new_db = malloc(sizeof(struct regdb));
+	if (!new_db) {
+		munmap(data, st.st_size);
+		return -ENOMEM;
+	}
+
+	new_db->data = data;
+	new_db->size = st.st_size;
+
+	r = regdb_check(new_db);
+	if (r) {
+		regdb_free(new_db);
+		return r;
+	}
+
+	new_db->n_countries =
+		((const struct regdb_file_header *) data)->n_countries;
+	new_db->countries = (const struct regdb_file_country *)
+		(new_db->data +
+		 ((const struct regdb_file_header *) data)->countries_off);
+
+	/*
+	 * The directory is sorted and checked, so there are no more
+	 * countries than slots and each has a slot of its own.
+	 */
+	memset(new_db->slots, 0, sizeof(new_db->slots));
+	for (i = 0; i < new_db->n_countries; i++)
+		new_db->slots[regdb_alpha2_slot(new_db->countries[i].alpha2)] =
+			i + 1;
+
+	*db = new_db;
+	return 0;
+}
+
+void regdb_free(struct regdb *db)
+{
+	if (!db)
+		return;
+
+	munmap((void *) db->data, db->size);
+	free(db);
+}
+
+unsigned int regdb_n_countries(const struct regdb *db)
+{
+	return db->n_countries;
+}
+
+/**
+ * regdb_find - look up the regulatory domain of a country
+ * @db: the database
+ * @alpha2: the ISO / IEC 3166 alpha2, or one of the special codes
+ *
+ * Returns the regulatory domain within the mapping of @db, valid until
+ * @db is freed, or %NULL if @db has none for @alpha2.
+ */
+const struct ieee80211_regdomain *regdb_find(const struct regdb *db,
+					     const char *alpha2)
+{
+	int slot = regdb_alpha2_slot(alpha2);
+
+	if (slot < 0 || !db->slots[slot])
+		return NULL;
+
+	return (const struct ieee80211_regdomain *)
+		(db->data + db->countries[db->slots[slot] - 1].regd_off);
+}
+
+/*
+ * The compiler below turns a wireless-regdb style db.txt into a database.
+ * It reads the input line by line and writes out each country as soon as
+ * its last rule has been read, all it keeps in memory are the rules of
+ * the country at hand and the directory entries.
+ */
+
+/**
+ * struct regdb_compiler - state of regdb_compile()
+ *
+ * @out: where the database goes
+ * @off: the file offset the next write to @out ends up at
+ * @rd: the country being read, with room for %REGLIB_MAX_REG_RULES rules
+ * @in_country: whether @rd is a country being read
+ * @n_countries: number of entries in @countries
+ * @countries: the directory entries of the countries written so far
+ * @seen: for each alpha2 slot whether its country has been read
+ */
+struct regdb_compiler {
+	FILE *out;
+	uint32_t off;
+	struct ieee80211_regdomain *rd;
+	bool in_country;
+	uint32_t n_countries;
+	struct regdb_file_country countries[REGDB_ALPHA2_SLOTS];
+	bool seen[REGDB_ALPHA2_SLOTS];
+};
+
+static const struct {
+	const char *name;
+	uint32_t flag;
+} regdb_flags[] = {
+	{ "NO-OFDM", IEEE80211_RRF_NO_OFDM },
+	{ "NO-CCK", IEEE80211_RRF_NO_CCK },
+	{ "NO-INDOOR", IEEE80211_RRF_NO_INDOOR },
+	{ "NO-OUTDOOR", IEEE80211_RRF_NO_OUTDOOR },
+	{ "DFS", IEEE80211_RRF_DFS },
+	{ "PTP-ONLY", IEEE80211_RRF_PTP_ONLY },
+	{ "PTMP-ONLY", IEEE80211_RRF_PTMP_ONLY },
+	{ "PASSIVE-SCAN", IEEE80211_RRF_PASSIVE_SCAN },
+	{ "NO-IR", IEEE80211_RRF_NO_IR },
+	/* Older databases split NO-IR in two */
+	{ "NO-IBSS", IEEE80211_RRF_NO_IR },
+	/* We have no use for these but they are valid */
+	{ "AUTO-BW", 0 },
+	{ "wmmrule=ETSI", 0 },
+};
+
+static int regdb_write(struct regdb_compiler *c, const void *data, size_t len)
+{
+	if ((uint64_t) c->off + len > UINT32_MAX)
+		return -EFBIG;
+
+	if (len && fwrite(data, len, 1, c->out) != 1)
+		return -EIO;
+
+	c->off += len;
+	return 0;
+}
+
+static int regdb_write_pad(struct regdb_compiler *c, unsigned int align)
+{
+	static const uint8_t zeroes[REGDB_ALIGN];
+
+	return regdb_write(c, zeroes, (align - c->off % align) % align);
+}
+
+/* Writes out the country read last, if any */
+static int regdb_country_end(struct regdb_compiler *c)
+{
+	struct regdb_file_country *country;
+	int r;
+
+	if (!c->in_country)
+		return 0;
+
+	c->in_country = false;
+
+	if (!c->rd->n_reg_rules)
+		return -EINVAL;
+
+	r = regdb_write_pad(c, REGDB_ALIGN);
+	if (r)
+		return r;
+
+	country = &c->countries[c->n_countries++];
+	memset(country, 0, sizeof(struct regdb_file_country));
+	memcpy(country->alpha2, c->rd->alpha2, 2);
+	country->regd_off = c->off;
+
+	return regdb_write(c, c->rd, sizeof(struct ieee80211_regdomain) +
+			   c->rd->n_reg_rules *
+			   sizeof(struct ieee80211_reg_rule));
+}
+
+/* "country XX: ..." */
+static int regdb_country_start(struct regdb_compiler *c, const char *line)
+{
+	int slot, r;
+
+	r = regdb_country_end(c);
+	if (r)
+		return r;
+
+	line += strlen("country");
+	while (*line == ' ' || *line == '\t')
+		line++;
+
+	slot = regdb_alpha2_slot(line);
+	if (slot < 0 || line[2] != ':')
+		return -EINVAL;
+
+	if (c->seen[slot])
+		return -EEXIST;
+	c->seen[slot] = true;
+
+	memset(c->rd, 0, sizeof(struct ieee80211_regdomain));
+	memcpy(c->rd->alpha2, line, 2);
+	c->in_country = true;
+
+	return 0;
+}
+
+static const char *regdb_skip_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+	return p;
+}
+
+/* Parses a number, returns what follows it or NULL if there is none */
+static const char *regdb_parse_num(const char *p, double *val)
+{
+	char *end;
+
+	p = regdb_skip_space(p);
+	*val = strtod(p, &end);
+	if (end == p || *val < 0)
+		return NULL;
+
+	return regdb_skip_space(end);
+}
+
+/* Skips an expected character and the space following it */
+static const char *regdb_expect(const char *p, char c)
+{
+	if (!p)
+		return NULL;
+
+	p = regdb_skip_space(p);
+	if (*p != c)
+		return NULL;
+
+	return regdb_skip_space(p + 1);
+}
+
+/* Power in mW as mBm, powers below 1 mW do not make sense here */
+static uint32_t regdb_mw_to_mbm(double mw)
+{
+	if (mw <= 1)
+		return 0;
+
+	return (uint32_t) (DBM_TO_MBM(10 * log10(mw)) + 0.5);
+}
+
+/* A power of either "dBm" or "mW mW" */
+static const char *regdb_parse_eirp(const char *p, uint32_t *eirp)
+{
+	double val;
+
+	p = regdb_parse_num(p, &val);
+	if (!p)
+		return NULL;
+
+	if (!strncmp(p, "mW", 2)) {
+		*eirp = regdb_mw_to_mbm(val);
+		return regdb_skip_space(p + 2);
+	}
+
+	*eirp = DBM_TO_MBM(val) + 0.5;
+	return p;
+}
+
+/*
+ * "(start - end @ bw), (eirp)[, FLAG...]" with frequencies in MHz and
+ * EIRP in dBm or mW, or "(gain, eirp)" with the antenna gain in dBi or
+ * N/A as older databases have it.
+ */
+static int regdb_parse_rule(const char *p, struct ieee80211_reg_rule *rule)
+{
+	struct ieee80211_freq_range *fr = &rule->freq_range;
+	struct ieee80211_power_rule *pr = &rule->power_rule;
+	double start, end, bw, gain;
+	const char *q;
+	size_t len;
+	unsigned int i;
+
+	memset(rule, 0, sizeof(struct ieee80211_reg_rule));
+
+	p = regdb_expect(p, '(');
+	if (p)
+		p = regdb_expect(regdb_parse_num(p, &start), '-');
+	if (p)
+		p = regdb_expect(regdb_parse_num(p, &end), '@');
+	if (p)
+		p = regdb_expect(regdb_parse_num(p, &bw), ')');
+	p = regdb_expect(regdb_expect(p, ','), '(');
+	if (!p)
+		return -EINVAL;
+
+	fr->start_freq_khz = MHZ_TO_KHZ(start) + 0.5;
+	fr->end_freq_khz = MHZ_TO_KHZ(end) + 0.5;
+	fr->max_bandwidth_khz = MHZ_TO_KHZ(bw) + 0.5;
+
+	if (!strncmp(p, "N/A", 3))
+		p = regdb_expect(p + 3, ',');
+	else {
+		q = regdb_parse_num(p, &gain);
+		if (q && *q == ',') {
+			pr->max_antenna_gain = DBI_TO_MBI(gain) + 0.5;
+			p = q + 1;
+		}
+	}
+	if (p)
+		p = regdb_expect(regdb_parse_eirp(p, &pr->max_eirp), ')');
+	if (!p)
+		return -EINVAL;
+
+	while (*p == ',') {
+		p = regdb_skip_space(p + 1);
+		len = strcspn(p, ", \t");
+		for (i = 0; i < ARRAY_SIZE(regdb_flags); i++) {
+			if (strlen(regdb_flags[i].name) == len &&
+			    !strncmp(p, regdb_flags[i].name, len))
+				break;
+		}
+		if (!len || i == ARRAY_SIZE(regdb_flags))
+			return -EINVAL;
+		rule->flags |= regdb_flags[i].flag;
+		p = regdb_skip_space(p + len);
+	}
+
+	if (*p)
+		return -EINVAL;
+
+	if (!reglib_is_valid_reg_rule(rule))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int regdb_country_cmp(const void *a, const void *b)
+{
+	const struct regdb_file_country *ca = a, *cb = b;
+
+	return memcmp(ca->alpha2, cb->alpha2, 2);
+}
+
+/* Writes the directory and fills in the header now that all is known */
+static int regdb_finish(struct regdb_compiler *c)
+{
+	struct regdb_file_header hdr;
+	int r;
+
+	r = regdb_write_pad(c, sizeof(uint32_t));
+	if (r)
+		return r;
+
+	qsort(c->countries, c->n_countries, sizeof(struct regdb_file_country),
+	      regdb_country_cmp);
+
+	memset(&hdr, 0, sizeof(struct regdb_file_header));
+	hdr.magic = REGDB_MAGIC;
+	hdr.version = REGDB_VERSION;
+	hdr.regd_size = sizeof(struct ieee80211_regdomain);
+	hdr.rule_size = sizeof(struct ieee80211_reg_rule);
+	hdr.n_countries = c->n_countries;
+	hdr.countries_off = c->off;
+
+	r = regdb_write(c, c->countries,
+			c->n_countries * sizeof(struct regdb_file_country));
+	if (r)
+		return r;
+
+	if (fseek(c->out, 0, SEEK_SET) ||
+	    fwrite(&hdr, sizeof(struct regdb_file_header), 1, c->out) != 1 ||
+	    fflush(c->out))
+		return -EIO;
+
+	return 0;
+}
+
+static int regdb_compile_line(struct regdb_compiler *c, char *line,
+			      bool *in_wmmrule)
+{
+	const char *p;
+	int r;
+
+	line[strcspn(line, "#\r\n")] = '\0';
+	p = regdb_skip_space(line);
+	if (!*p)
+		return 0;
+
+	if (!strncmp(p, "country", 7) && (p[7] == ' ' || p[7] == '\t')) {
+		*in_wmmrule = false;
+		return regdb_country_start(c, p);
+	}
+
+	/* WMM rules have nothing we use, skip all of their section */
+	if (!strncmp(p, "wmmrule", 7) && (p[7] == ' ' || p[7] == '\t')) {
+		*in_wmmrule = true;
+		return regdb_country_end(c);
+	}
+
+	if (*in_wmmrule)
+		return 0;
+
+	if (!c->in_country || *p != '(')
+		return -EINVAL;
+
+	if (c->rd->n_reg_rules == REGLIB_MAX_REG_RULES)
+		return -ENOSPC;
+
+	r = regdb_parse_rule(p, &c->rd->reg_rules[c->rd->n_reg_rules]);
+	if (r)
+		return r;
+
+	c->rd->n_reg_rules++;
+	return 0;
+}
+
+/**
+ * regdb_compile - compile a db.txt into a regulatory database
+ * @in: the wireless-regdb style db.txt
+ * @out: where the database goes, has to be seekable
+ * @err_line: set to the line of @in compilation failed at, 0 if the
+ *	failure was not due to a line in particular
+ *
+ * Reads @in in a single pass, each rule is checked just as
+ * reglib_is_valid_rd() would. The database can be loaded with
+ * regdb_load() right away.
+ *
+ * Returns 0 on success, -EINVAL if @in is not a valid db.txt, -EEXIST
+ * if it has a country twice, -ENOSPC if it has too many countries or
+ * rules or -EIO if writing @out fails.
+ */
+int regdb_compile(FILE *in, FILE *out, unsigned int *err_line)
+{
+	struct regdb_compiler *c;
+	struct regdb_file_header hdr;
+	char line[REGDB_MAX_LINE];
+	bool in_wmmrule = false;
+	unsigned int n_line = 0;
+	int r;
+
+	*err_line = 0;
+
+	c = malloc(sizeof(struct regdb_compiler));
+	if (!c)
+		return -ENOMEM;
+	memset(c, 0, sizeof(struct regdb_compiler));
+
+	c->out = out;
+	c->rd = malloc(sizeof(struct ieee80211_regdomain) +
+		       REGLIB_MAX_REG_RULES * sizeof(struct ieee80211_reg_rule));
+	if (!c->rd) {
+		free(c);
+		return -ENOMEM;
+	}
+
+	/* The header is filled in last */
+	memset(&hdr, 0, sizeof(struct regdb_file_header));
+	r = regdb_write(c, &hdr, sizeof(struct regdb_file_header));
+
+	while (!r && fgets(line, sizeof(line), in)) {
+		n_line++;
+		if (!strchr(line, '\n') && !feof(in))
+			r = -EINVAL;
+		else
+			r = regdb_compile_line(c, line, &in_wmmrule);
+		if (r)
+			*err_line = n_line;
+	}
+
+	if (!r && ferror(in))
+		r = -EIO;
+
+	if (!r) {
+		r = regdb_country_end(c);
+		if (r)
+			*err_line = n_line;
+	}
+
+	if (!r)
+		r = regdb_finish(c);
+
+	free(c->rd);
+	free(c);
+
+	return r;
+}
+
+/*
+ * The generator below turns a database into C sources with a static
+ * regulatory domain for each country, laid out just like the built in
+ * world_regdom, along with the index reglib_index_regd() would build
+ * for it. Nothing is left to do at run time.
+ */
+
+static void regdb_gen_bitmap(FILE *out, const struct reglib_chan_bitmap *map)
+{
+	unsigned int i;
+
+	fprintf(out, "{ .bits = {");
+	for (i = 0; i < REGLIB_CHAN_BITMAP_WORDS; i++)
+		fprintf(out, " 0x%llxULL,", (unsigned long long) map->bits[i]);
+	fprintf(out, " } }");
+}
+
+static void regdb_gen_index(FILE *out, const char *name,
+			    const struct reglib_regd_index *index)
+{
+	const struct reglib_index_entry *entry;
+	const struct reglib_segment *seg;
+	const struct reglib_chan_avail *avail;
+	enum ieee80211_band band;
+	unsigned int i, n_entries = 0;
+	int k;
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+		n_entries += index->bands[band].n_entries;
+
+	fprintf(out, "static const struct reglib_index_entry %s_entries[] = {\n",
+		name);
+	for (i = 0; i < n_entries; i++) {
+		entry = &index->entries[i];
+		fprintf(out, "\t{ %u, %u, %u, %u },\n",
+			entry->start_freq_khz, entry->end_freq_khz,
+			entry->max_end_khz, entry->rule_idx);
+	}
+	fprintf(out, "};\n\n");
+
+	if (index->n_segments) {
+		fprintf(out, "static const struct reglib_segment %s_segments[] = {\n",
+			name);
+		for (i = 0; i < index->n_segments; i++) {
+			seg = &index->segments[i];
+			fprintf(out, "\t{ %u, %u, {", seg->start_freq_khz,
+				seg->end_freq_khz);
+			for (k = 0; k < REGLIB_NUM_BWS; k++)
+				fprintf(out, " %d,", seg->best_rule[k]);
+			fprintf(out, " } },\n");
+		}
+		fprintf(out, "};\n\n");
+	}
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		if (!index->chan_rules[band])
+			continue;
+		fprintf(out, "static const uint32_t %s_chan_rules_%u[REGLIB_NUM_CHANS] = {\n",
+			name, band);
+		for (i = 0; i < REGLIB_NUM_CHANS; i++)
+			if (index->chan_rules[band][i])
+				fprintf(out, "\t[%u] = 0x%x,\n", i,
+					index->chan_rules[band][i]);
+		fprintf(out, "};\n\n");
+	}
+
+	fprintf(out, "static const struct reglib_regd_index %s_index = {\n", name);
+	fprintf(out, "\t.bands = {\n");
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+		fprintf(out, "\t\t[%u] = { %u, &%s_entries[%u] },\n", band,
+			index->bands[band].n_entries, name,
+			(unsigned int) (index->bands[band].by_start -
+					index->entries));
+	fprintf(out, "\t},\n");
+	fprintf(out, "\t.entries = %s_entries,\n", name);
+	fprintf(out, "\t.n_segments = %u,\n", index->n_segments);
+	if (index->n_segments)
+		fprintf(out, "\t.segments = %s_segments,\n", name);
+	fprintf(out, "\t.chans = {\n");
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		avail = &index->chans[band];
+		fprintf(out, "\t\t[%u] = {\n\t\t\t.primary = {\n", band);
+		for (k = 0; k < REGLIB_NUM_BWS; k++) {
+			fprintf(out, "\t\t\t\t");
+			regdb_gen_bitmap(out, &avail->primary[k]);
+			fprintf(out, ",\n");
+		}
+		fprintf(out, "\t\t\t},\n\t\t\t.ht40plus = ");
+		regdb_gen_bitmap(out, &avail->ht40plus);
+		fprintf(out, ",\n\t\t\t.ht40minus = ");
+		regdb_gen_bitmap(out, &avail->ht40minus);
+		fprintf(out, ",\n\t\t},\n");
+	}
+	fprintf(out, "\t},\n");
+	fprintf(out, "\t.chan_rules = {\n");
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+		if (index->chan_rules[band])
+			fprintf(out, "\t\t[%u] = %s_chan_rules_%u,\n",
+				band, name, band);
+	fprintf(out, "\t},\n");
+	fprintf(out, "\t.precomputed = true,\n");
+	fprintf(out, "};\n\n");
+}
+
+static int regdb_gen_regd(FILE *out, const struct ieee80211_regdomain *src)
+{
+	const struct ieee80211_reg_rule *rule;
+	struct ieee80211_regdomain *rd;
+	char name[32];
+	size_t size;
+	unsigned int i;
+	int r;
+
+	size = sizeof(struct ieee80211_regdomain) +
+		src->n_reg_rules * sizeof(struct ieee80211_reg_rule);
+	rd = malloc(size);
+	if (!rd)
+		return -ENOMEM;
+	memcpy(rd, src, size);
+	rd->index = NULL;
+
+	r = reglib_index_regd(rd);
+	if (r) {
+		free(rd);
+		return r;
+	}
+
+	snprintf(name, sizeof(name), "regdb_static_%c%c",
+		 rd->alpha2[0], rd->alpha2[1]);
+
+	regdb_gen_index(out, name, rd->index);
+
+	fprintf(out, "static const struct ieee80211_regdomain %s = {\n", name);
+	fprintf(out, "\t.n_reg_rules = %u,\n", rd->n_reg_rules);
+	fprintf(out, "\t.alpha2 = \"%c%c\",\n", rd->alpha2[0], rd->alpha2[1]);
+	fprintf(out, "\t.index = &%s_index,\n", name);
+	fprintf(out, "\t.reg_rules = {\n");
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		rule = &rd->reg_rules[i];
+		fprintf(out, "\t\t{ { %u, %u, %u }, { %u, %u }, 0x%x },\n",
+			rule->freq_range.start_freq_khz,
+			rule->freq_range.end_freq_khz,
+			rule->freq_range.max_bandwidth_khz,
+			rule->power_rule.max_antenna_gain,
+			rule->power_rule.max_eirp,
+			rule->flags);
+	}
+	fprintf(out, "\t}\n};\n\n");
+
+	reglib_unindex_regd(rd);
+	free(rd);
+
+	return 0;
+}
+
+/**
+ * regdb_gen_c - generate C sources for a regulatory database
+ * @db: the database
+ * @out: where the sources go
+ *
+ * The sources have a static const regulatory domain for each country of
+ * @db, with its lookup index precomputed, and define regdb_static_find()
+ * to look them up by alpha2.
+ *
+ * Returns 0 on success, -EIO if writing @out failed or -ENOMEM.
+ */
+int regdb_gen_c(const struct regdb *db, FILE *out)
+{
+	const struct ieee80211_regdomain *rd;
+	unsigned int i;
+	int r;
+
+	fprintf(out, "/* Generated by regdbc, do not edit */\n\n");
+	fprintf(out, "#include \"regdb.h\"\n");
+	fprintf(out, "#include \"reglib-index.h\"\n\n");
+
+	for (i = 0; i < db->n_countries; i++) {
+		rd = (const struct ieee80211_regdomain *)
+			(db->data + db->countries[i].regd_off);
+		r = regdb_gen_regd(out, rd);
+		if (r)
+			return r;
+	}
+
+	fprintf(out, "static const struct ieee80211_regdomain *const regdb_static_regdoms[] = {\n");
+	for (i = 0; i < db->n_countries; i++)
+		fprintf(out, "\t&regdb_static_%c%c,\n",
+			db->countries[i].alpha2[0],
+			db->countries[i].alpha2[1]);
+	fprintf(out, "};\n\n");
+
+	/* 1 + the index into regdb_static_regdoms[] of each slot's country */
+	fprintf(out, "static const uint16_t regdb_static_slots[REGDB_ALPHA2_SLOTS] = {\n");
+	for (i = 0; i < db->n_countries; i++)
+		fprintf(out, "\t[%d] = %u,\n",
+			regdb_alpha2_slot(db->countries[i].alpha2), i + 1);
+	fprintf(out, "};\n\n");
+
+	fprintf(out,
+		"const struct ieee80211_regdomain *regdb_static_find(const char *alpha2)\n"
+		"{\n"
+		"\tint slot = regdb_alpha2_slot(alpha2);\n"
+		"\n"
+		"\tif (slot < 0 || !regdb_static_slots[slot])\n"
+		"\t\treturn NULL;\n"
+		"\n"
+		"\treturn regdb_static_regdoms[regdb_static_slots[slot] - 1];\n"
+		"}\n");
+
+	if (fflush(out) || ferror(out))
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * The compact database, see regdb.h for the format. Rules are decoded
+ * one at a time into a struct ieee80211_reg_rule on the stack, which
+ * lets lookups share the rule matching of the regulatory library.
+ */
+
+#define REGDB_COMPACT_HDR_SIZE	6
+#define REGDB_COMPACT_DIR_SIZE	4
+
+struct regdb_compact_writer {
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+};
+
+static int regdb_put_u8(struct regdb_compact_writer *w, uint8_t v)
+{
+	if (w->len >= w->size)
+		return -ENOSPC;
+	w->buf[w->len++] = v;
+	return 0;
+}
+
+static void regdb_set_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static uint16_t regdb_get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static int regdb_put_varint(struct regdb_compact_writer *w, uint32_t v)
+{
+	int r;
+
+	while (v >= 0x80) {
+		r = regdb_put_u8(w, (v & 0x7f) | 0x80);
+		if (r)
+			return r;
+		v >>= 7;
+	}
+
+	return regdb_put_u8(w, v);
+}
+
+static int regdb_get_varint(const uint8_t **pos, const uint8_t *end,
+			    uint32_t *v)
+{
+	uint32_t val = 0;
+	unsigned int shift;
+	uint8_t b;
+
+	for (shift = 0; shift < 32; shift += 7) {
+		if (*pos >= end)
+			return -EINVAL;
+		b = *(*pos)++;
+		val |= (uint32_t) (b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = val;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* Whole dB, which almost all power values are, take a byte less */
+static uint32_t regdb_power_code(uint32_t mbm)
+{
+	if (!(mbm % 100))
+		return mbm / 100 << 1;
+	return mbm << 1 | 1;
+}
+
+static uint32_t regdb_power_decode(uint32_t code)
+{
+	if (code & 1)
+		return code >> 1;
+	return (code >> 1) * 100;
+}
+
+static int regdb_compact_put_rule(struct regdb_compact_writer *w,
+				  const struct ieee80211_reg_rule *rule,
+				  uint32_t *prev_end)
+{
+	const struct ieee80211_freq_range *fr = &rule->freq_range;
+	const struct ieee80211_power_rule *pr = &rule->power_rule;
+	uint32_t start, end;
+	int32_t delta;
+	int r;
+
+	if (fr->start_freq_khz % 1000 || fr->end_freq_khz % 1000 ||
+	    fr->max_bandwidth_khz % 1000)
+		return -ERANGE;
+	if (pr->max_antenna_gain > INT32_MAX || pr->max_eirp > INT32_MAX)
+		return -ERANGE;
+
+	start = KHZ_TO_MHZ(fr->start_freq_khz);
+	end = KHZ_TO_MHZ(fr->end_freq_khz);
+	delta = (int32_t) start - (int32_t) *prev_end;
+	*prev_end = end;
+
+	/* zigzag, so that small steps back take a byte too */
+	r = regdb_put_varint(w, (uint32_t) delta << 1 ^ (uint32_t) (delta >> 31));
+	if (!r)
+		r = regdb_put_varint(w, end - start);
+	if (!r)
+		r = regdb_put_varint(w, KHZ_TO_MHZ(fr->max_bandwidth_khz));
+	if (!r)
+		r = regdb_put_varint(w, regdb_power_code(pr->max_antenna_gain));
+	if (!r)
+		r = regdb_put_varint(w, regdb_power_code(pr->max_eirp));
+	if (!r)
+		r = regdb_put_varint(w, rule->flags);
+
+	return r;
+}
+
+static int regdb_compact_get_rule(const uint8_t **pos, const uint8_t *end,
+				  uint32_t *prev_end,
+				  struct ieee80211_reg_rule *rule)
+{
+	uint32_t delta, width, bw, gain, eirp, flags;
+	int64_t start;
+	int r;
+
+	r = regdb_get_varint(pos, end, &delta);
+	if (!r)
+		r = regdb_get_varint(pos, end, &width);
+	if (!r)
+		r = regdb_get_varint(pos, end, &bw);
+	if (!r)
+		r = regdb_get_varint(pos, end, &gain);
+	if (!r)
+		r = regdb_get_varint(pos, end, &eirp);
+	if (!r)
+		r = regdb_get_varint(pos, end, &flags);
+	if (r)
+		return r;
+
+	start = (int64_t) *prev_end + (int32_t) (delta >> 1 ^ -(delta & 1));
+	if (start < 0 || start + width > KHZ_TO_MHZ(UINT32_MAX) ||
+	    bw > KHZ_TO_MHZ(UINT32_MAX))
+		return -EINVAL;
+	*prev_end = start + width;
+
+	rule->freq_range.start_freq_khz = MHZ_TO_KHZ(start);
+	rule->freq_range.end_freq_khz = MHZ_TO_KHZ(start + width);
+	rule->freq_range.max_bandwidth_khz = MHZ_TO_KHZ(bw);
+	rule->power_rule.max_antenna_gain = regdb_power_decode(gain);
+	rule->power_rule.max_eirp = regdb_power_decode(eirp);
+	rule->flags = flags;
+
+	return 0;
+}
+
+static int regdb_compact_put_regd(struct regdb_compact_writer *w,
+				  const struct ieee80211_regdomain *rd)
+{
+	uint32_t prev_end = 0;
+	unsigned int i;
+	int r;
+
+	r = regdb_put_varint(w, rd->n_reg_rules);
+	for (i = 0; !r && i < rd->n_reg_rules; i++)
+		r = regdb_compact_put_rule(w, &rd->reg_rules[i], &prev_end);
+
+	return r;
+}
+
+/**
+ * regdb_compact_encode - encode a database in the compact format
+ * @db: the database
+ * @buf: where the compact database goes
+ * @size: size of @buf
+ * @len: set to the size of the compact database on success
+ *
+ * Returns 0 on success, -ENOSPC if @buf is too small or the compact
+ * database would be larger than %REGDB_COMPACT_MAX_SIZE, -ERANGE if a
+ * rule has a frequency which is not a whole MHz or -ENOMEM.
+ */
+int regdb_compact_encode(const struct regdb *db, uint8_t *buf, size_t size,
+			 size_t *len)
+{
+	struct regdb_compact_writer w;
+	const struct ieee80211_regdomain *rd;
+	uint16_t *offs;
+	size_t *lens, start;
+	unsigned int i, j;
+	int r = 0;
+
+	if (db->n_countries > UINT16_MAX)
+		return -ENOSPC;
+
+	w.buf = buf;
+	w.size = size < REGDB_COMPACT_MAX_SIZE ? size : REGDB_COMPACT_MAX_SIZE;
+	w.len = REGDB_COMPACT_HDR_SIZE +
+		db->n_countries * REGDB_COMPACT_DIR_SIZE;
+	if (w.len > w.size)
+		return -ENOSPC;
+
+	offs = malloc(db->n_countries * sizeof(*offs) + 1);
+	lens = malloc(db->n_countries * sizeof(*lens) + 1);
+	if (!offs || !lens) {
+		free(offs);
+		free(lens);
+		return -ENOMEM;
+	}
+
+	buf[0] = 'R';
+	buf[1] = 'C';
+	buf[2] = REGDB_COMPACT_VERSION;
+	buf[3] = 0;
+	regdb_set_le16(&buf[4], db->n_countries);
+
+	for (i = 0; !r && i < db->n_countries; i++) {
+		rd = (const struct ieee80211_regdomain *)
+			(db->data + db->countries[i].regd_off);
+
+		start = w.len;
+		r = regdb_compact_put_regd(&w, rd);
+		if (r)
+			break;
+
+		offs[i] = start;
+		lens[i] = w.len - start;
+
+		/* Countries with the same rules share them */
+		for (j = 0; j < i; j++) {
+			if (lens[j] == lens[i] &&
+			    !memcmp(&buf[offs[j]], &buf[start], lens[i])) {
+				offs[i] = offs[j];
+				w.len = start;
+				break;
+			}
+		}
+
+		memcpy(&buf[REGDB_COMPACT_HDR_SIZE +
+			    i * REGDB_COMPACT_DIR_SIZE],
+		       db->countries[i].alpha2, 2);
+		regdb_set_le16(&buf[REGDB_COMPACT_HDR_SIZE +
+				    i * REGDB_COMPACT_DIR_SIZE + 2], offs[i]);
+	}
+
+	free(offs);
+	free(lens);
+
+	if (!r)
+		*len = w.len;
+
+	return r;
+}
+
+/* Makes sure the rules of @regd decode into a valid regulatory domain */
+static int regdb_compact_check(const struct regdb_compact_regd *regd)
+{
+	const uint8_t *pos = regd->rules;
+	struct ieee80211_reg_rule rule;
+	uint32_t n_rules, prev_end = 0, i;
+	int r;
+
+	r = regdb_get_varint(&pos, regd->end, &n_rules);
+	if (r)
+		return r;
+	if (!n_rules || n_rules > REGLIB_MAX_REG_RULES)
+		return -EINVAL;
+
+	for (i = 0; i < n_rules; i++) {
+		r = regdb_compact_get_rule(&pos, regd->end, &prev_end, &rule);
+		if (r)
+			return r;
+		if (!reglib_is_valid_reg_rule(&rule))
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * regdb_compact_find - look up a country in a compact database
+ * @blob: the compact database
+ * @size: its size
+ * @alpha2: the ISO / IEC 3166 alpha2, or one of the special codes
+ * @regd: set to the country's regulatory domain on success
+ *
+ * The header, the directory and the country's rules are checked, lookups
+ * on @regd can rely on them. @regd points into @blob.
+ *
+ * Returns 0 on success, -ENOENT if @blob has no regulatory domain for
+ * @alpha2 or -EINVAL if @blob is not a valid compact database.
+ */
+int regdb_compact_find(const uint8_t *blob, size_t size, const char *alpha2,
+		       struct regdb_compact_regd *regd)
+{
+	const uint8_t *entry;
+	unsigned int lo = 0, hi, mid;
+	uint16_t off;
+	int cmp;
+
+	if (size < REGDB_COMPACT_HDR_SIZE || blob[0] != 'R' ||
+	    blob[1] != 'C' || blob[2] != REGDB_COMPACT_VERSION)
+		return -EINVAL;
+
+	hi = regdb_get_le16(&blob[4]);
+	if (hi * REGDB_COMPACT_DIR_SIZE > size - REGDB_COMPACT_HDR_SIZE)
+		return -EINVAL;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		entry = &blob[REGDB_COMPACT_HDR_SIZE +
+			      mid * REGDB_COMPACT_DIR_SIZE];
+		cmp = memcmp(alpha2, entry, 2);
+		if (!cmp) {
+			off = regdb_get_le16(&entry[2]);
+			if (off >= size)
+				return -EINVAL;
+			memcpy(regd->alpha2, entry, 2);
+			regd->rules = &blob[off];
+			regd->end = &blob[size];
+			return regdb_compact_check(regd);
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * regdb_compact_freq_info - look up the rule for a frequency
+ * @regd: the regulatory domain, from regdb_compact_find()
+ * @center_freq: center frequency in kHz
+ * @target_eirp_mbm: the lowest EIRP the rule has to allow
+ * @desired_bw_khz: width of the channel, 0 for 20 MHz
+ * @rule: set to the rule on success
+ *
+ * Works like reglib_freq_info_regd() does on the expanded domain,
+ * except that the rule is returned by value.
+ *
+ * Returns 0 on success, -ERANGE if no rule is in the band of
+ * @center_freq or -EINVAL if no rule in the band fits the channel.
+ */
+int regdb_compact_freq_info(const struct regdb_compact_regd *regd,
+			    uint32_t center_freq,
+			    int target_eirp_mbm,
+			    uint32_t desired_bw_khz,
+			    struct ieee80211_reg_rule *rule)
+{
+	const uint8_t *pos = regd->rules;
+	struct ieee80211_reg_rule rr;
+	uint32_t n_rules, prev_end = 0, i;
+	bool band_rule_found = false;
+	int r;
+
+	if (!desired_bw_khz)
+		desired_bw_khz = MHZ_TO_KHZ(20);
+
+	r = regdb_get_varint(&pos, regd->end, &n_rules);
+	if (r)
+		return r;
+
+	for (i = 0; i < n_rules; i++) {
+		r = regdb_compact_get_rule(&pos, regd->end, &prev_end, &rr);
+		if (r)
+			return r;
+
+		if (!band_rule_found)
+			band_rule_found =
+				reglib_freq_in_rule_band(&rr.freq_range,
+							 center_freq);
+
+		if (band_rule_found &&
+		    reglib_does_bw_fit(&rr.freq_range, center_freq,
+				       desired_bw_khz) &&
+		    target_eirp_mbm <= rr.power_rule.max_eirp) {
+			*rule = rr;
+			return 0;
+		}
+	}
+
+	if (!band_rule_found)
+		return -ERANGE;
+
+	return -EINVAL;
+}
+
+/**
+ * regdb_compact_expand - expand a regulatory domain
+ * @regd: the regulatory domain, from regdb_compact_find()
+ * @rd: set to the expanded domain on success, for the caller to free()
+ *
+ * This is for handing the domain to the regulatory core, all of whose
+ * lookups are on expanded domains. regdb_compact_freq_info() looks up
+ * a rule without expanding the domain.
+ *
+ * Returns 0 on success, -EINVAL if @regd does not decode or -ENOMEM.
+ */
+int regdb_compact_expand(const struct regdb_compact_regd *regd,
+			 struct ieee80211_regdomain **rd)
+{
+	const uint8_t *pos = regd->rules;
+	struct ieee80211_regdomain *new_rd;
+	uint32_t n_rules, prev_end = 0, i;
+	int r;
+
+	r = regdb_get_varint(&pos, regd->end, &n_rules);
+	if (r)
+		return r;
+	if (n_rules > REGLIB_MAX_REG_RULES)
+		return -EINVAL;
+
+	new_rd = malloc(sizeof(struct ieee80211_regdomain) +
+			n_rules * sizeof(struct ieee80211_reg_rule));
+	if (!new_rd)
+		return -ENOMEM;
+	memset(new_rd, 0, sizeof(struct ieee80211_regdomain));
+
+	new_rd->n_reg_rules = n_rules;
+	memcpy(new_rd->alpha2, regd->alpha2, 2);
+
+	for (i = 0; i < n_rules; i++) {
+		r = regdb_compact_get_rule(&pos, regd->end, &prev_end,
+					   &new_rd->reg_rules[i]);
+		if (r) {
+			free(new_rd);
+			return r;
+		}
+	}
+
+	*rd = new_rd;
+	return 0;
+}
+
+/**
+ * regdb_compact_load - read a compact database
+ * @path: the compact database file
+ * @blob: set to the compact database, for the caller to free()
+ * @size: set to its size
+ *
+ * Unlike a database a compact one is small enough to be read into
+ * memory. Each country is checked the way regdb_compact_find() does, so
+ * that a country which does not decode is caught here rather than on its
+ * first lookup.
+ *
+ * Returns 0 on success, -EINVAL if the file is not a valid compact
+ * database or another negative error code if it can not be read.
+ */
+int regdb_compact_load(const char *path, uint8_t **blob, size_t *size)
+{
+	struct regdb_compact_regd regd;
+	const uint8_t *entry;
+	unsigned int i, n_countries;
+	uint8_t *buf;
+	struct stat st;
+	ssize_t len;
+	size_t done;
+	int fd, r;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	if (st.st_size < REGDB_COMPACT_HDR_SIZE ||
+	    st.st_size > REGDB_COMPACT_MAX_SIZE) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	buf = malloc(st.st_size);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	for (done = 0; done < (size_t) st.st_size; done += len) {
+		len = read(fd, buf + done, st.st_size - done);
+		if (len <= 0) {
+			r = len ? -errno : -EINVAL;
+			close(fd);
+			free(buf);
+			return r;
+		}
+	}
+	close(fd);
+
+	r = 0;
+	n_countries = regdb_get_le16(&buf[4]);
+	if (buf[0] != 'R' || buf[1] != 'C' ||
+	    buf[2] != REGDB_COMPACT_VERSION ||
+	    n_countries * REGDB_COMPACT_DIR_SIZE >
+	    st.st_size - REGDB_COMPACT_HDR_SIZE)
+		r = -EINVAL;
+
+	/* Lookups bisect the directory, it has to be sorted */
+	for (i = 0; !r && i < n_countries; i++) {
+		entry = &buf[REGDB_COMPACT_HDR_SIZE +
+			     i * REGDB_COMPACT_DIR_SIZE];
+		if (regdb_alpha2_slot((const char *) entry) < 0 ||
+		    (i && memcmp(&entry[-REGDB_COMPACT_DIR_SIZE], entry,
+				 2) >= 0))
+			r = -EINVAL;
+		else
+			r = regdb_compact_find(buf, st.st_size,
+					       (const char *) entry, &regd);
+	}
+
+	if (r) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	*blob = buf;
+	*size = st.st_size;
+	return 0;
+}
+
+unsigned int regdb_compact_n_countries(const uint8_t *blob)
+{
+	return regdb_get_le16(&blob[4]);
+}
+
+/*
+ * The bulk validator below checks all regulatory domains of a database
+ * before it is published. The countries are spread over several threads,
+ * the problems found are reported afterwards in directory order.
+ */
+
+/* Countries a worker of regdb_validate() takes on at a time */
+#define REGDB_VALIDATE_BATCH	16
+
+/**
+ * struct regdb_problems - the problems found with one country
+ *
+ * @problems: the problems, in the order they were found
+ * @n_problems: number of entries in @problems
+ * @size: number of entries @problems has room for
+ */
+struct regdb_problems {
+	struct regdb_problem *problems;
+	unsigned int n_problems;
+	unsigned int size;
+};
+
+/**
+ * struct regdb_validate_job - the work shared by regdb_validate()'s workers
+ *
+ * @db: the database
+ * @results: the problems of each country of @db
+ * @next: the next country no worker has taken on yet
+ * @failed: set if a worker ran out of memory
+ */
+struct regdb_validate_job {
+	const struct regdb *db;
+	struct regdb_problems *results;
+	unsigned int next;
+	bool failed;
+};
+
+static const char *const regdb_problem_strs[] = {
+	[REGDB_PROBLEM_NO_RULES] = "has no rules",
+	[REGDB_PROBLEM_TOO_MANY_RULES] = "has too many rules",
+	[REGDB_PROBLEM_BAD_RULE] = "has an invalid frequency range or bandwidth",
+	[REGDB_PROBLEM_SPANS_BANDS] = "spans several bands",
+	[REGDB_PROBLEM_TOO_NARROW] = "allows no channel of any width",
+	[REGDB_PROBLEM_SHADOWED] = "is never used since another rule covers it",
+};
+
+const char *regdb_problem_str(enum regdb_problem_type type)
+{
+	return regdb_problem_strs[type];
+}
+
+static int regdb_add_problem(struct regdb_problems *res, const char *alpha2,
+			     enum regdb_problem_type type, int rule,
+			     int other_rule)
+{
+	struct regdb_problem *problem;
+	unsigned int size;
+
+	if (res->n_problems == res->size) {
+		size = res->size ? res->size * 2 : 4;
+		problem = realloc(res->problems,
+				  size * sizeof(struct regdb_problem));
+		if (!problem)
+			return -ENOMEM;
+		res->problems = problem;
+		res->size = size;
+	}
+
+	problem = &res->problems[res->n_problems++];
+	memcpy(problem->alpha2, alpha2, 2);
+	problem->type = type;
+	problem->rule = rule;
+	problem->other_rule = other_rule;
+
+	return 0;
+}
+
+/*
+ * Whether rule1 makes rule2 pointless when it comes first: lookups pick
+ * the first rule a channel fits in allowing the EIRP asked for, and any
+ * channel fitting rule2 fits rule1, which allows at least as much.
+ */
+static bool regdb_rule_covers(const struct ieee80211_reg_rule *rule1,
+			      const struct ieee80211_reg_rule *rule2)
+{
+	return rule1->freq_range.start_freq_khz <=
+		rule2->freq_range.start_freq_khz &&
+	       rule1->freq_range.end_freq_khz >=
+		rule2->freq_range.end_freq_khz &&
+	       rule1->freq_range.max_bandwidth_khz >=
+		rule2->freq_range.max_bandwidth_khz &&
+	       rule1->power_rule.max_eirp >= rule2->power_rule.max_eirp;
+}
+
+/*
+ * Each rule is checked against those before it, so the cost for a domain
+ * is bounded by the square of %REGLIB_MAX_REG_RULES.
+ */
+static int regdb_validate_regd(const struct ieee80211_regdomain *rd,
+			       struct regdb_problems *res)
+{
+	const struct ieee80211_reg_rule *rule;
+	const struct ieee80211_freq_range *fr;
+	unsigned int i, j;
+	int r = 0;
+
+	if (!rd->n_reg_rules)
+		return regdb_add_problem(res, rd->alpha2,
+					 REGDB_PROBLEM_NO_RULES, -1, -1);
+	if (rd->n_reg_rules > REGLIB_MAX_REG_RULES)
+		return regdb_add_problem(res, rd->alpha2,
+					 REGDB_PROBLEM_TOO_MANY_RULES, -1, -1);
+
+	for (i = 0; !r && i < rd->n_reg_rules; i++) {
+		rule = &rd->reg_rules[i];
+		fr = &rule->freq_range;
+
+		if (!reglib_is_valid_reg_rule(rule)) {
+			r = regdb_add_problem(res, rd->alpha2,
+					      REGDB_PROBLEM_BAD_RULE, i, -1);
+			continue;
+		}
+
+		if (reglib_freq_to_band(fr->start_freq_khz) !=
+		    reglib_freq_to_band(fr->end_freq_khz - 1))
+			r = regdb_add_problem(res, rd->alpha2,
+					      REGDB_PROBLEM_SPANS_BANDS, i, -1);
+
+		if (!r && fr->max_bandwidth_khz < REGLIB_BW_KHZ(REGLIB_BW_5))
+			r = regdb_add_problem(res, rd->alpha2,
+					      REGDB_PROBLEM_TOO_NARROW, i, -1);
+
+		for (j = 0; !r && j < i; j++) {
+			if (!reglib_is_valid_reg_rule(&rd->reg_rules[j]) ||
+			    !regdb_rule_covers(&rd->reg_rules[j], rule))
+				continue;
+			r = regdb_add_problem(res, rd->alpha2,
+					      REGDB_PROBLEM_SHADOWED, i, j);
+			break;
+		}
+	}
+
+	return r;
+}
+
+static void *regdb_validate_worker(void *arg)
+{
+	struct regdb_validate_job *job = arg;
+	const struct regdb *db = job->db;
+	const struct ieee80211_regdomain *rd;
+	unsigned int i, end;
+
+	while (true) {
+		i = __atomic_fetch_add(&job->next, REGDB_VALIDATE_BATCH,
+				       __ATOMIC_RELAXED);
+		if (i >= db->n_countries)
+			break;
+
+		end = i + REGDB_VALIDATE_BATCH;
+		if (end > db->n_countries)
+			end = db->n_countries;
+
+		for (; i < end; i++) {
+			rd = (const struct ieee80211_regdomain *)
+				(db->data + db->countries[i].regd_off);
+			if (regdb_validate_regd(rd, &job->results[i]))
+				__atomic_store_n(&job->failed, true,
+						 __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * regdb_validate - check all regulatory domains of a database
+ * @db: the database
+ * @n_threads: number of threads to use including the calling one, 0 for
+ *	one per online CPU
+ * @report: called for each problem found, in the order of the countries
+ *	in @db and of the rules in each of them, from the calling thread.
+ *	May be %NULL.
+ * @priv: passed to @report
+ *
+ * Beyond what reglib_is_valid_rd() checks, rules spanning several bands,
+ * rules allowing no channel of any width and rules no lookup can ever
+ * end up with are found. All problems of all countries are reported.
+ *
+ * Returns the number of problems found or -ENOMEM.
+ */
+int regdb_validate(const struct regdb *db, unsigned int n_threads,
+		   regdb_problem_fn report, void *priv)
+{
+	struct regdb_validate_job job = {
+		.db = db,
+		.next = 0,
+		.failed = false,
+	};
+	pthread_t threads[64];
+	unsigned int i, j, n_started = 0;
+	int n_problems = 0;
+	long n_cpus;
+
+	job.results = calloc(db->n_countries + 1,
+			     sizeof(struct regdb_problems));
+	if (!job.results)
+		return -ENOMEM;
+
+	if (!n_threads) {
+		n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n_cpus > 0 ? n_cpus : 1;
+	}
+	if (n_threads > (db->n_countries + REGDB_VALIDATE_BATCH - 1) /
+			REGDB_VALIDATE_BATCH)
+		n_threads = (db->n_countries + REGDB_VALIDATE_BATCH - 1) /
+			REGDB_VALIDATE_BATCH;
+	if (n_threads > ARRAY_SIZE(threads) + 1)
+		n_threads = ARRAY_SIZE(threads) + 1;
+
+	for (i = 1; i < n_threads; i++) {
+		if (pthread_create(&threads[n_started], NULL,
+				   regdb_validate_worker, &job))
+			break;
+		n_started++;
+	}
+
+	regdb_validate_worker(&job);
+
+	for (i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < db->n_countries; i++) {
+		for (j = 0; report && j < job.results[i].n_problems; j++)
+			report(&job.results[i].problems[j], priv);
+		n_problems += job.results[i].n_problems;
+		free(job.results[i].problems);
+	}
+	free(job.results);
+
+	if (job.failed)
+		return -ENOMEM;
+
+	return n_problems;
+}
@@ -0,0 +1,218 @@
+#ifndef __REGDB_H
+#define __REGDB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "reglib.h"
+
+/*
+ * Binary regulatory database
+ *
+ * The database is a file which is mapped into memory and read in place,
+ * much like wireless-regdb's regulatory.bin. Unlike regulatory.bin the
+ * regulatory domains in it are laid out exactly as a
+ * struct ieee80211_regdomain is in memory so that lookups hand out
+ * pointers right into the mapping. All integers are in host byte order,
+ * a database is only good for hosts with the same ABI as the one which
+ * wrote it, the header records enough of it for the loader to tell.
+ *
+ * The file consists of:
+ *
+ *	struct regdb_file_header
+ *	struct regdb_file_country[n_countries], sorted by alpha2
+ *	the regulatory domains, each a struct ieee80211_regdomain with
+ *	its rules, aligned to REGDB_ALIGN
+ */
+
+#define REGDB_MAGIC	0x52474442	/* "RGDB" */
+#define REGDB_VERSION	1
+#define REGDB_ALIGN	8
+
+/**
+ * struct regdb_file_header - what a database file starts with
+ *
+ * @magic: %REGDB_MAGIC
+ * @version: %REGDB_VERSION
+ * @regd_size: sizeof(struct ieee80211_regdomain) of the writer
+ * @rule_size: sizeof(struct ieee80211_reg_rule) of the writer
+ * @n_countries: number of entries in the country directory
+ * @countries_off: file offset of the country directory
+ */
+struct regdb_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t regd_size;
+	uint32_t rule_size;
+	uint32_t n_countries;
+	uint32_t countries_off;
+};
+
+/**
+ * struct regdb_file_country - an entry of the country directory
+ *
+ * @alpha2: the ISO / IEC 3166 alpha2, or one of the special codes
+ * @reserved: must be 0
+ * @regd_off: file offset of the country's regulatory domain, its index
+ *	pointer must be %NULL and its alpha2 the same as @alpha2
+ */
+struct regdb_file_country {
+	char alpha2[2];
+	uint16_t reserved;
+	uint32_t regd_off;
+};
+
+/*
+ * The characters of an alpha2 are digits or upper case letters, which
+ * includes the special codes 00, 97, 98 and 99. Numbering all such
+ * alpha2 gives a perfect hash of them, so a lookup in a directory of
+ * countries is a single probe of a table with %REGDB_ALPHA2_SLOTS slots.
+ */
+#define REGDB_ALPHA2_SLOTS	(36 * 36)
+
+static inline int regdb_alpha2_char_code(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* The slot of @alpha2, or -1 if it is not a valid alpha2 */
+static inline int regdb_alpha2_slot(const char *alpha2)
+{
+	int hi = regdb_alpha2_char_code(alpha2[0]);
+	int lo = regdb_alpha2_char_code(alpha2[1]);
+
+	if (hi < 0 || lo < 0)
+		return -1;
+
+	return hi * 36 + lo;
+}
+
+/* Longest line of a db.txt regdb_compile() takes */
+#define REGDB_MAX_LINE	1024
+
+struct regdb;
+
+int regdb_load(const char *path, struct regdb **db);
+void regdb_free(struct regdb *db);
+unsigned int regdb_n_countries(const struct regdb *db);
+const struct ieee80211_regdomain *regdb_find(const struct regdb *db,
+					     const char *alpha2);
+/**
+ * enum regdb_problem_type - what regdb_validate() finds wrong with a domain
+ *
+ * @REGDB_PROBLEM_NO_RULES: the domain has no rules
+ * @REGDB_PROBLEM_TOO_MANY_RULES: the domain has more than
+ *	%REGLIB_MAX_REG_RULES rules
+ * @REGDB_PROBLEM_BAD_RULE: the rule's frequency range is empty or
+ *	narrower than its max bandwidth
+ * @REGDB_PROBLEM_SPANS_BANDS: the rule has frequencies in several bands
+ * @REGDB_PROBLEM_TOO_NARROW: the rule's max bandwidth is below that of
+ *	the narrowest channels
+ * @REGDB_PROBLEM_SHADOWED: an earlier rule allows everything the rule does,
+ *	so no lookup ever ends up with it
+ */
+enum regdb_problem_type {
+	REGDB_PROBLEM_NO_RULES,
+	REGDB_PROBLEM_TOO_MANY_RULES,
+	REGDB_PROBLEM_BAD_RULE,
+	REGDB_PROBLEM_SPANS_BANDS,
+	REGDB_PROBLEM_TOO_NARROW,
+	REGDB_PROBLEM_SHADOWED,
+};
+
+/**
+ * struct regdb_problem - a problem regdb_validate() found
+ *
+ * @alpha2: the country with the problem
+ * @type: what is wrong
+ * @rule: index of the rule with the problem, -1 if it is with the domain
+ * @other_rule: for %REGDB_PROBLEM_SHADOWED the index of the rule covering
+ *	@rule, -1 otherwise
+ */
+struct regdb_problem {
+	char alpha2[2];
+	enum regdb_problem_type type;
+	int rule;
+	int other_rule;
+};
+
+typedef void (*regdb_problem_fn)(const struct regdb_problem *problem,
+				 void *priv);
+
+int regdb_compile(FILE *in, FILE *out, unsigned int *err_line);
+int regdb_gen_c(const struct regdb *db, FILE *out);
+int regdb_validate(const struct regdb *db, unsigned int n_threads,
+		   regdb_problem_fn report, void *priv);
+const char *regdb_problem_str(enum regdb_problem_type type);
+
+/* Defined by the sources regdb_gen_c() generates */
+const struct ieee80211_regdomain *regdb_static_find(const char *alpha2);
+
+/*
+ * Compact regulatory database
+ *
+ * For targets short on memory. A rule takes around 7 bytes instead of
+ * the 24 of a struct ieee80211_reg_rule, and countries with the same
+ * rules share them. The storage is expand-on-use: the regulatory core
+ * only looks up expanded domains, so CRDA expands a country with
+ * regdb_compact_expand() the first time it hands it to the core and
+ * keeps the expanded copy for as long as the database is loaded. Only
+ * the countries used are ever held expanded in memory, and only
+ * regdb_compact_freq_info() looks up rules in the compact form itself.
+ * Unlike the database above the format is byte oriented and the same
+ * on all hosts:
+ *
+ *	"RC", u8 version, u8 reserved, le16 n_countries
+ *	n_countries times, sorted by alpha2:
+ *		char alpha2[2], le16 offset of the country's rules
+ *	the rules of each country:
+ *		varint n_rules
+ *		n_rules times:
+ *			varint start MHz less end MHz of the previous rule,
+ *				zigzag encoded
+ *			varint end MHz less start MHz
+ *			varint max bandwidth MHz
+ *			varint max antenna gain mBi, power encoded
+ *			varint max EIRP mBm, power encoded
+ *			varint flags
+ *
+ * varints are little endian base 128. Power encoded values are value /
+ * 100 << 1 for whole dB and value << 1 | 1 for everything else.
+ */
+
+#define REGDB_COMPACT_VERSION	1
+#define REGDB_COMPACT_MAX_SIZE	65535
+
+/**
+ * struct regdb_compact_regd - a regulatory domain in a compact database
+ *
+ * @alpha2: the alpha2 of the country
+ * @rules: where the country's rules start
+ * @end: end of the compact database
+ */
+struct regdb_compact_regd {
+	char alpha2[2];
+	const uint8_t *rules;
+	const uint8_t *end;
+};
+
+int regdb_compact_encode(const struct regdb *db, uint8_t *buf, size_t size,
+			 size_t *len);
+int regdb_compact_find(const uint8_t *blob, size_t size, const char *alpha2,
+		       struct regdb_compact_regd *regd);
+int regdb_compact_freq_info(const struct regdb_compact_regd *regd,
+			    uint32_t center_freq,
+			    int target_eirp_mbm,
+			    uint32_t desired_bw_khz,
+			    struct ieee80211_reg_rule *rule);
+int regdb_compact_expand(const struct regdb_compact_regd *regd,
+			 struct ieee80211_regdomain **rd);
+int regdb_compact_load(const char *path, uint8_t **blob, size_t *size);
+unsigned int regdb_compact_n_countries(const uint8_t *blob);
+
+#endif /* __REGDB_H */
@@ -0,0 +1,190 @@
+/*
+ * Compiles a wireless-regdb style db.txt into a regsim regulatory database
+ * and, with -c, a regulatory database into C sources regsim is built with
+ * or, with -z, into a compact database. With -v it checks a regulatory
+ * database.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "regdb.h"
+
+static int regdbc_gen_c(const char *db_path, const char *c_path)
+{
+	struct regdb *db;
+	FILE *out;
+	int r;
+
+	r = regdb_load(db_path, &db);
+	if (r) {
+		fprintf(stderr, "%s: %s\n", db_path, strerror(-r));
+		return 1;
+	}
+
+	out = fopen(c_path, "w");
+	if (!out) {
+		fprintf(stderr, "%s: %s\n", c_path, strerror(errno));
+		regdb_free(db);
+		return 1;
+	}
+
+	r = regdb_gen_c(db, out);
+	if (fclose(out) && !r)
+		r = -EIO;
+	regdb_free(db);
+
+	if (r) {
+		fprintf(stderr, "%s: %s\n", c_path, strerror(-r));
+		remove(c_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int regdbc_compact(const char *db_path, const char *out_path)
+{
+	struct regdb *db;
+	uint8_t *buf;
+	size_t len;
+	FILE *out;
+	int r;
+
+	r = regdb_load(db_path, &db);
+	if (r) {
+		fprintf(stderr, "%s: %s\n", db_path, strerror(-r));
+		return 1;
+	}
+
+	buf = malloc(REGDB_COMPACT_MAX_SIZE);
+	if (!buf) {
+		regdb_free(db);
+		return 1;
+	}
+
+	r = regdb_compact_encode(db, buf, REGDB_COMPACT_MAX_SIZE, &len);
+	regdb_free(db);
+	if (r) {
+		fprintf(stderr, "%s: %s\n", db_path, strerror(-r));
+		free(buf);
+		return 1;
+	}
+
+	out = fopen(out_path, "wb");
+	if (!out) {
+		fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+		free(buf);
+		return 1;
+	}
+
+	if (fwrite(buf, 1, len, out) != len)
+		r = -EIO;
+	if (fclose(out) && !r)
+		r = -EIO;
+	free(buf);
+
+	if (r) {
+		fprintf(stderr, "%s: %s\n", out_path, strerror(-r));
+		remove(out_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void regdbc_problem(const struct regdb_problem *problem, void *priv)
+{
+	const char *path = priv;
+
+	fprintf(stderr, "%s: %c%c", path, problem->alpha2[0],
+		problem->alpha2[1]);
+	if (problem->rule >= 0)
+		fprintf(stderr, " rule %d", problem->rule);
+	fprintf(stderr, " %s", regdb_problem_str(problem->type));
+	if (problem->other_rule >= 0)
+		fprintf(stderr, ", rule %d", problem->other_rule);
+	fprintf(stderr, "\n");
+}
+
+static int regdbc_validate(const char *db_path)
+{
+	struct regdb *db;
+	int r;
+
+	r = regdb_load(db_path, &db);
+	if (r) {
+		fprintf(stderr, "%s: %s\n", db_path, strerror(-r));
+		return 1;
+	}
+
+	r = regdb_validate(db, 0, regdbc_problem, (void *) db_path);
+	regdb_free(db);
+
+	if (r < 0) {
+		fprintf(stderr, "%s: %s\n", db_path, strerror(-r));
+		return 1;
+	}
+
+	return r ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s <db.txt> <regulatory.db>\n", prog);
+	fprintf(stderr, "       %s -c <regulatory.db> <regdb-static.c>\n", prog);
+	fprintf(stderr, "       %s -z <regulatory.db> <regulatory.cdb>\n", prog);
+	fprintf(stderr, "       %s -v <regulatory.db>\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	unsigned int err_line;
+	int r;
+
+	if (argc == 4 && !strcmp(argv[1], "-c"))
+		return regdbc_gen_c(argv[2], argv[3]);
+	if (argc == 4 && !strcmp(argv[1], "-z"))
+		return regdbc_compact(argv[2], argv[3]);
+	if (argc == 3 && !strcmp(argv[1], "-v"))
+		return regdbc_validate(argv[2]);
+
+	if (argc != 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	out = fopen(argv[2], "wb");
+	if (!out) {
+		fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+		fclose(in);
+		return 1;
+	}
+
+	r = regdb_compile(in, out, &err_line);
+
+	fclose(in);
+	if (fclose(out) && !r)
+		r = -EIO;
+
+	if (r) {
+		if (err_line)
+			fprintf(stderr, "%s:%u: %s\n", argv[1], err_line,
+				strerror(-r));
+		else
+			fprintf(stderr, "%s: %s\n", argv[2], strerror(-r));
+		remove(argv[2]);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef __REGLIB_INDEX_H
+#define __REGLIB_INDEX_H
+
+#include "reglib.h"
+
+/*
+ * The lookup index reglib_index_regd() attaches to regulatory domains.
+ *
+ * Only the regulatory library and the static regulatory domains regdbc
+ * generates, which come with their index precomputed, need to know
+ * what is in it.
+ */
+
+/* Most rules a domain can have for its index to have chan_rules */
+#define REGLIB_CHAN_RULES_MAX_RULES	32
+
+/**
+ * struct reglib_index_entry - a regulatory rule as seen by the index
+ *
+ * @start_freq_khz: start frequency of the rule
+ * @end_freq_khz: end frequency of the rule
+ * @max_end_khz: the highest end frequency of this and all entries
+ *	sorted before it, used to stop the backwards walk early
+ * @rule_idx: position of the rule in the domain's reg_rules[]
+ */
+struct reglib_index_entry {
+	uint32_t start_freq_khz;
+	uint32_t end_freq_khz;
+	uint32_t max_end_khz;
+	uint32_t rule_idx;
+};
+
+/**
+ * struct reglib_segment - a range of center frequencies with the same rules
+ *
+ * @start_freq_khz: first center frequency of the segment
+ * @end_freq_khz: last center frequency of the segment
+ * @best_rule: for each &enum reglib_bw the index of the rule allowing the
+ *	highest EIRP for a channel of that width centered anywhere in the
+ *	segment, or -1 if no rule fits such a channel
+ */
+struct reglib_segment {
+	uint32_t start_freq_khz;
+	uint32_t end_freq_khz;
+	int32_t best_rule[REGLIB_NUM_BWS];
+};
+
+/**
+ * struct reglib_band_index - the index of the rules in one band
+ *
+ * @n_entries: number of rules with any frequency in the band
+ * @by_start: those rules sorted by start and then end frequency
+ */
+struct reglib_band_index {
+	uint32_t n_entries;
+	const struct reglib_index_entry *by_start;
+};
+
+/**
+ * struct reglib_regd_index - sorted interval index over a regulatory domain
+ *
+ * The rules are partitioned by band so that lookups only ever look at
+ * the rules of the band of the frequency they are for. A rule spanning
+ * several bands is part of each of their partitions.
+ *
+ * @bands: the partitions, indexed by &enum ieee80211_band
+ * @entries: backing storage for all partitions, each partition's entries
+ *	are contiguous
+ * @n_segments: number of segments
+ * @segments: the domain normalized into disjoint, sorted ranges of center
+ *	frequencies, see reg_index_build_segments()
+ * @chans: for each band the channels the domain permits at each width,
+ *	see &struct reglib_chan_avail
+ * @chan_rules: for each band and channel number the rules a 20 MHz
+ *	channel on that channel fits in, as a bitmask of BIT(rule index).
+ *	%NULL for bands without rules and on domains with more than
+ *	%REGLIB_CHAN_RULES_MAX_RULES rules.
+ * @precomputed: set in the indexes regdbc generates. Their domains are
+ *	static, so the regulatory library refers to them rather than
+ *	copying them.
+ */
+struct reglib_regd_index {
+	struct reglib_band_index bands[IEEE80211_NUM_BANDS];
+	const struct reglib_index_entry *entries;
+	uint32_t n_segments;
+	const struct reglib_segment *segments;
+	struct reglib_chan_avail chans[IEEE80211_NUM_BANDS];
+	const uint32_t *chan_rules[IEEE80211_NUM_BANDS];
+	bool precomputed;
+};
+
+#endif /* __REGLIB_INDEX_H */
@@ -5,8 +5,11 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "reglib.h"
+#include "reglib-index.h"
 
 #ifdef CONFIG_REGLIB_DEBUG
 #define REG_DBG_PRINT(format, args...)			\
@@ -15,8 +18,11 @@
 #define REG_DBG_PRINT(args...)
 #endif /* CONFIG_REGLIB_DEBUG */
 
-/* We keep a static world regulatory domain in case of the absence of CRDA */
-static const struct ieee80211_regdomain world_regdom = {
+/*
+ * We keep a static world regulatory domain in case of the absence of CRDA.
+ * This is not const as reglib_core_init() attaches a lookup index to it.
+ */
+static struct ieee80211_regdomain world_regdom = {
 	.n_reg_rules = 5,
 	.alpha2 =  "00",
 	.reg_rules = {
@@ -57,6 +63,110 @@ struct regulatory_request core_request_world = {
 	.country_ie_env = ENVIRON_ANY,
 };
 
+/* Cells of the queue of each initiator, a power of 2 */
+#define REG_REQUEST_QUEUE_SIZE	REGLIB_MAX_QUEUED
+/* The table of queued requests of each initiator has as many entries */
+#define REG_PENDING_BITS	8
+#define REG_PENDING_SIZE	(1 << REG_PENDING_BITS)
+
+/*
+ * The low bits of the state of a &struct reg_pending tell what it is up
+ * to, the others count the changes to it so that readers can tell it was
+ * reused.
+ */
+#define REG_PENDING_FREE	0
+#define REG_PENDING_CLAIMED	1
+#define REG_PENDING_QUEUED	2
+#define REG_PENDING_MASK	3
+#define REG_PENDING_GEN		4
+
+/**
+ * struct reg_pending - who a queued request is from and what it is for
+ *
+ * @state: %REG_PENDING_FREE, %REG_PENDING_CLAIMED while being filled in
+ *	or %REG_PENDING_QUEUED, plus a generation count
+ * @pos: the position of the request in its queue
+ * @reg: the request's device
+ * @initiator: the request's initiator
+ * @alpha2: the request's alpha2
+ *
+ * Read like a seqlock, the other members only mean something while
+ * @state is the same %REG_PENDING_QUEUED state before and after reading
+ * them.
+ */
+struct reg_pending {
+	unsigned long state;
+	unsigned long pos;
+	struct ieee80211_dev_regulatory *reg;
+	enum ieee80211_reg_initiator initiator;
+	char alpha2[2];
+};
+
+struct reg_request_cell {
+	unsigned long seq;
+	struct regulatory_request *request;
+};
+
+/**
+ * struct reg_request_queue - the requests of an initiator to be processed
+ *
+ * A bounded queue which any number of threads add requests to without
+ * locks, for one thread at a time to take them off. Each cell's sequence
+ * number tells whether the cell is free for the position of @tail that
+ * maps to it or filled for the position of @head that does.
+ *
+ * @cells: the requests
+ * @tail: the next position to be filled
+ * @head: the next position to be taken
+ * @count: requests queued or being queued, at most @params' limit so
+ *	that a request which got to count itself always finds a free cell
+ * @overflow: the request set aside while the queue was full, with
+ *	%REGLIB_QUEUE_COALESCE
+ * @params: how requests are queued, the limit and policy are read
+ *	without locks
+ * @stats: the counters of reglib_get_queue_stats(), but for the depth
+ * @pending: queued requests by a hash of their device, initiator and
+ *	alpha2, the latest one of each hash, to merge requests into a like
+ *	one which is the newest queued. Each initiator has its own so that
+ *	a flood of requests of one does not keep those of others from being
+ *	merged.
+ */
+struct reg_request_queue {
+	struct reg_request_cell cells[REG_REQUEST_QUEUE_SIZE];
+	unsigned long tail __attribute__((aligned(64)));
+	unsigned long head __attribute__((aligned(64)));
+	unsigned int count __attribute__((aligned(64)));
+	struct regulatory_request *overflow;
+	struct reglib_queue_params params;
+	struct reglib_queue_stats stats;
+	struct reg_pending pending[REG_PENDING_SIZE];
+};
+
+static const struct reglib_queue_params
+reg_queue_defaults[REGLIB_NUM_INITIATORS] = {
+	[IEEE80211_REGDOM_SET_BY_CORE] = {
+		.priority = 3,
+		.limit = 16,
+		.policy = REGLIB_QUEUE_REJECT,
+	},
+	[IEEE80211_REGDOM_SET_BY_USER] = {
+		.priority = 2,
+		.limit = 64,
+		.policy = REGLIB_QUEUE_REJECT,
+	},
+	[IEEE80211_REGDOM_SET_BY_DRIVER] = {
+		.priority = 1,
+		.limit = REGLIB_MAX_QUEUED,
+		.policy = REGLIB_QUEUE_REJECT,
+	},
+	/* Only the latest country IE matters */
+	[IEEE80211_REGDOM_SET_BY_COUNTRY_IE] = {
+		.priority = 0,
+		.limit = REGLIB_MAX_QUEUED,
+		.policy = REGLIB_QUEUE_COALESCE,
+	},
+};
+
 /**
  * struct ieee80211_regcore - the regulatory core
  *
@@ -69,7 +179,8 @@ struct regulatory_request core_request_world = {
  * @dev_regd_list: list of known registered 802.11 device's regulatory
  *	data. This is used by the regulatory library when it needs to
  *	iterate over all devices.
- * @requests_list: list of regulatory requests
+ * @requests: the regulatory requests yet to be processed, by initiator
+ * @request_order: the initiators by the priority of their requests
  */
 struct ieee80211_regcore {
 	struct regcore_ops *ops;
@@ -78,7 +189,8 @@ struct ieee80211_regcore {
 	struct regulatory_request *last_request;
 	char user_alpha2[2];
 	struct dl_list dev_regd_list;
-	struct dl_list requests_list;
+	struct reg_request_queue requests[REGLIB_NUM_INITIATORS];
+	enum ieee80211_reg_initiator request_order[REGLIB_NUM_INITIATORS];
 };
 
 struct ieee80211_regcore reg_core = {
@@ -89,6 +201,188 @@ struct ieee80211_regcore reg_core = {
 
 struct ieee80211_regcore *regcore = &reg_core;
 
+/*
+ * Lookups do not take the regulatory core's lock. Much like with RCU
+ * they run in read-side critical sections instead, the core publishes
+ * the domains and requests they look at with release stores and only
+ * frees those after a grace period, see reglib_synchronize().
+ *
+ * Each thread which reads gets a reader slot of its own in which it
+ * notes the epoch it entered its read-side critical section in, or 0
+ * while it is outside of one. A grace period is over once no slot has
+ * an epoch from before it. Threads beyond %REG_RCU_MAX_READERS count
+ * themselves in the reg_rcu_overflow counter of the epoch's parity
+ * instead. A grace period only waits for the counter of the epochs
+ * before it, so it ends however many of those threads keep entering
+ * read-side critical sections.
+ */
+#define REG_RCU_MAX_READERS	128
+
+struct reg_rcu_reader {
+	unsigned long epoch;
+	bool used;
+} __attribute__((aligned(64)));
+
+static struct reg_rcu_reader reg_rcu_readers[REG_RCU_MAX_READERS];
+static unsigned long reg_rcu_epoch = 1;
+static unsigned long reg_rcu_overflow[2];
+static pthread_key_t reg_rcu_key;
+static pthread_once_t reg_rcu_once = PTHREAD_ONCE_INIT;
+/* Grace periods take turns, so that they only ever flip the parity once */
+static pthread_mutex_t reg_rcu_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct reg_rcu_reader *reg_rcu_self;
+static __thread unsigned int reg_rcu_nesting;
+static __thread bool reg_rcu_no_slot;
+/* The reg_rcu_overflow counter a thread without a slot counted itself in */
+static __thread unsigned int reg_rcu_overflow_idx;
+
+/* Hands the slot of an exiting thread to the threads to come */
+static void reg_rcu_reader_release(void *data)
+{
+	struct reg_rcu_reader *self = data;
+
+	__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&self->used, false, __ATOMIC_RELEASE);
+}
+
+static void reg_rcu_init(void)
+{
+	pthread_key_create(&reg_rcu_key, reg_rcu_reader_release);
+}
+
+static struct reg_rcu_reader *reg_rcu_reader_get(void)
+{
+	unsigned int i;
+
+	if (reg_rcu_self || reg_rcu_no_slot)
+		return reg_rcu_self;
+
+	pthread_once(&reg_rcu_once, reg_rcu_init);
+
+	for (i = 0; i < REG_RCU_MAX_READERS; i++) {
+		if (__atomic_exchange_n(&reg_rcu_readers[i].used, true,
+					__ATOMIC_ACQUIRE))
+			continue;
+		reg_rcu_self = &reg_rcu_readers[i];
+		pthread_setspecific(reg_rcu_key, reg_rcu_self);
+		return reg_rcu_self;
+	}
+
+	reg_rcu_no_slot = true;
+
+	return NULL;
+}
+
+/*
+ * Counts a thread without a slot in the counter of the current epoch.
+ * Should a grace period start before it is counted, that grace period
+ * may not have seen it, so it counts itself in the next one's counter.
+ */
+static void reg_rcu_overflow_enter(void)
+{
+	unsigned long epoch;
+	unsigned int idx;
+
+	while (true) {
+		epoch = __atomic_load_n(&reg_rcu_epoch, __ATOMIC_SEQ_CST);
+		idx = epoch & 1;
+		__atomic_add_fetch(&reg_rcu_overflow[idx], 1, __ATOMIC_SEQ_CST);
+		/* Pairs with the one in reglib_synchronize() */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&reg_rcu_epoch, __ATOMIC_SEQ_CST) == epoch)
+			break;
+		__atomic_sub_fetch(&reg_rcu_overflow[idx], 1, __ATOMIC_RELEASE);
+	}
+
+	reg_rcu_overflow_idx = idx;
+}
+
+/**
+ * reglib_read_lock - enter a read-side critical section
+ *
+ * Regulatory domains and rules lookups hand out stay valid until the
+ * matching reglib_read_unlock(), even if the regulatory core moves on
+ * in the meantime. Lookups enter one of their own, so this is only
+ * needed to hold on to what they return. Read-side critical sections
+ * nest, never wait on writers and are cheap. They must not wrap calls
+ * which change the regulatory core.
+ */
+void reglib_read_lock(void)
+{
+	struct reg_rcu_reader *self;
+
+	if (reg_rcu_nesting++)
+		return;
+
+	self = reg_rcu_reader_get();
+	if (!self) {
+		reg_rcu_overflow_enter();
+		return;
+	}
+
+	__atomic_store_n(&self->epoch,
+			 __atomic_load_n(&reg_rcu_epoch, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	/* Pairs with the one in reglib_synchronize() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * reglib_read_unlock - leave a read-side critical section
+ */
+void reglib_read_unlock(void)
+{
+	if (--reg_rcu_nesting)
+		return;
+
+	if (!reg_rcu_self) {
+		__atomic_sub_fetch(&reg_rcu_overflow[reg_rcu_overflow_idx], 1,
+				   __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_store_n(&reg_rcu_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * reglib_synchronize - wait for a grace period to pass
+ *
+ * Returns once all read-side critical sections entered before the call
+ * have been left, after which nothing unpublished before the call is
+ * looked at anymore and it can be freed. Readers entering meanwhile do
+ * not hold this up, neither with nor without a reader slot. Concurrent
+ * callers take turns. Must not be called in a read-side critical section.
+ */
+void reglib_synchronize(void)
+{
+	unsigned long epoch, seen;
+	unsigned int i;
+
+	pthread_mutex_lock(&reg_rcu_sync_lock);
+
+	epoch = __atomic_add_fetch(&reg_rcu_epoch, 1, __ATOMIC_SEQ_CST);
+	/* Pairs with the one in reglib_read_lock() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < REG_RCU_MAX_READERS; i++) {
+		for (;;) {
+			seen = __atomic_load_n(&reg_rcu_readers[i].epoch,
+					       __ATOMIC_ACQUIRE);
+			if (!seen || seen >= epoch)
+				break;
+			sched_yield();
+		}
+	}
+
+	/* Threads without a slot entering from here on count in the other */
+	while (__atomic_load_n(&reg_rcu_overflow[(epoch - 1) & 1],
+			       __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	pthread_mutex_unlock(&reg_rcu_sync_lock);
+}
+
 int reglib_frequency_to_channel(int freq)
 {
 	if (freq == 2484)
@@ -110,33 +404,218 @@ bool reglib_is_world_regdom(const char *alpha2)
 	return false;
 }
 
-static int reg_copy_regd(const struct ieee80211_regdomain **dst_regd,
-			 const struct ieee80211_regdomain *src_regd)
+/*
+ * Interned regulatory domains
+ *
+ * The domains devices hold are hash-consed by content into a pool of
+ * immutable, refcounted instances, so however many devices end up with
+ * the same domain they share a single copy of it, indexed once. The
+ * static domains regdbc generates already are immutable, indexed and
+ * around for good, those are interned as they are. Only used with the
+ * regcore lock held.
+ */
+#define REG_INTERN_HASH_BITS	6
+#define REG_INTERN_HASH_SIZE	(1 << REG_INTERN_HASH_BITS)
+
+/**
+ * struct reg_interned - an interned regulatory domain
+ *
+ * @refs: references held to @rd
+ * @hash: reg_regd_hash() of @rd
+ * @list: for inclusion in its bucket of reg_interned
+ * @rd: the domain, either @copy or a static domain regdbc generated
+ * @copy: our copy of the domain, must be last as its rules follow. Not
+ *	used for static domains, which have no rules allocated for it.
+ */
+struct reg_interned {
+	unsigned int refs;
+	uint32_t hash;
+	struct dl_list list;
+	const struct ieee80211_regdomain *rd;
+	struct ieee80211_regdomain copy;
+};
+
+static struct dl_list reg_interned[REG_INTERN_HASH_SIZE];
+
+static void reg_chan_map_flush(void);
+
+/* FNV-1a of the alpha2 and rules of rd */
+static uint32_t reg_regd_hash(const struct ieee80211_regdomain *rd)
+{
+	const uint8_t *p = (const uint8_t *) rd->reg_rules;
+	size_t i, len;
+	uint32_t h = 2166136261u;
+
+	h = (h ^ (uint8_t) rd->alpha2[0]) * 16777619;
+	h = (h ^ (uint8_t) rd->alpha2[1]) * 16777619;
+
+	len = rd->n_reg_rules * sizeof(struct ieee80211_reg_rule);
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619;
+
+	return h;
+}
+
+static bool reg_regd_same(const struct ieee80211_regdomain *rd1,
+			  const struct ieee80211_regdomain *rd2)
+{
+	return rd1->alpha2[0] == rd2->alpha2[0] &&
+	       rd1->alpha2[1] == rd2->alpha2[1] &&
+	       rd1->n_reg_rules == rd2->n_reg_rules &&
+	       !memcmp(rd1->reg_rules, rd2->reg_rules,
+		       rd1->n_reg_rules * sizeof(struct ieee80211_reg_rule));
+}
+
+/*
+ * Returns a reference to the interned domain with the contents of rd,
+ * creating it if there is none yet, or %NULL if we ran out of memory.
+ */
+static const struct ieee80211_regdomain *
+reg_regd_intern(const struct ieee80211_regdomain *rd)
+{
+	struct reg_interned *interned;
+	struct dl_list *bucket;
+	uint32_t hash;
+
+	hash = reg_regd_hash(rd);
+	bucket = &reg_interned[hash >> (32 - REG_INTERN_HASH_BITS)];
+
+	dl_list_for_each(interned, bucket, struct reg_interned, list) {
+		if (interned->hash == hash && reg_regd_same(interned->rd, rd)) {
+			interned->refs++;
+			return interned->rd;
+		}
+	}
+
+	if (rd->index && rd->index->precomputed) {
+		interned = malloc(sizeof(struct reg_interned));
+		if (!interned)
+			return NULL;
+		interned->rd = rd;
+	} else {
+		interned = malloc(sizeof(struct reg_interned) +
+				  rd->n_reg_rules *
+				  sizeof(struct ieee80211_reg_rule));
+		if (!interned)
+			return NULL;
+
+		interned->copy.n_reg_rules = rd->n_reg_rules;
+		interned->copy.alpha2[0] = rd->alpha2[0];
+		interned->copy.alpha2[1] = rd->alpha2[1];
+		interned->copy.index = NULL;
+		memcpy(interned->copy.reg_rules, rd->reg_rules,
+		       rd->n_reg_rules * sizeof(struct ieee80211_reg_rule));
+
+		/* Without an index lookups just scan the rules */
+		reglib_index_regd(&interned->copy);
+		interned->rd = &interned->copy;
+	}
+
+	interned->refs = 1;
+	interned->hash = hash;
+	dl_list_add(bucket, &interned->list);
+
+	return interned->rd;
+}
+
+/* The interned domain rd is, which has to be one */
+static struct reg_interned *
+reg_interned_find(const struct ieee80211_regdomain *rd)
+{
+	struct reg_interned *interned;
+	struct dl_list *bucket;
+	uint32_t hash;
+
+	hash = reg_regd_hash(rd);
+	bucket = &reg_interned[hash >> (32 - REG_INTERN_HASH_BITS)];
+	dl_list_for_each(interned, bucket, struct reg_interned, list)
+		if (interned->rd == rd)
+			return interned;
+
+	BUG_ON(1);
+	return NULL;
+}
+
+/*
+ * Drops a reference to an interned domain. Lookups may still be on it,
+ * so the last reference only takes it out of reg_interned and onto dead,
+ * reg_interned_free() frees it after a grace period.
+ */
+static void reg_regd_release(const struct ieee80211_regdomain *rd,
+			     struct dl_list *dead)
+{
+	struct reg_interned *interned;
+
+	if (!rd)
+		return;
+
+	interned = reg_interned_find(rd);
+	if (--interned->refs)
+		return;
+
+	dl_list_del(&interned->list);
+	dl_list_add_tail(dead, &interned->list);
+}
+
+/* Frees what reg_regd_release() put on dead, call after reglib_synchronize() */
+static void reg_interned_free(struct dl_list *dead)
+{
+	struct reg_interned *interned, *tmp;
+
+	if (dl_list_empty(dead))
+		return;
+
+	dl_list_for_each_safe(interned, tmp, dead, struct reg_interned, list) {
+		dl_list_del(&interned->list);
+		if (interned->rd == &interned->copy)
+			reglib_unindex_regd(&interned->copy);
+		free(interned);
+	}
+
+	/* A new domain may show up at the same address */
+	reg_chan_map_flush();
+}
+
+static void reg_regd_put(const struct ieee80211_regdomain *rd)
+{
+	struct dl_list dead;
+
+	dl_list_init(&dead);
+	reg_regd_release(rd, &dead);
+	if (dl_list_empty(&dead))
+		return;
+
+	reglib_synchronize();
+	reg_interned_free(&dead);
+}
+
+static void reg_interned_init(void)
 {
-	struct ieee80211_regdomain *regd;
-	int size_of_regd = 0;
 	unsigned int i;
 
-	size_of_regd = sizeof(struct ieee80211_regdomain) +
-	  ((src_regd->n_reg_rules + 1) * sizeof(struct ieee80211_reg_rule));
+	for (i = 0; i < REG_INTERN_HASH_SIZE; i++)
+		dl_list_init(&reg_interned[i]);
+}
 
-	regd = malloc(size_of_regd);
-	if (!regd)
-		return -ENOMEM;
-	memset(regd, 0, size_of_regd);
+/* Gives the device a reference to the interned domain like rd */
+static int reg_dev_set_regd(struct ieee80211_dev_regulatory *reg,
+			    const struct ieee80211_regdomain *rd)
+{
+	const struct ieee80211_regdomain *interned, *old_rd;
 
-	memcpy(regd, src_regd, sizeof(struct ieee80211_regdomain));
+	interned = reg_regd_intern(rd);
+	if (!interned)
+		return -ENOMEM;
 
-	for (i = 0; i < src_regd->n_reg_rules; i++)
-		memcpy(&regd->reg_rules[i], &src_regd->reg_rules[i],
-			sizeof(struct ieee80211_reg_rule));
+	old_rd = reg->regd;
+	__atomic_store_n(&reg->regd, interned, __ATOMIC_RELEASE);
+	reg_regd_put(old_rd);
 
-	*dst_regd = regd;
 	return 0;
 }
 
 /* Sanity check on a regulatory rule */
-static bool is_valid_reg_rule(const struct ieee80211_reg_rule *rule)
+bool reglib_is_valid_reg_rule(const struct ieee80211_reg_rule *rule)
 {
 	const struct ieee80211_freq_range *freq_range = &rule->freq_range;
 	uint32_t freq_diff;
@@ -165,26 +644,25 @@ bool reglib_is_valid_rd(const struct ieee80211_regdomain *rd)
 		return false;
 
 	/*
-	 * we use 32 for now as the maximum under the assumption we
-	 * don't want to allocate memory for more. Right now at least
-	 * on the Linux kernel we dynamically allocate memory for
-	 * a regulatory domain so we decided to limit this to 32.
+	 * Lookups only look at the rules of a channel's band so there is
+	 * no need to keep domains small, this just keeps a corrupt
+	 * n_reg_rules from having us walk off into the void.
 	 */
-	if (rd->n_reg_rules > 32)
+	if (rd->n_reg_rules > REGLIB_MAX_REG_RULES)
 		return false;
 
 	for (i = 0; i < rd->n_reg_rules; i++) {
 		reg_rule = &rd->reg_rules[i];
-		if (!is_valid_reg_rule(reg_rule))
+		if (!reglib_is_valid_reg_rule(reg_rule))
 			return false;
 	}
 
 	return true;
 }
 
-static bool reg_does_bw_fit(const struct ieee80211_freq_range *freq_range,
-			    uint32_t center_freq_khz,
-			    uint32_t bw_khz)
+bool reglib_does_bw_fit(const struct ieee80211_freq_range *freq_range,
+			uint32_t center_freq_khz,
+			uint32_t bw_khz)
 {
 	uint32_t start_freq_khz, end_freq_khz;
 
@@ -198,118 +676,1691 @@ static bool reg_does_bw_fit(const struct ieee80211_freq_range *freq_range,
 	return false;
 }
 
+/*
+ * The frequency ranges the bands cover. Together they cover all
+ * frequencies, 6 GHz takes anything between the 5 GHz and 60 GHz bands.
+ */
+static const struct ieee80211_freq_range reg_band_ranges[IEEE80211_NUM_BANDS] = {
+	[IEEE80211_BAND_2GHZ] = {
+		.start_freq_khz = 0,
+		.end_freq_khz = MHZ_TO_KHZ(4000),
+	},
+	[IEEE80211_BAND_5GHZ] = {
+		.start_freq_khz = MHZ_TO_KHZ(4000),
+		.end_freq_khz = MHZ_TO_KHZ(5925),
+	},
+	[IEEE80211_BAND_6GHZ] = {
+		.start_freq_khz = MHZ_TO_KHZ(5925),
+		.end_freq_khz = MHZ_TO_KHZ(45000),
+	},
+	[IEEE80211_BAND_60GHZ] = {
+		.start_freq_khz = MHZ_TO_KHZ(45000),
+		.end_freq_khz = UINT32_MAX,
+	},
+};
+
+/**
+ * reglib_freq_to_band - tells us which band a frequency belongs to
+ * @freq_khz: the frequency
+ */
+enum ieee80211_band reglib_freq_to_band(uint32_t freq_khz)
+{
+	if (freq_khz < reg_band_ranges[IEEE80211_BAND_5GHZ].start_freq_khz)
+		return IEEE80211_BAND_2GHZ;
+	if (freq_khz < reg_band_ranges[IEEE80211_BAND_6GHZ].start_freq_khz)
+		return IEEE80211_BAND_5GHZ;
+	if (freq_khz < reg_band_ranges[IEEE80211_BAND_60GHZ].start_freq_khz)
+		return IEEE80211_BAND_6GHZ;
+	return IEEE80211_BAND_60GHZ;
+}
+
+/* Tells us if a rule has any frequency in a band */
+static bool reg_rule_in_band(const struct ieee80211_freq_range *freq_range,
+			     enum ieee80211_band band)
+{
+	return freq_range->start_freq_khz < reg_band_ranges[band].end_freq_khz &&
+	       freq_range->end_freq_khz >= reg_band_ranges[band].start_freq_khz;
+}
+
 /**
- * freq_in_rule_band - tells us if a frequency is in a frequency band
+ * reglib_freq_in_rule_band - tells us if a frequency is in a frequency band
  * @freq_range: frequency rule we want to query
  * @freq_khz: frequency we are inquiring about
  *
  * This lets us know if a specific frequency rule is or is not relevant to
- * a specific frequency's band. Bands are device specific and artificial
- * definitions (the "2.4 GHz band" and the "5 GHz band"), however it is
- * safe for now to assume that a frequency rule should not be part of a
- * frequency's band if the start freq or end freq are off by more than 2 GHz.
- * This resolution can be lowered and should be considered as we add
- * regulatory rule support for other "bands".
+ * a specific frequency's band, that is if the rule has any frequency in
+ * the band @freq_khz belongs to. See reglib_freq_to_band().
  **/
-static bool freq_in_rule_band(const struct ieee80211_freq_range *freq_range,
+bool reglib_freq_in_rule_band(const struct ieee80211_freq_range *freq_range,
 			      uint32_t freq_khz)
 {
-#define ONE_GHZ_IN_KHZ	1000000
-	if (abs(freq_khz - freq_range->start_freq_khz) <= (2 * ONE_GHZ_IN_KHZ))
-		return true;
-	if (abs(freq_khz - freq_range->end_freq_khz) <= (2 * ONE_GHZ_IN_KHZ))
-		return true;
-	return false;
-#undef ONE_GHZ_IN_KHZ
+	return reg_rule_in_band(freq_range, reglib_freq_to_band(freq_khz));
 }
 
-int reglib_freq_info_regd(struct ieee80211_dev_regulatory *reg,
-			  uint32_t center_freq,
-			  int target_eirp_mbm,
-			  uint32_t desired_bw_khz,
-			  const struct ieee80211_reg_rule **reg_rule,
-			  const struct ieee80211_regdomain *custom_regd)
+/* The bands a rule has frequencies in, as a bitmask of BIT(band) */
+static uint32_t reg_rule_bands(const struct ieee80211_freq_range *freq_range)
 {
-	int i;
-	bool band_rule_found = false;
-	const struct ieee80211_regdomain *regd;
-	bool bw_fits = false;
+	enum ieee80211_band band;
+	uint32_t bands = 0;
 
-	if (!desired_bw_khz)
-		desired_bw_khz = MHZ_TO_KHZ(20);
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+		if (reg_rule_in_band(freq_range, band))
+			bands |= 1 << band;
 
-	regd = custom_regd ? custom_regd : regcore->world_regd;
+	return bands;
+}
 
-	/*
-	 * Follow the device's regulatory domain, if present, unless a
-	 * country IE has been processed or a user wants to help complaince
-	 * further.
-	 */
-	if (!custom_regd &&
-	    regcore->last_request->initiator != IEEE80211_REGDOM_SET_BY_COUNTRY_IE &&
-	    regcore->last_request->initiator != IEEE80211_REGDOM_SET_BY_USER &&
-	    reg->regd)
-		regd = reg->regd;
+static int reg_index_entry_cmp(const void *a, const void *b)
+{
+	const struct reglib_index_entry *ea = a, *eb = b;
 
-	if (!regd)
-		return -EINVAL;
+	if (ea->start_freq_khz != eb->start_freq_khz)
+		return ea->start_freq_khz < eb->start_freq_khz ? -1 : 1;
+	if (ea->end_freq_khz != eb->end_freq_khz)
+		return ea->end_freq_khz < eb->end_freq_khz ? -1 : 1;
+	return ea->rule_idx < eb->rule_idx ? -1 : 1;
+}
 
-	for (i = 0; i < regd->n_reg_rules; i++) {
-		const struct ieee80211_reg_rule *rr;
-		const struct ieee80211_freq_range *fr = NULL;
-		const struct ieee80211_power_rule *pr = NULL;
+static int reg_u32_cmp(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *) a, ub = *(const uint32_t *) b;
 
-		rr = &regd->reg_rules[i];
-		fr = &rr->freq_range;
-		pr = &rr->power_rule;
+	if (ua == ub)
+		return 0;
+	return ua < ub ? -1 : 1;
+}
 
-		/*
-		 * We only need to know if one frequency rule was
-		 * was in center_freq's band, that's enough, so lets
-		 * not overwrite it once found
-		 */
-		if (!band_rule_found)
-			band_rule_found = freq_in_rule_band(fr, center_freq);
+/* Sorts index entries and fills in their running maximum end frequency */
+static void reg_sort_entries(struct reglib_index_entry *entries,
+			     unsigned int n_entries)
+{
+	uint32_t max_end = 0;
+	unsigned int i;
 
-		bw_fits = reg_does_bw_fit(fr,
-					  center_freq,
-					  desired_bw_khz);
+	qsort(entries, n_entries, sizeof(struct reglib_index_entry),
+	      reg_index_entry_cmp);
 
-		if (band_rule_found && bw_fits &&
-		    target_eirp_mbm <= pr->max_eirp) {
-			*reg_rule = rr;
-			return 0;
-		}
+	for (i = 0; i < n_entries; i++) {
+		if (entries[i].end_freq_khz > max_end)
+			max_end = entries[i].end_freq_khz;
+		entries[i].max_end_khz = max_end;
 	}
-
-	if (!band_rule_found)
-		return -ERANGE;
-
-	return -EINVAL;
 }
 
-int reglib_freq_info(struct ieee80211_dev_regulatory *reg,
-		     uint32_t center_freq,
-		     int target_eirp_mbm,
-		     uint32_t desired_bw_khz,
-		     const struct ieee80211_reg_rule **reg_rule)
+/*
+ * The rules of a domain sorted by start frequency, regardless of their
+ * band. The caller frees them.
+ */
+static struct reglib_index_entry *
+reg_sorted_rules(const struct ieee80211_regdomain *rd)
 {
-	return reglib_freq_info_regd(reg,
-				     center_freq,
-				     target_eirp_mbm,
-				     desired_bw_khz,
-				     reg_rule,
-				     NULL);
+	struct reglib_index_entry *sorted;
+	const struct ieee80211_freq_range *fr;
+	unsigned int i;
+
+	sorted = malloc((rd->n_reg_rules + 1) * sizeof(struct reglib_index_entry));
+	if (!sorted)
+		return NULL;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		fr = &rd->reg_rules[i].freq_range;
+		sorted[i].start_freq_khz = fr->start_freq_khz;
+		sorted[i].end_freq_khz = fr->end_freq_khz;
+		sorted[i].rule_idx = i;
+	}
+
+	reg_sort_entries(sorted, rd->n_reg_rules);
+
+	return sorted;
 }
 
-const struct ieee80211_regdomain *reglib_get_regd(void)
+/* Number of sorted entries with a start frequency <= freq_khz */
+static unsigned int reg_entries_upper_start(const struct reglib_index_entry *entries,
+					    unsigned int n_entries,
+					    uint32_t freq_khz)
 {
-	return regcore->regd;
+	unsigned int lo = 0, hi = n_entries, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (entries[mid].start_freq_khz <= freq_khz)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
-static void print_rd_rules(const struct ieee80211_regdomain *rd)
+/*
+ * Better rule for a channel: higher max EIRP wins, on a tie the one
+ * declared first in the domain does.
+ */
+static bool reg_rule_is_better(const struct ieee80211_regdomain *rd,
+			       int32_t rule_idx, int32_t best)
 {
-	unsigned int i;
+	uint32_t eirp, best_eirp;
+
+	if (best < 0)
+		return true;
+
+	eirp = rd->reg_rules[rule_idx].power_rule.max_eirp;
+	best_eirp = rd->reg_rules[best].power_rule.max_eirp;
+
+	if (eirp != best_eirp)
+		return eirp > best_eirp;
+
+	return rule_idx < best;
+}
+
+/*
+ * The range of center frequencies on which a channel of bw_khz fits
+ * within a rule, returns false if it fits nowhere.
+ */
+static bool reg_rule_fit_range(const struct ieee80211_freq_range *fr,
+			       uint32_t bw_khz,
+			       uint32_t *first_khz, uint32_t *last_khz)
+{
+	if (fr->end_freq_khz - fr->start_freq_khz < bw_khz)
+		return false;
+
+	*first_khz = fr->start_freq_khz + bw_khz/2;
+	*last_khz = fr->end_freq_khz - bw_khz/2;
+
+	return true;
+}
+
+/*
+ * Normalizes the domain into disjoint segments of center frequencies.
+ * The boundaries of the segments are the first and last center
+ * frequency at which a channel of each bandwidth class fits into each
+ * rule, so within a segment the set of rules a channel of a given width
+ * fits into does not change. For each segment and class we keep the rule
+ * with the highest max EIRP and merge neighbouring segments which ended
+ * up with the same rules.
+ *
+ * A channel of a given width centered on a given frequency is then
+ * permitted at a target EIRP if, and only if, the best rule of the
+ * segment containing that frequency allows it. Frequencies not in any
+ * segment can not fit any channel of any of the classes.
+ */
+static int reg_index_build_segments(struct reglib_regd_index *index,
+				    const struct ieee80211_regdomain *rd)
+{
+	struct reglib_segment *segments, *seg;
+	struct reglib_index_entry *sorted;
+	uint32_t *bounds, first, last, bw_khz;
+	unsigned int n_bounds = 0, n_segments = 0;
+	unsigned int i, j, k;
+	int32_t best;
+
+	if (!rd->n_reg_rules)
+		return 0;
+
+	bounds = malloc(2 * REGLIB_NUM_BWS * rd->n_reg_rules * sizeof(uint32_t));
+	if (!bounds)
+		return -ENOMEM;
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		for (k = 0; k < REGLIB_NUM_BWS; k++) {
+			if (!reg_rule_fit_range(&rd->reg_rules[i].freq_range,
+						REGLIB_BW_KHZ(k),
+						&first, &last))
+				continue;
+			bounds[n_bounds++] = first;
+			bounds[n_bounds++] = last + 1;
+		}
+	}
+
+	if (!n_bounds) {
+		free(bounds);
+		return 0;
+	}
+
+	qsort(bounds, n_bounds, sizeof(uint32_t), reg_u32_cmp);
+
+	sorted = reg_sorted_rules(rd);
+	segments = malloc((n_bounds - 1) * sizeof(struct reglib_segment));
+	if (!sorted || !segments) {
+		free(sorted);
+		free(segments);
+		free(bounds);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i + 1 < n_bounds; i++) {
+		if (bounds[i] == bounds[i + 1])
+			continue;
+
+		seg = &segments[n_segments];
+		seg->start_freq_khz = bounds[i];
+		seg->end_freq_khz = bounds[i + 1] - 1;
+
+		/*
+		 * Only rules starting before the segment's first center
+		 * can fit any channel in it.
+		 */
+		for (k = 0; k < REGLIB_NUM_BWS; k++) {
+			bw_khz = REGLIB_BW_KHZ(k);
+			best = -1;
+			for (j = reg_entries_upper_start(sorted, rd->n_reg_rules,
+							 seg->start_freq_khz);
+			     j--; ) {
+				const struct reglib_index_entry *entry;
+
+				entry = &sorted[j];
+				if (entry->max_end_khz < seg->end_freq_khz)
+					break;
+				if (!reg_rule_fit_range(&rd->reg_rules[entry->rule_idx].freq_range,
+							bw_khz, &first, &last))
+					continue;
+				if (first > seg->start_freq_khz ||
+				    last < seg->end_freq_khz)
+					continue;
+				if (reg_rule_is_better(rd, entry->rule_idx, best))
+					best = entry->rule_idx;
+			}
+			seg->best_rule[k] = best;
+		}
+
+		for (k = 0; k < REGLIB_NUM_BWS; k++)
+			if (seg->best_rule[k] >= 0)
+				break;
+		if (k == REGLIB_NUM_BWS)
+			continue;
+
+		if (n_segments &&
+		    segments[n_segments - 1].end_freq_khz + 1 == seg->start_freq_khz &&
+		    !memcmp(segments[n_segments - 1].best_rule, seg->best_rule,
+			    sizeof(seg->best_rule))) {
+			segments[n_segments - 1].end_freq_khz = seg->end_freq_khz;
+			continue;
+		}
+
+		n_segments++;
+	}
+
+	free(sorted);
+	free(bounds);
+
+	index->n_segments = n_segments;
+	index->segments = segments;
+
+	return 0;
+}
+
+/**
+ * reglib_chan_to_freq - center frequency of a channel
+ * @band: the band of the channel
+ * @chan: the IEEE channel number
+ *
+ * Returns the center frequency in MHz of a channel on the 20 MHz channel
+ * grid of @band, or 0 if the band has no such channel.
+ */
+int reglib_chan_to_freq(enum ieee80211_band band, unsigned int chan)
+{
+	switch (band) {
+	case IEEE80211_BAND_2GHZ:
+		if (chan == 14)
+			return 2484;
+		if (chan >= 1 && chan <= 13)
+			return 2407 + chan * 5;
+		break;
+	case IEEE80211_BAND_5GHZ:
+		if (chan >= 182 && chan <= 196)
+			return 4000 + chan * 5;
+		if (chan >= 1 && chan <= 181)
+			return 5000 + chan * 5;
+		break;
+	case IEEE80211_BAND_6GHZ:
+		if (chan >= 1 && chan <= 233)
+			return 5950 + chan * 5;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * reglib_freq_to_chan - channel number of a center frequency
+ * @band: the band of the channel
+ * @freq: center frequency in MHz
+ *
+ * The inverse of reglib_chan_to_freq(), returns -EINVAL if @freq is not
+ * the center of a channel of @band.
+ */
+int reglib_freq_to_chan(enum ieee80211_band band, int freq)
+{
+	int chan = -EINVAL;
+
+	switch (band) {
+	case IEEE80211_BAND_2GHZ:
+		if (freq == 2484)
+			return 14;
+		chan = (freq - 2407) / 5;
+		break;
+	case IEEE80211_BAND_5GHZ:
+		if (freq >= 4910 && freq <= 4980)
+			chan = (freq - 4000) / 5;
+		else
+			chan = (freq - 5000) / 5;
+		break;
+	case IEEE80211_BAND_6GHZ:
+		chan = (freq - 5950) / 5;
+		break;
+	default:
+		break;
+	}
+
+	if (chan < 0 || reglib_chan_to_freq(band, chan) != freq)
+		return -EINVAL;
+
+	return chan;
+}
+
+/*
+ * Lower edge and width in MHz of the 5 GHz and 6 GHz blocks wide
+ * channels are aligned to, for the block a center frequency is in. The
+ * 5 GHz band has two of them, U-NII-1 to U-NII-2C and U-NII-3.
+ */
+static bool reg_chan_grid_block(enum ieee80211_band band, int freq,
+				int *start, int *end)
+{
+	switch (band) {
+	case IEEE80211_BAND_5GHZ:
+		if (freq >= 5180 && freq <= 5720) {
+			*start = 5170;
+			*end = 5730;
+			return true;
+		}
+		if (freq >= 5745 && freq <= 5885) {
+			*start = 5735;
+			*end = 5895;
+			return true;
+		}
+		return false;
+	case IEEE80211_BAND_6GHZ:
+		*start = 5945;
+		*end = 7125;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Center frequency in MHz of the channel of a given width a primary
+ * channel is part of on the 5 GHz and 6 GHz grids, 0 if there is none.
+ */
+static int reg_chan_grid_center(enum ieee80211_band band, int freq,
+				enum reglib_bw bw)
+{
+	int start, end, width, lower;
+
+	width = KHZ_TO_MHZ(REGLIB_BW_KHZ(bw));
+
+	if (!reg_chan_grid_block(band, freq, &start, &end))
+		return 0;
+
+	lower = start + (freq - 10 - start) / width * width;
+	if (lower + width > end)
+		return 0;
+
+	return lower + width / 2;
+}
+
+/**
+ * reglib_wide_chan_center - center frequency of a wide channel
+ * @band: the band of the channel
+ * @chan: the IEEE channel number of the primary channel
+ * @bw: the width of the channel
+ *
+ * Returns the center frequency in MHz of the channel of width @bw @chan
+ * is the primary channel of. Channels up to 20 MHz wide are centered on
+ * the primary channel itself. Wider ones follow the 5 GHz and 6 GHz
+ * channel grids, on other bands and off the grid there is no such
+ * channel and 0 is returned.
+ */
+int reglib_wide_chan_center(enum ieee80211_band band, unsigned int chan,
+			    enum reglib_bw bw)
+{
+	int freq;
+
+	freq = reglib_chan_to_freq(band, chan);
+	if (!freq || bw <= REGLIB_BW_20)
+		return freq;
+
+	if (bw >= REGLIB_NUM_BWS)
+		return 0;
+
+	return reg_chan_grid_center(band, freq, bw);
+}
+
+/*
+ * Whether a channel of bw_khz centered on center_freq is permitted, that
+ * is some rule covers all of it and allows that width. Walks the rules
+ * of the band partition if there is one and all of them otherwise.
+ */
+static bool reg_chan_permitted(const struct ieee80211_regdomain *rd,
+			       const struct reglib_band_index *band_index,
+			       uint32_t center_freq, uint32_t bw_khz)
+{
+	const struct ieee80211_freq_range *fr;
+	const struct reglib_index_entry *entry;
+	unsigned int i;
+
+	if (!band_index) {
+		for (i = 0; i < rd->n_reg_rules; i++) {
+			fr = &rd->reg_rules[i].freq_range;
+			if (fr->max_bandwidth_khz >= bw_khz &&
+			    reglib_does_bw_fit(fr, center_freq, bw_khz))
+				return true;
+		}
+		return false;
+	}
+
+	for (i = reg_entries_upper_start(band_index->by_start,
+					 band_index->n_entries,
+					 center_freq - bw_khz/2);
+	     i--; ) {
+		entry = &band_index->by_start[i];
+		if (entry->max_end_khz < center_freq + bw_khz/2)
+			break;
+		fr = &rd->reg_rules[entry->rule_idx].freq_range;
+		if (fr->max_bandwidth_khz >= bw_khz &&
+		    reglib_does_bw_fit(fr, center_freq, bw_khz))
+			return true;
+	}
+
+	return false;
+}
+
+/* Fills in what a domain permits on one channel into a band's bitmaps */
+static void reg_chan_avail_fill(const struct ieee80211_regdomain *rd,
+				const struct reglib_band_index *band_index,
+				enum ieee80211_band band,
+				unsigned int chan,
+				struct reglib_chan_avail *avail)
+{
+	const uint32_t ht40_khz = REGLIB_BW_KHZ(REGLIB_BW_40);
+	int freq, center;
+	enum reglib_bw bw;
+
+	freq = reglib_chan_to_freq(band, chan);
+	if (!freq)
+		return;
+
+	for (bw = 0; bw <= REGLIB_BW_20; bw++)
+		if (reg_chan_permitted(rd, band_index, MHZ_TO_KHZ(freq),
+				       REGLIB_BW_KHZ(bw)))
+			reglib_chan_set(&avail->primary[bw], chan);
+
+	if (!reglib_chan_test(&avail->primary[REGLIB_BW_20], chan))
+		return;
+
+	if (band == IEEE80211_BAND_2GHZ) {
+		/* HT40 may pair any two channels four apart but 14 */
+		if (chan + 4 <= 13 &&
+		    reg_chan_permitted(rd, band_index,
+				       MHZ_TO_KHZ(freq + 10), ht40_khz))
+			reglib_chan_set(&avail->ht40plus, chan);
+		if (chan >= 5 && chan <= 13 &&
+		    reg_chan_permitted(rd, band_index,
+				       MHZ_TO_KHZ(freq - 10), ht40_khz))
+			reglib_chan_set(&avail->ht40minus, chan);
+		if (reglib_chan_test(&avail->ht40plus, chan) ||
+		    reglib_chan_test(&avail->ht40minus, chan))
+			reglib_chan_set(&avail->primary[REGLIB_BW_40], chan);
+		return;
+	}
+
+	for (bw = REGLIB_BW_40; bw < REGLIB_NUM_BWS; bw++) {
+		center = reg_chan_grid_center(band, freq, bw);
+		if (!center ||
+		    !reg_chan_permitted(rd, band_index, MHZ_TO_KHZ(center),
+					REGLIB_BW_KHZ(bw)))
+			continue;
+
+		reglib_chan_set(&avail->primary[bw], chan);
+		if (bw != REGLIB_BW_40)
+			continue;
+		if (freq < center)
+			reglib_chan_set(&avail->ht40plus, chan);
+		else
+			reglib_chan_set(&avail->ht40minus, chan);
+	}
+}
+
+static void reg_chan_avail_build(const struct ieee80211_regdomain *rd,
+				 const struct reglib_band_index *band_index,
+				 enum ieee80211_band band,
+				 struct reglib_chan_avail *avail)
+{
+	unsigned int chan;
+
+	memset(avail, 0, sizeof(struct reglib_chan_avail));
+
+	if (band_index && !band_index->n_entries)
+		return;
+
+	for (chan = 0; chan < 64 * REGLIB_CHAN_BITMAP_WORDS; chan++)
+		reg_chan_avail_fill(rd, band_index, band, chan, avail);
+}
+
+/*
+ * The rules each 20 MHz channel of a band fits in, these are what
+ * reglib_handle_channel() asks for every channel of every device.
+ */
+static int reg_index_build_chan_rules(struct reglib_regd_index *index,
+				      const struct ieee80211_regdomain *rd,
+				      enum ieee80211_band band)
+{
+	const struct reglib_band_index *band_index = &index->bands[band];
+	const struct reglib_index_entry *entry;
+	uint32_t *chan_rules = NULL;
+	unsigned int chan, i;
+	int freq;
+
+	if (rd->n_reg_rules > REGLIB_CHAN_RULES_MAX_RULES)
+		return 0;
+
+	for (chan = 0; chan < REGLIB_NUM_CHANS; chan++) {
+		freq = reglib_chan_to_freq(band, chan);
+		if (!freq)
+			continue;
+
+		for (i = 0; i < band_index->n_entries; i++) {
+			entry = &band_index->by_start[i];
+			if (!reglib_does_bw_fit(&rd->reg_rules[entry->rule_idx].freq_range,
+					     MHZ_TO_KHZ(freq), MHZ_TO_KHZ(20)))
+				continue;
+
+			if (!chan_rules) {
+				chan_rules = malloc(REGLIB_NUM_CHANS *
+						    sizeof(uint32_t));
+				if (!chan_rules)
+					return -ENOMEM;
+				memset(chan_rules, 0,
+				       REGLIB_NUM_CHANS * sizeof(uint32_t));
+			}
+
+			chan_rules[chan] |= (uint32_t) 1 << entry->rule_idx;
+		}
+	}
+
+	index->chan_rules[band] = chan_rules;
+	return 0;
+}
+
+static void reg_index_free(struct reglib_regd_index *index)
+{
+	enum ieee80211_band band;
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+		free((void *) index->chan_rules[band]);
+	free((void *) index->entries);
+	free((void *) index->segments);
+	free(index);
+}
+
+/**
+ * reglib_index_regd - build the lookup index for a regulatory domain
+ * @rd: the regulatory domain to index
+ *
+ * The index partitions the domain's rules by band and sorts each
+ * partition by frequency so that reglib_freq_info_regd() can binary
+ * search for the rules containing a channel rather than scan all of
+ * them. The rules themselves, and the order in which they take
+ * precedence, are left untouched. The index also holds the domain
+ * normalized into disjoint frequency segments, used by
+ * reglib_freq_best_regd(), the channels permitted at each width in
+ * each band, used by reglib_chan_bw_allowed(), and for small domains
+ * the rules each 20 MHz channel fits in.
+ *
+ * Returns 0 on success or if the domain was already indexed.
+ */
+int reglib_index_regd(struct ieee80211_regdomain *rd)
+{
+	struct reglib_regd_index *index;
+	struct reglib_index_entry *entries, *entry;
+	const struct ieee80211_freq_range *fr;
+	unsigned int i, n_entries = 0;
+	enum ieee80211_band band;
+	int r;
+
+	if (rd->index)
+		return 0;
+
+	index = malloc(sizeof(struct reglib_regd_index));
+	if (!index)
+		return -ENOMEM;
+	memset(index, 0, sizeof(struct reglib_regd_index));
+
+	for (i = 0; i < rd->n_reg_rules; i++) {
+		fr = &rd->reg_rules[i].freq_range;
+		for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+			if (reg_rule_in_band(fr, band))
+				n_entries++;
+	}
+
+	entries = malloc((n_entries + 1) * sizeof(struct reglib_index_entry));
+	if (!entries) {
+		reg_index_free(index);
+		return -ENOMEM;
+	}
+	index->entries = entries;
+
+	entry = entries;
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		struct reglib_index_entry *by_start = entry;
+
+		index->bands[band].by_start = by_start;
+		for (i = 0; i < rd->n_reg_rules; i++) {
+			fr = &rd->reg_rules[i].freq_range;
+			if (!reg_rule_in_band(fr, band))
+				continue;
+			entry->start_freq_khz = fr->start_freq_khz;
+			entry->end_freq_khz = fr->end_freq_khz;
+			entry->rule_idx = i;
+			entry++;
+		}
+		index->bands[band].n_entries = entry - by_start;
+		reg_sort_entries(by_start, index->bands[band].n_entries);
+	}
+
+	r = reg_index_build_segments(index, rd);
+	if (r) {
+		reg_index_free(index);
+		return r;
+	}
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		reg_chan_avail_build(rd, &index->bands[band], band,
+				     &index->chans[band]);
+		r = reg_index_build_chan_rules(index, rd, band);
+		if (r) {
+			reg_index_free(index);
+			return r;
+		}
+	}
+
+	rd->index = index;
+	return 0;
+}
+
+void reglib_unindex_regd(struct ieee80211_regdomain *rd)
+{
+	struct reglib_regd_index *index;
+
+	if (!rd->index)
+		return;
+
+	index = (struct reglib_regd_index *) rd->index;
+	rd->index = NULL;
+
+	reg_index_free(index);
+}
+
+/* reglib_freq_in_rule_band() for all rules at once */
+static bool reg_index_band_rule_found(const struct reglib_regd_index *index,
+				      uint32_t freq_khz)
+{
+	return index->bands[reglib_freq_to_band(freq_khz)].n_entries;
+}
+
+static int reg_freq_info_scan(const struct ieee80211_regdomain *regd,
+			      uint32_t center_freq,
+			      int target_eirp_mbm,
+			      uint32_t desired_bw_khz,
+			      const struct ieee80211_reg_rule **reg_rule)
+{
+	int i;
+	bool band_rule_found = false;
+	bool bw_fits = false;
+
+	for (i = 0; i < regd->n_reg_rules; i++) {
+		const struct ieee80211_reg_rule *rr;
+		const struct ieee80211_freq_range *fr = NULL;
+		const struct ieee80211_power_rule *pr = NULL;
+
+		rr = &regd->reg_rules[i];
+		fr = &rr->freq_range;
+		pr = &rr->power_rule;
+
+		/*
+		 * We only need to know if one frequency rule was
+		 * was in center_freq's band, that's enough, so lets
+		 * not overwrite it once found
+		 */
+		if (!band_rule_found)
+			band_rule_found = reglib_freq_in_rule_band(fr, center_freq);
+
+		bw_fits = reglib_does_bw_fit(fr,
+					  center_freq,
+					  desired_bw_khz);
+
+		if (band_rule_found && bw_fits &&
+		    target_eirp_mbm <= pr->max_eirp) {
+			*reg_rule = rr;
+			return 0;
+		}
+	}
+
+	if (!band_rule_found)
+		return -ERANGE;
+
+	return -EINVAL;
+}
+
+/*
+ * 20 MHz channels on the channel grid of domains with few rules have
+ * the rules they fit in precomputed, of those we want the first one
+ * allowing the target EIRP.
+ */
+static int reg_freq_info_chan_rules(const struct ieee80211_regdomain *regd,
+				    uint32_t mask,
+				    int target_eirp_mbm,
+				    const struct ieee80211_reg_rule **reg_rule)
+{
+	const struct ieee80211_reg_rule *rr;
+
+	for (; mask; mask &= mask - 1) {
+		rr = &regd->reg_rules[__builtin_ctz(mask)];
+		if (target_eirp_mbm <= rr->power_rule.max_eirp) {
+			*reg_rule = rr;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * The rules that can fit the desired bandwidth are the ones starting at
+ * or before the channel's lower edge which end at or past its upper edge,
+ * all of which are in the band of the channel's center frequency. We
+ * binary search that band's rules for the last one starting before the
+ * lower edge and walk backwards, the running maximum of the end
+ * frequencies tells us when no earlier rule can reach the upper edge
+ * anymore. Of all rules that fit we pick the one declared first in the
+ * domain, just as the linear scan would.
+ */
+static int reg_freq_info_index(const struct ieee80211_regdomain *regd,
+			       uint32_t center_freq,
+			       int target_eirp_mbm,
+			       uint32_t desired_bw_khz,
+			       const struct ieee80211_reg_rule **reg_rule)
+{
+	const struct reglib_band_index *band_index;
+	const struct reglib_index_entry *entry;
+	const struct ieee80211_reg_rule *rr;
+	uint32_t start_freq_khz, end_freq_khz;
+	uint32_t best = regd->n_reg_rules;
+	enum ieee80211_band band;
+	unsigned int i;
+	int chan;
+
+	/* Leave nonsensical channels below 0 KHz to the linear scan */
+	if (center_freq < desired_bw_khz/2)
+		return reg_freq_info_scan(regd,
+					  center_freq,
+					  target_eirp_mbm,
+					  desired_bw_khz,
+					  reg_rule);
+
+	band = reglib_freq_to_band(center_freq);
+	band_index = &regd->index->bands[band];
+	if (!band_index->n_entries)
+		return -ERANGE;
+
+	if (desired_bw_khz == MHZ_TO_KHZ(20) && regd->index->chan_rules[band] &&
+	    !(center_freq % MHZ_TO_KHZ(1))) {
+		chan = reglib_freq_to_chan(band, KHZ_TO_MHZ(center_freq));
+		if (chan >= 0)
+			return reg_freq_info_chan_rules(regd,
+					regd->index->chan_rules[band][chan],
+					target_eirp_mbm, reg_rule);
+	}
+
+	start_freq_khz = center_freq - (desired_bw_khz/2);
+	end_freq_khz = center_freq + (desired_bw_khz/2);
+
+	i = reg_entries_upper_start(band_index->by_start,
+				    band_index->n_entries,
+				    start_freq_khz);
+	while (i--) {
+		entry = &band_index->by_start[i];
+		if (entry->max_end_khz < end_freq_khz)
+			break;
+		if (entry->end_freq_khz < end_freq_khz ||
+		    entry->rule_idx >= best)
+			continue;
+		rr = &regd->reg_rules[entry->rule_idx];
+		if (target_eirp_mbm <= rr->power_rule.max_eirp)
+			best = entry->rule_idx;
+	}
+
+	if (best < regd->n_reg_rules) {
+		*reg_rule = &regd->reg_rules[best];
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Returns which of the regulatory core's domain and the device's own
+ * domain lookups for the device should be made against. The device's
+ * own is followed, if present, unless a country IE has been processed
+ * or a user wants to help complaince further.
+ */
+static const struct ieee80211_regdomain *
+reg_dev_regd(const struct ieee80211_regdomain *core_regd,
+	     const struct ieee80211_regdomain *dev_regd)
+{
+	const struct regulatory_request *last_request;
+
+	last_request = __atomic_load_n(&regcore->last_request,
+				       __ATOMIC_ACQUIRE);
+	if (last_request->initiator != IEEE80211_REGDOM_SET_BY_COUNTRY_IE &&
+	    last_request->initiator != IEEE80211_REGDOM_SET_BY_USER &&
+	    dev_regd)
+		return dev_regd;
+
+	return core_regd;
+}
+
+/*
+ * Returns the regulatory domain lookups for this device should be made
+ * against, custom_regd takes precedence if set. Otherwise it is the
+ * device's own domain or the one last applied to the regulatory core,
+ * the built in world domain only until CRDA applies one. Lookups have
+ * to be in a read-side critical section, see reglib_read_lock().
+ */
+static const struct ieee80211_regdomain *
+reg_get_regd(struct ieee80211_dev_regulatory *reg,
+	     const struct ieee80211_regdomain *custom_regd)
+{
+	if (custom_regd)
+		return custom_regd;
+
+	return reg_dev_regd(__atomic_load_n(&regcore->regd, __ATOMIC_ACQUIRE),
+			    __atomic_load_n(&reg->regd, __ATOMIC_ACQUIRE));
+}
+
+static int reg_freq_info(const struct ieee80211_regdomain *regd,
+			 uint32_t center_freq,
+			 int target_eirp_mbm,
+			 uint32_t desired_bw_khz,
+			 const struct ieee80211_reg_rule **reg_rule)
+{
+	if (!regd)
+		return -EINVAL;
+
+	if (regd->index)
+		return reg_freq_info_index(regd,
+					   center_freq,
+					   target_eirp_mbm,
+					   desired_bw_khz,
+					   reg_rule);
+
+	return reg_freq_info_scan(regd,
+				  center_freq,
+				  target_eirp_mbm,
+				  desired_bw_khz,
+				  reg_rule);
+}
+
+int reglib_freq_info_regd(struct ieee80211_dev_regulatory *reg,
+			  uint32_t center_freq,
+			  int target_eirp_mbm,
+			  uint32_t desired_bw_khz,
+			  const struct ieee80211_reg_rule **reg_rule,
+			  const struct ieee80211_regdomain *custom_regd)
+{
+	int r;
+
+	if (!desired_bw_khz)
+		desired_bw_khz = MHZ_TO_KHZ(20);
+
+	reglib_read_lock();
+	r = reg_freq_info(reg_get_regd(reg, custom_regd),
+			  center_freq,
+			  target_eirp_mbm,
+			  desired_bw_khz,
+			  reg_rule);
+	reglib_read_unlock();
+
+	return r;
+}
+
+/* Returns the bandwidth class bw_khz belongs to, or -1 if none */
+static int reg_bw_class(uint32_t bw_khz)
+{
+	int k;
+
+	for (k = 0; k < REGLIB_NUM_BWS; k++)
+		if (REGLIB_BW_KHZ(k) == bw_khz)
+			return k;
+
+	return -1;
+}
+
+/* The segment containing freq_khz, if any */
+static const struct reglib_segment *
+reg_index_find_segment(const struct reglib_regd_index *index,
+		       uint32_t freq_khz)
+{
+	unsigned int lo = 0, hi = index->n_segments, mid;
+	const struct reglib_segment *seg;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		seg = &index->segments[mid];
+		if (freq_khz < seg->start_freq_khz)
+			hi = mid;
+		else if (freq_khz > seg->end_freq_khz)
+			lo = mid + 1;
+		else
+			return seg;
+	}
+
+	return NULL;
+}
+
+static int reg_freq_best_scan(const struct ieee80211_regdomain *regd,
+			      uint32_t center_freq,
+			      uint32_t desired_bw_khz,
+			      const struct ieee80211_reg_rule **reg_rule)
+{
+	int32_t best = -1;
+	bool band_rule_found = false;
+	unsigned int i;
+
+	for (i = 0; i < regd->n_reg_rules; i++) {
+		const struct ieee80211_freq_range *fr;
+
+		fr = &regd->reg_rules[i].freq_range;
+
+		if (!band_rule_found)
+			band_rule_found = reglib_freq_in_rule_band(fr, center_freq);
+
+		if (band_rule_found &&
+		    reglib_does_bw_fit(fr, center_freq, desired_bw_khz) &&
+		    reg_rule_is_better(regd, i, best))
+			best = i;
+	}
+
+	if (best >= 0) {
+		*reg_rule = &regd->reg_rules[best];
+		return 0;
+	}
+
+	if (!band_rule_found)
+		return -ERANGE;
+
+	return -EINVAL;
+}
+
+static int reg_freq_best(const struct ieee80211_regdomain *regd,
+			 uint32_t center_freq,
+			 uint32_t desired_bw_khz,
+			 const struct ieee80211_reg_rule **reg_rule)
+{
+	const struct reglib_segment *seg;
+	int k;
+
+	if (!desired_bw_khz)
+		desired_bw_khz = MHZ_TO_KHZ(20);
+
+	if (!regd)
+		return -EINVAL;
+
+	k = reg_bw_class(desired_bw_khz);
+
+	if (!regd->index || k < 0 || center_freq < desired_bw_khz/2)
+		return reg_freq_best_scan(regd, center_freq,
+					  desired_bw_khz, reg_rule);
+
+	seg = reg_index_find_segment(regd->index, center_freq);
+	if (seg && seg->best_rule[k] >= 0) {
+		*reg_rule = &regd->reg_rules[seg->best_rule[k]];
+		return 0;
+	}
+
+	if (!reg_index_band_rule_found(regd->index, center_freq))
+		return -ERANGE;
+
+	return -EINVAL;
+}
+
+/**
+ * reglib_freq_best_regd - find the rule allowing the most power on a channel
+ * @reg: the device's regulatory data, as for reglib_freq_info_regd()
+ * @center_freq: center frequency of the channel in KHz
+ * @desired_bw_khz: width of the channel in KHz, 0 means 20 MHz
+ * @reg_rule: set to the rule with the highest max EIRP the channel fits
+ *	in, on a tie the one declared first in the domain
+ * @custom_regd: the regulatory domain to use, as for reglib_freq_info_regd()
+ *
+ * Where reglib_freq_info_regd() gives the first rule which allows a target
+ * EIRP, this gives the best one there is. reglib_freq_info_regd() will
+ * find a rule for any target EIRP up to the max EIRP of the rule returned
+ * here, and for none above it. On indexed domains and for the widths in
+ * &enum reglib_bw this is a single probe into the normalized domain.
+ *
+ * Returns 0 if a rule was found, -ERANGE if no rule is in the channel's
+ * band and -EINVAL otherwise.
+ */
+int reglib_freq_best_regd(struct ieee80211_dev_regulatory *reg,
+			  uint32_t center_freq,
+			  uint32_t desired_bw_khz,
+			  const struct ieee80211_reg_rule **reg_rule,
+			  const struct ieee80211_regdomain *custom_regd)
+{
+	int r;
+
+	reglib_read_lock();
+	r = reg_freq_best(reg_get_regd(reg, custom_regd),
+			  center_freq,
+			  desired_bw_khz,
+			  reg_rule);
+	reglib_read_unlock();
+
+	return r;
+}
+
+/* One pass over the rules for all bandwidth classes */
+static void reg_freq_caps_scan(const struct ieee80211_regdomain *regd,
+			       uint32_t center_freq,
+			       int32_t *best_rule,
+			       bool *band_rule_found)
+{
+	const struct ieee80211_freq_range *fr;
+	unsigned int i;
+	int k;
+
+	*band_rule_found = false;
+
+	for (i = 0; i < regd->n_reg_rules; i++) {
+		fr = &regd->reg_rules[i].freq_range;
+
+		if (!*band_rule_found)
+			*band_rule_found = reglib_freq_in_rule_band(fr, center_freq);
+		if (!*band_rule_found)
+			continue;
+
+		for (k = 0; k < REGLIB_NUM_BWS; k++)
+			if (reglib_does_bw_fit(fr, center_freq, REGLIB_BW_KHZ(k)) &&
+			    reg_rule_is_better(regd, i, best_rule[k]))
+				best_rule[k] = i;
+	}
+}
+
+static int reg_freq_caps(const struct ieee80211_regdomain *regd,
+			 uint32_t center_freq,
+			 struct reglib_freq_caps *caps)
+{
+	const struct reglib_segment *seg;
+	int32_t best_rule[REGLIB_NUM_BWS];
+	bool band_rule_found = true;
+	bool permitted = false;
+	int k;
+
+	memset(caps, 0, sizeof(struct reglib_freq_caps));
+
+	if (!regd)
+		return -EINVAL;
+
+	for (k = 0; k < REGLIB_NUM_BWS; k++)
+		best_rule[k] = -1;
+
+	if (!regd->index ||
+	    center_freq < REGLIB_BW_KHZ(REGLIB_NUM_BWS - 1)/2)
+		reg_freq_caps_scan(regd, center_freq, best_rule,
+				   &band_rule_found);
+	else {
+		seg = reg_index_find_segment(regd->index, center_freq);
+		if (seg)
+			memcpy(best_rule, seg->best_rule, sizeof(best_rule));
+		else
+			band_rule_found =
+				reg_index_band_rule_found(regd->index,
+							  center_freq);
+	}
+
+	for (k = 0; k < REGLIB_NUM_BWS; k++) {
+		if (best_rule[k] < 0)
+			continue;
+		caps->reg_rule[k] = &regd->reg_rules[best_rule[k]];
+		caps->max_eirp[k] = caps->reg_rule[k]->power_rule.max_eirp;
+		permitted = true;
+	}
+
+	if (permitted)
+		return 0;
+
+	if (!band_rule_found)
+		return -ERANGE;
+
+	return -EINVAL;
+}
+
+/**
+ * reglib_freq_caps_regd - tell what is permitted on a center frequency
+ * @reg: the device's regulatory data, as for reglib_freq_info_regd()
+ * @center_freq: center frequency in KHz
+ * @caps: filled in with the best rule, and its max EIRP, for a channel of
+ *	each width in &enum reglib_bw centered on @center_freq
+ * @custom_regd: the regulatory domain to use, as for reglib_freq_info_regd()
+ *
+ * This is reglib_freq_best_regd() for all bandwidth classes at once. It
+ * costs a single probe on indexed domains and a single pass over the
+ * rules on all others.
+ *
+ * Returns 0 if a channel of at least one of the widths is permitted,
+ * -ERANGE if no rule is in the frequency's band and -EINVAL otherwise.
+ */
+int reglib_freq_caps_regd(struct ieee80211_dev_regulatory *reg,
+			  uint32_t center_freq,
+			  struct reglib_freq_caps *caps,
+			  const struct ieee80211_regdomain *custom_regd)
+{
+	int r;
+
+	reglib_read_lock();
+	r = reg_freq_caps(reg_get_regd(reg, custom_regd),
+			  center_freq,
+			  caps);
+	reglib_read_unlock();
+
+	return r;
+}
+
+static int reg_chan_avail(const struct ieee80211_regdomain *regd,
+			  enum ieee80211_band band,
+			  struct reglib_chan_avail *avail)
+{
+	if (band >= IEEE80211_NUM_BANDS)
+		return -EINVAL;
+
+	if (!regd)
+		return -EINVAL;
+
+	if (regd->index)
+		memcpy(avail, &regd->index->chans[band],
+		       sizeof(struct reglib_chan_avail));
+	else
+		reg_chan_avail_build(regd, NULL, band, avail);
+
+	return 0;
+}
+
+/**
+ * reglib_chan_avail_regd - tell which channels of a band permit each width
+ * @reg: the device's regulatory data, as for reglib_freq_info_regd()
+ * @band: the band
+ * @avail: filled in with the channels permitted at each width
+ * @custom_regd: the regulatory domain to use, as for reglib_freq_info_regd()
+ *
+ * This is a copy of what was precomputed on indexed domains, other
+ * domains are evaluated channel by channel.
+ */
+int reglib_chan_avail_regd(struct ieee80211_dev_regulatory *reg,
+			   enum ieee80211_band band,
+			   struct reglib_chan_avail *avail,
+			   const struct ieee80211_regdomain *custom_regd)
+{
+	int r;
+
+	reglib_read_lock();
+	r = reg_chan_avail(reg_get_regd(reg, custom_regd),
+			   band,
+			   avail);
+	reglib_read_unlock();
+
+	return r;
+}
+
+static bool reg_chan_bw_allowed(const struct ieee80211_regdomain *regd,
+				enum ieee80211_band band,
+				unsigned int chan,
+				enum reglib_bw bw)
+{
+	struct reglib_chan_avail avail;
+
+	if (band >= IEEE80211_NUM_BANDS || bw >= REGLIB_NUM_BWS)
+		return false;
+
+	if (!regd)
+		return false;
+
+	if (regd->index)
+		return reglib_chan_test(&regd->index->chans[band].primary[bw],
+					chan);
+
+	memset(&avail, 0, sizeof(struct reglib_chan_avail));
+	reg_chan_avail_fill(regd, NULL, band, chan, &avail);
+
+	return reglib_chan_test(&avail.primary[bw], chan);
+}
+
+/**
+ * reglib_chan_bw_allowed - tell if a channel may be used at a width
+ * @reg: the device's regulatory data, as for reglib_freq_info_regd()
+ * @band: the band of the channel
+ * @chan: the IEEE channel number of the primary channel
+ * @bw: the width of the channel
+ * @custom_regd: the regulatory domain to use, as for reglib_freq_info_regd()
+ *
+ * For example whether an 80 MHz channel with channel 36 as its primary
+ * is permitted. On indexed domains this is a single bit test.
+ */
+bool reglib_chan_bw_allowed(struct ieee80211_dev_regulatory *reg,
+			    enum ieee80211_band band,
+			    unsigned int chan,
+			    enum reglib_bw bw,
+			    const struct ieee80211_regdomain *custom_regd)
+{
+	bool r;
+
+	reglib_read_lock();
+	r = reg_chan_bw_allowed(reg_get_regd(reg, custom_regd),
+				band,
+				chan,
+				bw);
+	reglib_read_unlock();
+
+	return r;
+}
+
+/*
+ * Batched lookups evaluate every rule of the domain against a vector of
+ * queries at a time, in the same order reg_freq_info_scan() walks the
+ * rules. For domains with many rules the index is cheaper than looking
+ * at every rule, those are resolved one query at a time instead.
+ */
+#define REG_BATCH_MAX_VEC_RULES	32
+
+static void reg_freq_info_batch_scalar(const struct ieee80211_regdomain *regd,
+				       const uint32_t *center_freqs,
+				       const int *target_eirps_mbm,
+				       const uint32_t *desired_bws_khz,
+				       unsigned int n,
+				       int *results)
+{
+	const struct ieee80211_reg_rule *reg_rule = NULL;
+	uint32_t desired_bw_khz;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < n; i++) {
+		desired_bw_khz = desired_bws_khz[i];
+		if (!desired_bw_khz)
+			desired_bw_khz = MHZ_TO_KHZ(20);
+
+		r = reg_freq_info(regd,
+				  center_freqs[i],
+				  target_eirps_mbm[i],
+				  desired_bw_khz,
+				  &reg_rule);
+		results[i] = r ? r : (int) (reg_rule - regd->reg_rules);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Unsigned 32-bit comparisons are done as signed ones with the sign bit
+ * flipped on both sides, SSE2 and AVX2 only have signed compares.
+ */
+#define REG_SIGN_BIT	0x80000000
+
+/* reglib_freq_to_band() as a BIT(band) for each of the frequencies */
+static __m128i reg_freq_to_band_sse2(__m128i freq)
+{
+	const __m128i sign = _mm_set1_epi32(REG_SIGN_BIT);
+	__m128i above_2ghz, above_5ghz, above_6ghz, bands;
+
+	freq = _mm_xor_si128(freq, sign);
+	above_2ghz = _mm_cmpgt_epi32(freq, _mm_set1_epi32(
+		(reg_band_ranges[IEEE80211_BAND_5GHZ].start_freq_khz - 1) ^
+		REG_SIGN_BIT));
+	above_5ghz = _mm_cmpgt_epi32(freq, _mm_set1_epi32(
+		(reg_band_ranges[IEEE80211_BAND_6GHZ].start_freq_khz - 1) ^
+		REG_SIGN_BIT));
+	above_6ghz = _mm_cmpgt_epi32(freq, _mm_set1_epi32(
+		(reg_band_ranges[IEEE80211_BAND_60GHZ].start_freq_khz - 1) ^
+		REG_SIGN_BIT));
+
+	bands = _mm_andnot_si128(above_2ghz,
+				 _mm_set1_epi32(1 << IEEE80211_BAND_2GHZ));
+	bands = _mm_or_si128(bands, _mm_and_si128(
+		_mm_andnot_si128(above_5ghz, above_2ghz),
+		_mm_set1_epi32(1 << IEEE80211_BAND_5GHZ)));
+	bands = _mm_or_si128(bands, _mm_and_si128(
+		_mm_andnot_si128(above_6ghz, above_5ghz),
+		_mm_set1_epi32(1 << IEEE80211_BAND_6GHZ)));
+	bands = _mm_or_si128(bands, _mm_and_si128(above_6ghz,
+		_mm_set1_epi32(1 << IEEE80211_BAND_60GHZ)));
+
+	return bands;
+}
+
+__attribute__((target("avx2")))
+static __m256i reg_freq_to_band_avx2(__m256i freq)
+{
+	const __m256i sign = _mm256_set1_epi32(REG_SIGN_BIT);
+	__m256i above_2ghz, above_5ghz, above_6ghz, bands;
+
+	freq = _mm256_xor_si256(freq, sign);
+	above_2ghz = _mm256_cmpgt_epi32(freq, _mm256_set1_epi32(
+		(reg_band_ranges[IEEE80211_BAND_5GHZ].start_freq_khz - 1) ^
+		REG_SIGN_BIT));
+	above_5ghz = _mm256_cmpgt_epi32(freq, _mm256_set1_epi32(
+		(reg_band_ranges[IEEE80211_BAND_6GHZ].start_freq_khz - 1) ^
+		REG_SIGN_BIT));
+	above_6ghz = _mm256_cmpgt_epi32(freq, _mm256_set1_epi32(
+		(reg_band_ranges[IEEE80211_BAND_60GHZ].start_freq_khz - 1) ^
+		REG_SIGN_BIT));
+
+	bands = _mm256_andnot_si256(above_2ghz,
+				    _mm256_set1_epi32(1 << IEEE80211_BAND_2GHZ));
+	bands = _mm256_or_si256(bands, _mm256_and_si256(
+		_mm256_andnot_si256(above_5ghz, above_2ghz),
+		_mm256_set1_epi32(1 << IEEE80211_BAND_5GHZ)));
+	bands = _mm256_or_si256(bands, _mm256_and_si256(
+		_mm256_andnot_si256(above_6ghz, above_5ghz),
+		_mm256_set1_epi32(1 << IEEE80211_BAND_6GHZ)));
+	bands = _mm256_or_si256(bands, _mm256_and_si256(above_6ghz,
+		_mm256_set1_epi32(1 << IEEE80211_BAND_60GHZ)));
+
+	return bands;
+}
+
+static unsigned int
+reg_freq_info_batch_sse2(const struct ieee80211_regdomain *regd,
+			 const uint32_t *center_freqs,
+			 const int *target_eirps_mbm,
+			 const uint32_t *desired_bws_khz,
+			 unsigned int n,
+			 int *results)
+{
+	const __m128i sign = _mm_set1_epi32(REG_SIGN_BIT);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bw_20 = _mm_set1_epi32(MHZ_TO_KHZ(20));
+	const __m128i erange = _mm_set1_epi32(-ERANGE);
+	const __m128i einval = _mm_set1_epi32(-EINVAL);
+	const struct ieee80211_reg_rule *rr;
+	__m128i center, bw, eirp, lo, hi, m;
+	__m128i freq_band, band, found, idx, fits, match;
+	unsigned int i, j;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		center = _mm_loadu_si128((const __m128i *) &center_freqs[i]);
+		bw = _mm_loadu_si128((const __m128i *) &desired_bws_khz[i]);
+		eirp = _mm_loadu_si128((const __m128i *) &target_eirps_mbm[i]);
+
+		/* A desired bandwidth of 0 means 20 MHz */
+		m = _mm_cmpeq_epi32(bw, zero);
+		bw = _mm_or_si128(_mm_and_si128(m, bw_20),
+				  _mm_andnot_si128(m, bw));
+		bw = _mm_srli_epi32(bw, 1);
+
+		lo = _mm_xor_si128(_mm_sub_epi32(center, bw), sign);
+		hi = _mm_xor_si128(_mm_add_epi32(center, bw), sign);
+		eirp = _mm_xor_si128(eirp, sign);
+		freq_band = reg_freq_to_band_sse2(center);
+
+		band = zero;
+		found = zero;
+		idx = zero;
+
+		for (j = 0; j < regd->n_reg_rules; j++) {
+			__m128i start, end, max_eirp, rule_bands;
+
+			rr = &regd->reg_rules[j];
+			start = _mm_set1_epi32(rr->freq_range.start_freq_khz);
+			end = _mm_set1_epi32(rr->freq_range.end_freq_khz);
+			max_eirp = _mm_set1_epi32(rr->power_rule.max_eirp ^
+						  REG_SIGN_BIT);
+			rule_bands = _mm_set1_epi32(reg_rule_bands(&rr->freq_range));
+
+			/* reglib_freq_in_rule_band() */
+			m = _mm_cmpeq_epi32(_mm_and_si128(freq_band, rule_bands),
+					    zero);
+			band = _mm_or_si128(band,
+				_mm_andnot_si128(m, _mm_set1_epi32(-1)));
+
+			/* reglib_does_bw_fit() and the max_eirp check */
+			fits = _mm_or_si128(
+				_mm_cmpgt_epi32(_mm_xor_si128(start, sign), lo),
+				_mm_cmpgt_epi32(hi, _mm_xor_si128(end, sign)));
+			fits = _mm_or_si128(fits,
+					    _mm_cmpgt_epi32(eirp, max_eirp));
+
+			match = _mm_andnot_si128(_mm_or_si128(fits, found),
+						 band);
+			idx = _mm_or_si128(idx,
+				_mm_and_si128(match, _mm_set1_epi32(j)));
+			found = _mm_or_si128(found, match);
+
+			if (_mm_movemask_epi8(found) == 0xffff)
+				break;
+		}
+
+		/* Queries with no match get -ERANGE or -EINVAL */
+		m = _mm_or_si128(_mm_and_si128(band, einval),
+				 _mm_andnot_si128(band, erange));
+		idx = _mm_or_si128(_mm_and_si128(found, idx),
+				   _mm_andnot_si128(found, m));
+		_mm_storeu_si128((__m128i *) &results[i], idx);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+reg_freq_info_batch_avx2(const struct ieee80211_regdomain *regd,
+			 const uint32_t *center_freqs,
+			 const int *target_eirps_mbm,
+			 const uint32_t *desired_bws_khz,
+			 unsigned int n,
+			 int *results)
+{
+	const __m256i sign = _mm256_set1_epi32(REG_SIGN_BIT);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i bw_20 = _mm256_set1_epi32(MHZ_TO_KHZ(20));
+	const __m256i erange = _mm256_set1_epi32(-ERANGE);
+	const __m256i einval = _mm256_set1_epi32(-EINVAL);
+	const struct ieee80211_reg_rule *rr;
+	__m256i center, bw, eirp, lo, hi, m;
+	__m256i freq_band, band, found, idx, fits, match;
+	unsigned int i, j;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		center = _mm256_loadu_si256((const __m256i *) &center_freqs[i]);
+		bw = _mm256_loadu_si256((const __m256i *) &desired_bws_khz[i]);
+		eirp = _mm256_loadu_si256((const __m256i *) &target_eirps_mbm[i]);
+
+		/* A desired bandwidth of 0 means 20 MHz */
+		bw = _mm256_blendv_epi8(bw, bw_20, _mm256_cmpeq_epi32(bw, zero));
+		bw = _mm256_srli_epi32(bw, 1);
+
+		lo = _mm256_xor_si256(_mm256_sub_epi32(center, bw), sign);
+		hi = _mm256_xor_si256(_mm256_add_epi32(center, bw), sign);
+		eirp = _mm256_xor_si256(eirp, sign);
+		freq_band = reg_freq_to_band_avx2(center);
+
+		band = zero;
+		found = zero;
+		idx = zero;
+
+		for (j = 0; j < regd->n_reg_rules; j++) {
+			__m256i start, end, max_eirp, rule_bands;
+
+			rr = &regd->reg_rules[j];
+			start = _mm256_set1_epi32(rr->freq_range.start_freq_khz);
+			end = _mm256_set1_epi32(rr->freq_range.end_freq_khz);
+			max_eirp = _mm256_set1_epi32(rr->power_rule.max_eirp ^
+						     REG_SIGN_BIT);
+			rule_bands = _mm256_set1_epi32(reg_rule_bands(&rr->freq_range));
+
+			/* reglib_freq_in_rule_band() */
+			m = _mm256_cmpeq_epi32(_mm256_and_si256(freq_band,
+								rule_bands),
+					       zero);
+			band = _mm256_or_si256(band,
+				_mm256_xor_si256(m, _mm256_set1_epi32(-1)));
+
+			/* reglib_does_bw_fit() and the max_eirp check */
+			fits = _mm256_or_si256(
+				_mm256_cmpgt_epi32(_mm256_xor_si256(start, sign), lo),
+				_mm256_cmpgt_epi32(hi, _mm256_xor_si256(end, sign)));
+			fits = _mm256_or_si256(fits,
+					       _mm256_cmpgt_epi32(eirp, max_eirp));
+
+			match = _mm256_andnot_si256(_mm256_or_si256(fits, found),
+						    band);
+			idx = _mm256_blendv_epi8(idx, _mm256_set1_epi32(j), match);
+			found = _mm256_or_si256(found, match);
+
+			if (_mm256_movemask_epi8(found) == -1)
+				break;
+		}
+
+		/* Queries with no match get -ERANGE or -EINVAL */
+		m = _mm256_blendv_epi8(erange, einval, band);
+		idx = _mm256_blendv_epi8(m, idx, found);
+		_mm256_storeu_si256((__m256i *) &results[i], idx);
+	}
+
+	return i;
+}
+
+static unsigned int
+reg_freq_info_batch_vec(const struct ieee80211_regdomain *regd,
+			const uint32_t *center_freqs,
+			const int *target_eirps_mbm,
+			const uint32_t *desired_bws_khz,
+			unsigned int n,
+			int *results)
+{
+	if (__builtin_cpu_supports("avx2"))
+		return reg_freq_info_batch_avx2(regd, center_freqs,
+						target_eirps_mbm,
+						desired_bws_khz, n, results);
+
+	return reg_freq_info_batch_sse2(regd, center_freqs, target_eirps_mbm,
+					desired_bws_khz, n, results);
+}
+#else
+static unsigned int
+reg_freq_info_batch_vec(const struct ieee80211_regdomain *regd,
+			const uint32_t *center_freqs,
+			const int *target_eirps_mbm,
+			const uint32_t *desired_bws_khz,
+			unsigned int n,
+			int *results)
+{
+	return 0;
+}
+#endif /* __x86_64__ || __i386__ */
+
+static int reg_freq_info_batch(const struct ieee80211_regdomain *regd,
+			       const uint32_t *center_freqs,
+			       const int *target_eirps_mbm,
+			       const uint32_t *desired_bws_khz,
+			       unsigned int n,
+			       int *results)
+{
+	unsigned int done = 0;
+
+	if (!regd)
+		return -EINVAL;
+
+	if (!regd->index || regd->n_reg_rules <= REG_BATCH_MAX_VEC_RULES)
+		done = reg_freq_info_batch_vec(regd, center_freqs,
+					       target_eirps_mbm,
+					       desired_bws_khz, n, results);
+
+	reg_freq_info_batch_scalar(regd,
+				   center_freqs + done,
+				   target_eirps_mbm + done,
+				   desired_bws_khz + done,
+				   n - done,
+				   results + done);
+
+	return 0;
+}
+
+/**
+ * reglib_freq_info_batch - reglib_freq_info_regd() for many queries at once
+ * @reg: the device's regulatory data, as for reglib_freq_info_regd()
+ * @center_freqs: center frequencies in KHz
+ * @target_eirps_mbm: target EIRPs in mBm
+ * @desired_bws_khz: desired bandwidths in KHz, 0 means 20 MHz
+ * @n: number of queries in each of the arrays above
+ * @results: for each query the index into the domain's reg_rules[] of
+ *	the rule reglib_freq_info_regd() would give, or the negative error
+ *	code it would return
+ * @custom_regd: the regulatory domain to use, as for reglib_freq_info_regd()
+ *
+ * Returns 0 if the queries were resolved or -EINVAL if there is no
+ * regulatory domain to resolve them against.
+ */
+int reglib_freq_info_batch(struct ieee80211_dev_regulatory *reg,
+			   const uint32_t *center_freqs,
+			   const int *target_eirps_mbm,
+			   const uint32_t *desired_bws_khz,
+			   unsigned int n,
+			   int *results,
+			   const struct ieee80211_regdomain *custom_regd)
+{
+	int r;
+
+	reglib_read_lock();
+	r = reg_freq_info_batch(reg_get_regd(reg, custom_regd),
+				center_freqs,
+				target_eirps_mbm,
+				desired_bws_khz,
+				n,
+				results);
+	reglib_read_unlock();
+
+	return r;
+}
+
+int reglib_freq_info(struct ieee80211_dev_regulatory *reg,
+		     uint32_t center_freq,
+		     int target_eirp_mbm,
+		     uint32_t desired_bw_khz,
+		     const struct ieee80211_reg_rule **reg_rule)
+{
+	return reglib_freq_info_regd(reg,
+				     center_freq,
+				     target_eirp_mbm,
+				     desired_bw_khz,
+				     reg_rule,
+				     NULL);
+}
+
+/*
+ * The current regulatory domain, which is only good up to the end of
+ * the caller's read-side critical section.
+ */
+const struct ieee80211_regdomain *reglib_get_regd(void)
+{
+	return __atomic_load_n(&regcore->regd, __ATOMIC_ACQUIRE);
+}
+
+static void print_rd_rules(const struct ieee80211_regdomain *rd)
+{
+	unsigned int i;
 	const struct ieee80211_reg_rule *reg_rule = NULL;
 	const struct ieee80211_freq_range *freq_range = NULL;
 	const struct ieee80211_power_rule *power_rule = NULL;
@@ -341,15 +2392,364 @@ static void print_rd_rules(const struct ieee80211_regdomain *rd)
 	}
 }
 
-void reglib_print_regdomain(const struct ieee80211_regdomain *rd)
+void reglib_print_regdomain(const struct ieee80211_regdomain *rd)
+{
+	if (reglib_is_world_regdom(rd->alpha2))
+		printf("World regulatory domain updated:\n");
+	else
+		printf("Regulatory domain changed to country: %c%c\n",
+		       rd->alpha2[0], rd->alpha2[1]);
+
+	print_rd_rules(rd);
+}
+
+/*
+ * Intersections are memoized by the contents of the pair of domains they
+ * were computed from. The same country IE and user hints get processed
+ * over and over by all stations, this spares recomputing them every
+ * time. The memo keeps plain copies of the pair, looked for by their
+ * reg_regd_hash() and never looked up in, so the memo neither depends on
+ * where the caller's domains live nor on how long. At most
+ * %REG_INTERSECT_MAX intersections are kept, the least recently used one
+ * goes first. Only used with the regcore lock held.
+ */
+#define REG_INTERSECT_HASH_BITS	6
+#define REG_INTERSECT_HASH_SIZE	(1 << REG_INTERSECT_HASH_BITS)
+#define REG_INTERSECT_MAX	32
+
+/**
+ * struct reg_intersection - a memoized intersection
+ *
+ * @hash1: reg_regd_hash() of @rd1
+ * @hash2: reg_regd_hash() of @rd2
+ * @rd1: copy of the first domain intersected, the one first in
+ *	reg_regd_cmp() order
+ * @rd2: copy of the second domain intersected
+ * @rd: the intersection, or %NULL if the domains have nothing in common
+ * @list: for inclusion in its bucket of reg_intersections
+ * @lru: for inclusion in reg_intersect_lru
+ */
+struct reg_intersection {
+	uint32_t hash1;
+	uint32_t hash2;
+	struct ieee80211_regdomain *rd1;
+	struct ieee80211_regdomain *rd2;
+	struct ieee80211_regdomain *rd;
+	struct dl_list list;
+	struct dl_list lru;
+};
+
+static struct dl_list reg_intersections[REG_INTERSECT_HASH_SIZE];
+/* The memoized intersections, most recently used first */
+static struct dl_list reg_intersect_lru;
+static unsigned int reg_n_intersections;
+
+static unsigned int reg_intersect_hash(uint32_t hash1, uint32_t hash2)
+{
+	uint32_t h;
+
+	h = hash1 * 0x9e3779b1;
+	h ^= hash2 * 0x85ebca6b;
+
+	return h >> (32 - REG_INTERSECT_HASH_BITS);
+}
+
+/*
+ * Orders domains by their reg_regd_hash() and then their contents, so
+ * that the pair of an intersection is the same whichever way around it
+ * was asked for.
+ */
+static int reg_regd_cmp(const struct ieee80211_regdomain *rd1, uint32_t hash1,
+			const struct ieee80211_regdomain *rd2, uint32_t hash2)
+{
+	int r;
+
+	if (hash1 != hash2)
+		return hash1 < hash2 ? -1 : 1;
+
+	r = memcmp(rd1->alpha2, rd2->alpha2, 2);
+	if (r)
+		return r;
+
+	if (rd1->n_reg_rules != rd2->n_reg_rules)
+		return rd1->n_reg_rules < rd2->n_reg_rules ? -1 : 1;
+
+	return memcmp(rd1->reg_rules, rd2->reg_rules,
+		      rd1->n_reg_rules * sizeof(struct ieee80211_reg_rule));
+}
+
+/* An unindexed copy of rd, or %NULL if we ran out of memory */
+static struct ieee80211_regdomain *
+reg_regd_dup(const struct ieee80211_regdomain *rd)
+{
+	struct ieee80211_regdomain *copy;
+	size_t size;
+
+	size = sizeof(struct ieee80211_regdomain) +
+	       rd->n_reg_rules * sizeof(struct ieee80211_reg_rule);
+	copy = malloc(size);
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, rd, size);
+	copy->index = NULL;
+
+	return copy;
+}
+
+/*
+ * Helper for reg_intersect_rds(), this does the real mathematical
+ * intersection fun
+ */
+static bool reg_rules_intersect(const struct ieee80211_reg_rule *rule1,
+				const struct ieee80211_reg_rule *rule2,
+				struct ieee80211_reg_rule *intersected_rule)
+{
+	const struct ieee80211_freq_range *freq_range1, *freq_range2;
+	struct ieee80211_freq_range *freq_range;
+	const struct ieee80211_power_rule *power_rule1, *power_rule2;
+	struct ieee80211_power_rule *power_rule;
+	uint32_t freq_diff;
+
+	freq_range1 = &rule1->freq_range;
+	freq_range2 = &rule2->freq_range;
+	freq_range = &intersected_rule->freq_range;
+
+	power_rule1 = &rule1->power_rule;
+	power_rule2 = &rule2->power_rule;
+	power_rule = &intersected_rule->power_rule;
+
+	freq_range->start_freq_khz = freq_range1->start_freq_khz >
+		freq_range2->start_freq_khz ? freq_range1->start_freq_khz :
+		freq_range2->start_freq_khz;
+	freq_range->end_freq_khz = min(freq_range1->end_freq_khz,
+				       freq_range2->end_freq_khz);
+	freq_range->max_bandwidth_khz = min(freq_range1->max_bandwidth_khz,
+					    freq_range2->max_bandwidth_khz);
+
+	freq_diff = freq_range->end_freq_khz - freq_range->start_freq_khz;
+	if (freq_range->end_freq_khz > freq_range->start_freq_khz &&
+	    freq_range->max_bandwidth_khz > freq_diff)
+		freq_range->max_bandwidth_khz = freq_diff;
+
+	power_rule->max_eirp = min(power_rule1->max_eirp,
+				   power_rule2->max_eirp);
+	power_rule->max_antenna_gain = min(power_rule1->max_antenna_gain,
+					   power_rule2->max_antenna_gain);
+
+	intersected_rule->flags = rule1->flags | rule2->flags;
+
+	return reglib_is_valid_reg_rule(intersected_rule);
+}
+
+/**
+ * reg_intersect_rds - intersect two regulatory domains
+ * @rd1: first regulatory domain
+ * @rd2: second regulatory domain
+ *
+ * Sweeps over the rules of both domains in order of start frequency.
+ * The rules of @rd2 which end before the current rule of @rd1 starts
+ * can not intersect any later rule of @rd1 either so we never look at
+ * them again, for domains without overlapping rules of their own this
+ * takes linear time. The resulting domain uses the "98" alpha2 which
+ * denotes an intersection, its rules are sorted by frequency.
+ *
+ * Returns %NULL if the domains have no rule in common or if we ran out
+ * of memory.
+ */
+static struct ieee80211_regdomain *
+reg_intersect_rds(const struct ieee80211_regdomain *rd1,
+		  const struct ieee80211_regdomain *rd2)
+{
+	struct reglib_index_entry *sorted1, *sorted2;
+	struct ieee80211_regdomain *rd = NULL, *tmp;
+	struct ieee80211_reg_rule intersected_rule;
+	unsigned int i, j, lo = 0, n_rules = 0, size = 0;
+
+	sorted1 = reg_sorted_rules(rd1);
+	sorted2 = reg_sorted_rules(rd2);
+	if (!sorted1 || !sorted2)
+		goto out;
+
+	for (i = 0; i < rd1->n_reg_rules; i++) {
+		while (lo < rd2->n_reg_rules &&
+		       sorted2[lo].max_end_khz <= sorted1[i].start_freq_khz)
+			lo++;
+
+		for (j = lo; j < rd2->n_reg_rules &&
+		     sorted2[j].start_freq_khz < sorted1[i].end_freq_khz; j++) {
+			if (sorted2[j].end_freq_khz <= sorted1[i].start_freq_khz)
+				continue;
+
+			if (!reg_rules_intersect(&rd1->reg_rules[sorted1[i].rule_idx],
+						 &rd2->reg_rules[sorted2[j].rule_idx],
+						 &intersected_rule))
+				continue;
+
+			if (n_rules == size) {
+				size = size ? 2 * size : 8;
+				tmp = realloc(rd, sizeof(struct ieee80211_regdomain) +
+					      size * sizeof(struct ieee80211_reg_rule));
+				if (!tmp) {
+					free(rd);
+					rd = NULL;
+					goto out;
+				}
+				rd = tmp;
+			}
+
+			rd->reg_rules[n_rules++] = intersected_rule;
+		}
+	}
+
+	if (!rd)
+		goto out;
+
+	rd->n_reg_rules = n_rules;
+	rd->alpha2[0] = '9';
+	rd->alpha2[1] = '8';
+	rd->index = NULL;
+
+	/* Intersections get looked up a lot, fine if this fails though */
+	reglib_index_regd(rd);
+
+out:
+	free(sorted1);
+	free(sorted2);
+
+	return rd;
+}
+
+/* Drops a memoized intersection, lookups may still be on its domain */
+static void reg_intersection_free(struct reg_intersection *intersection)
+{
+	dl_list_del(&intersection->list);
+	dl_list_del(&intersection->lru);
+	reg_n_intersections--;
+
+	free(intersection->rd1);
+	free(intersection->rd2);
+
+	if (intersection->rd) {
+		reglib_synchronize();
+		reglib_unindex_regd(intersection->rd);
+		free(intersection->rd);
+		/* A new domain may show up at the same address */
+		reg_chan_map_flush();
+	}
+	free(intersection);
+}
+
+/* Makes room for one more, the domain in use stays */
+static void reg_intersections_shrink(void)
+{
+	struct reg_intersection *intersection;
+
+	if (reg_n_intersections < REG_INTERSECT_MAX)
+		return;
+
+	dl_list_for_each_reverse(intersection, &reg_intersect_lru,
+				 struct reg_intersection, lru) {
+		if (intersection->rd != regcore->regd) {
+			reg_intersection_free(intersection);
+			return;
+		}
+	}
+}
+
+/**
+ * reglib_intersect_regdoms - intersect two regulatory domains
+ * @rd1: first regulatory domain
+ * @rd2: second regulatory domain
+ *
+ * Returns the intersection of the two domains: the frequency ranges both
+ * permit with the lower power and bandwidth limits of the two and the
+ * flags of both. The result is memoized and owned by the regulatory
+ * library, asking for domains with the same alpha2 and rules again, in
+ * either order, returns the same intersection as long as it is memoized.
+ * The memo keeps copies of the domains, they only have to be valid for
+ * the call. Must be called with the regulatory core's lock held. The
+ * intersection stays valid until the next call, or for as long as it is
+ * the current regulatory domain.
+ *
+ * Returns %NULL if the domains have nothing in common or if we ran out
+ * of memory.
+ */
+const struct ieee80211_regdomain *
+reglib_intersect_regdoms(const struct ieee80211_regdomain *rd1,
+			 const struct ieee80211_regdomain *rd2)
+{
+	const struct ieee80211_regdomain *tmp;
+	struct reg_intersection *intersection;
+	struct dl_list *bucket;
+	uint32_t hash1, hash2, tmp_hash;
+
+	hash1 = reg_regd_hash(rd1);
+	hash2 = reg_regd_hash(rd2);
+	if (reg_regd_cmp(rd1, hash1, rd2, hash2) > 0) {
+		tmp = rd1;
+		rd1 = rd2;
+		rd2 = tmp;
+		tmp_hash = hash1;
+		hash1 = hash2;
+		hash2 = tmp_hash;
+	}
+
+	bucket = &reg_intersections[reg_intersect_hash(hash1, hash2)];
+
+	dl_list_for_each(intersection, bucket, struct reg_intersection, list) {
+		if (intersection->hash1 == hash1 &&
+		    intersection->hash2 == hash2 &&
+		    reg_regd_same(intersection->rd1, rd1) &&
+		    reg_regd_same(intersection->rd2, rd2)) {
+			dl_list_del(&intersection->lru);
+			dl_list_add(&reg_intersect_lru, &intersection->lru);
+			return intersection->rd;
+		}
+	}
+
+	reg_intersections_shrink();
+
+	intersection = malloc(sizeof(struct reg_intersection));
+	if (!intersection)
+		return NULL;
+
+	intersection->rd1 = reg_regd_dup(rd1);
+	intersection->rd2 = reg_regd_dup(rd2);
+	if (!intersection->rd1 || !intersection->rd2) {
+		free(intersection->rd1);
+		free(intersection->rd2);
+		free(intersection);
+		return NULL;
+	}
+
+	intersection->hash1 = hash1;
+	intersection->hash2 = hash2;
+	intersection->rd = reg_intersect_rds(rd1, rd2);
+	dl_list_add(bucket, &intersection->list);
+	dl_list_add(&reg_intersect_lru, &intersection->lru);
+	reg_n_intersections++;
+
+	return intersection->rd;
+}
+
+static void reg_intersections_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < REG_INTERSECT_HASH_SIZE; i++)
+		dl_list_init(&reg_intersections[i]);
+	dl_list_init(&reg_intersect_lru);
+	reg_n_intersections = 0;
+}
+
+static void reg_intersections_free(void)
 {
-	if (reglib_is_world_regdom(rd->alpha2))
-		printf("World regulatory domain updated:\n");
-	else
-		printf("Regulatory domain changed to country: %c%c\n",
-		       rd->alpha2[0], rd->alpha2[1]);
+	struct reg_intersection *intersection, *tmp;
 
-	print_rd_rules(rd);
+	dl_list_for_each_safe(intersection, tmp, &reg_intersect_lru,
+			      struct reg_intersection, lru)
+		reg_intersection_free(intersection);
 }
 
 static void reg_set_request_processed(void)
@@ -387,12 +2787,82 @@ static int ignore_request(struct ieee80211_dev_regulatory *reg,
 	}
 }
 
+/**
+ * struct reg_batch - requests processed in one go
+ *
+ * @requests: the requests, oldest first, %NULL for those dropped
+ * @n_requests: number of entries in @requests
+ * @retired: requests which stopped being the last request, freed after
+ *	a single grace period for all of them
+ * @n_retired: number of entries in @retired
+ * @devs: devices to update after all requests have been processed
+ * @initiators: for each of @devs the initiator to update it for
+ * @n_devs: number of entries in @devs
+ */
+struct reg_batch {
+	struct regulatory_request *requests[REG_REQUEST_QUEUE_SIZE];
+	unsigned int n_requests;
+	struct regulatory_request *retired[REG_REQUEST_QUEUE_SIZE];
+	unsigned int n_retired;
+	struct ieee80211_dev_regulatory *devs[REG_REQUEST_QUEUE_SIZE];
+	enum ieee80211_reg_initiator initiators[REG_REQUEST_QUEUE_SIZE];
+	unsigned int n_devs;
+};
+
+static void reg_batch_update_dev(struct reg_batch *batch,
+				 struct ieee80211_dev_regulatory *reg,
+				 enum ieee80211_reg_initiator initiator)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->n_devs; i++)
+		if (batch->devs[i] == reg)
+			break;
+
+	if (i == batch->n_devs) {
+		batch->devs[i] = reg;
+		batch->n_devs++;
+	}
+	batch->initiators[i] = initiator;
+}
+
+/*
+ * Requests are handed to us by the reglib user, which may well have
+ * allocated them from somewhere else than malloc().
+ */
+static void reg_request_free(struct regulatory_request *request)
+{
+	if (regcore->ops && regcore->ops->free_request)
+		regcore->ops->free_request(request);
+	else
+		free(request);
+}
+
+/* Updates the devices and frees the requests the batch left behind */
+static void reg_batch_finish(struct reg_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->n_devs; i++)
+		reglib_regdev_update(batch->devs[i], batch->initiators[i]);
+
+	if (!batch->n_retired)
+		return;
+
+	/* Lookups may still be on any of them */
+	reglib_synchronize();
+
+	for (i = 0; i < batch->n_retired; i++)
+		reg_request_free(batch->retired[i]);
+}
+
 /**
  * __regulatory_hint - hint to the wireless core a regulatory domain
  * @reg: if the hint comes from country information from an AP, this
  *	is required to be set to the device's regulatory data that
  *	received the information.
  * @pending_request: the regulatory request currently being processed
+ * @batch: the batch @pending_request is processed in
  *
  * The wireless subsystem can use this function to hint to the wireless core
  * what it believes should be the current regulatory domain.
@@ -401,8 +2871,10 @@ static int ignore_request(struct ieee80211_dev_regulatory *reg,
  * already been set or other standard error codes.
  */
 static int __regulatory_hint(struct ieee80211_dev_regulatory *reg,
-			     struct regulatory_request *pending_request)
+			     struct regulatory_request *pending_request,
+			     struct reg_batch *batch)
 {
+	struct regulatory_request *old_request;
 	bool intersect = false;
 	int r = 0;
 
@@ -411,9 +2883,9 @@ static int __regulatory_hint(struct ieee80211_dev_regulatory *reg,
 	if (r == REG_INTERSECT) {
 		if (pending_request->initiator ==
 		    IEEE80211_REGDOM_SET_BY_DRIVER) {
-			r = reg_copy_regd(&reg->regd, regcore->regd);
+			r = reg_dev_set_regd(reg, regcore->regd);
 			if (r) {
-				free(pending_request);
+				reg_request_free(pending_request);
 				return r;
 			}
 		}
@@ -427,24 +2899,27 @@ static int __regulatory_hint(struct ieee80211_dev_regulatory *reg,
 		if (r == -EALREADY &&
 		    pending_request->initiator ==
 		    IEEE80211_REGDOM_SET_BY_DRIVER) {
-			r = reg_copy_regd(&reg->regd, regcore->regd);
+			r = reg_dev_set_regd(reg, regcore->regd);
 			if (r) {
-				free(pending_request);
+				reg_request_free(pending_request);
 				return r;
 			}
 			r = -EALREADY;
 			goto new_request;
 		}
-		free(pending_request);
+		reg_request_free(pending_request);
 		return r;
 	}
 
 new_request:
-	if (regcore->last_request != &core_request_world)
-		free(regcore->last_request);
+	old_request = regcore->last_request;
 
-	regcore->last_request = pending_request;
-	regcore->last_request->intersect = intersect;
+	pending_request->intersect = intersect;
+	__atomic_store_n(&regcore->last_request, pending_request,
+			 __ATOMIC_RELEASE);
+
+	if (old_request != &core_request_world)
+		batch->retired[batch->n_retired++] = old_request;
 
 	pending_request = NULL;
 
@@ -471,7 +2946,8 @@ new_request:
 }
 
 /* This processes *all* regulatory hints */
-void reglib_process_hint(struct regulatory_request *reg_request)
+static void reg_process_hint(struct regulatory_request *reg_request,
+			     struct reg_batch *batch)
 {
 	int r = 0;
 	struct ieee80211_dev_regulatory *reg = reg_request->reg;
@@ -481,19 +2957,111 @@ void reglib_process_hint(struct regulatory_request *reg_request)
 
 	if (reg_request->initiator == IEEE80211_REGDOM_SET_BY_DRIVER &&
 	    !reg) {
-		free(reg_request);
+		reg_request_free(reg_request);
 		return;
 	}
 
-	r = __regulatory_hint(reg, reg_request);
+	r = __regulatory_hint(reg, reg_request, batch);
 	/* This is required so that the orig_* parameters are saved */
 	if (r == -EALREADY && reg &&
 	    reg->flags & IEEE80211_REGD_STRICT_REGULATORY) {
-		reglib_regdev_update(reg, initiator);
+		reg_batch_update_dev(batch, reg, initiator);
 		return;
 	}
 }
 
+void reglib_process_hint(struct regulatory_request *reg_request)
+{
+	struct reg_batch batch;
+
+	batch.n_retired = 0;
+	batch.n_devs = 0;
+
+	reg_process_hint(reg_request, &batch);
+	reg_batch_finish(&batch);
+}
+
+/*
+ * Drops the requests a later one from the same initiator, and for the
+ * same device, supersedes: the later one replaces whatever they set.
+ */
+static void reg_batch_drop_superseded(struct reg_batch *batch)
+{
+	struct regulatory_request *request, *later;
+	unsigned int i, j;
+
+	for (i = batch->n_requests; i-- > 0;) {
+		request = batch->requests[i];
+		for (j = i + 1; j < batch->n_requests; j++) {
+			later = batch->requests[j];
+			if (later && later->initiator == request->initiator &&
+			    later->reg == request->reg)
+				break;
+		}
+		if (j == batch->n_requests)
+			continue;
+
+		reg_request_free(request);
+		batch->requests[i] = NULL;
+	}
+}
+
+/**
+ * reglib_process_hints - process all queued requests in one go
+ *
+ * Takes all requests off the queue. Those which a later request from
+ * the same initiator, and for the same device, supersedes are dropped
+ * and the others processed in order. Devices the requests affect are
+ * updated once, after all of them, and the requests they replaced as
+ * the last request are freed after a single grace period. So the work
+ * done grows with the number of distinct requests, not with the number
+ * of requests queued. Only one thread at a time may process requests.
+ *
+ * Returns the number of requests taken off the queue.
+ */
+unsigned int reglib_process_hints(void)
+{
+	struct reg_batch *batch;
+	struct regulatory_request *request;
+	unsigned int i, n = 0;
+
+	batch = malloc(sizeof(struct reg_batch));
+	if (!batch) {
+		/* Make do with one at a time */
+		while ((request = reglib_next_request())) {
+			reglib_process_hint(request);
+			n++;
+		}
+		return n;
+	}
+
+	do {
+		batch->n_requests = 0;
+		batch->n_retired = 0;
+		batch->n_devs = 0;
+
+		while (batch->n_requests < REG_REQUEST_QUEUE_SIZE) {
+			request = reglib_next_request();
+			if (!request)
+				break;
+			batch->requests[batch->n_requests++] = request;
+		}
+
+		reg_batch_drop_superseded(batch);
+
+		for (i = 0; i < batch->n_requests; i++)
+			if (batch->requests[i])
+				reg_process_hint(batch->requests[i], batch);
+
+		reg_batch_finish(batch);
+		n += batch->n_requests;
+	} while (batch->n_requests == REG_REQUEST_QUEUE_SIZE);
+
+	free(batch);
+
+	return n;
+}
+
 
 #ifdef CONFIG_REGLIB_DEBUG
 static const char *reglib_initiator_name(enum ieee80211_reg_initiator initiator)
@@ -550,6 +3118,26 @@ static void chan_reg_rule_print_dbg(struct ieee80211_channel *chan,
 }
 #endif /* CONFIG_REGLIB_DEBUG */
 
+/*
+ * Every device registered resolves its channels against the same
+ * regulatory domain with the same query (see reglib_handle_channel()),
+ * the channel map cache keeps the result of those queries keyed by the
+ * regulatory domain and the channel's center frequency so that they are
+ * only resolved once and reused across devices.
+ */
+#define REG_CHAN_CACHE_BITS	10
+#define REG_CHAN_CACHE_SIZE	(1 << REG_CHAN_CACHE_BITS)
+
+/*
+ * XXX: add support for keeping track of target EIRP and
+ * cache that into the ieee80211_channel data structure.
+ * This will require updating the target EIRP on any power
+ * change if want to optimize for seeking the best rule
+ * depending on both target power and bandwidth. For now use
+ * an arbitrary max high value.
+ */
+#define REG_CHAN_TARGET_EIRP_MBM	DBM_TO_MBM(31.5)
+
 /*
  * Note that right now we assume the desired channel bandwidth
  * is always 20 MHz for each individual channel (HT40 uses 20 MHz
@@ -559,131 +3147,665 @@ static void chan_reg_rule_print_dbg(struct ieee80211_channel *chan,
  * on the wiphy with the target_bw specified. Then we can simply use
  * that below for the desired_bw_khz below.
  */
+#define REG_CHAN_DESIRED_BW_KHZ		MHZ_TO_KHZ(20)
+
+/**
+ * struct reg_chan_map_entry - a channel resolved against a regulatory domain
+ *
+ * @regd: the regulatory domain the channel was resolved against
+ * @generation: the cache generation this entry was filled in at, entries
+ *	from older generations are stale
+ * @center_freq: center frequency of the channel in MHz
+ * @r: the result of the lookup, 0 or the error reglib_freq_info() gave
+ * @reg_rule: the rule the channel falls under, if @r is 0
+ * @bw_flags: the IEEE80211_CHAN_NO_HT40* flags of the channel
+ * @max_antenna_gain: maximum antenna gain the rule allows, in dBi
+ * @max_power: maximum EIRP the rule allows, in dBm
+ */
+struct reg_chan_map_entry {
+	const struct ieee80211_regdomain *regd;
+	unsigned int generation;
+	uint16_t center_freq;
+	int r;
+	const struct ieee80211_reg_rule *reg_rule;
+	uint32_t bw_flags;
+	int max_antenna_gain;
+	int max_power;
+};
+
+/**
+ * struct reg_chan_map - the channel map cache
+ *
+ * @generation: current generation, bumped to invalidate all entries
+ * @regd: the regcore's regd when the cache was last validated
+ * @world_regd: the regcore's world_regd when the cache was last validated
+ * @entries: direct mapped cache entries
+ */
+static struct reg_chan_map {
+	unsigned int generation;
+	const struct ieee80211_regdomain *regd;
+	const struct ieee80211_regdomain *world_regd;
+	struct reg_chan_map_entry entries[REG_CHAN_CACHE_SIZE];
+} reg_chan_map = {
+	.generation = 1,
+};
+
+static void reg_chan_map_flush(void)
+{
+	reg_chan_map.generation++;
+}
+
+/* Drops all cached channels if the regcore's domains have changed */
+static void reg_chan_map_validate(void)
+{
+	if (reg_chan_map.regd == regcore->regd &&
+	    reg_chan_map.world_regd == regcore->world_regd)
+		return;
+
+	reg_chan_map.regd = regcore->regd;
+	reg_chan_map.world_regd = regcore->world_regd;
+	reg_chan_map_flush();
+}
+
+static unsigned int reg_chan_map_hash(const struct ieee80211_regdomain *regd,
+				      uint16_t center_freq)
+{
+	uint32_t h;
+
+	h = (uint32_t) ((uintptr_t) regd >> 4) * 0x9e3779b1;
+	h ^= center_freq * 0x85ebca6b;
+
+	return h >> (32 - REG_CHAN_CACHE_BITS);
+}
+
+/*
+ * The IEEE80211_CHAN_NO_HT40* flags for a channel, from where the domain
+ * permits the channel's secondary channel. Channels off the band's
+ * channel grid can not be used for HT40 at all.
+ */
+static uint32_t reg_chan_ht40_flags(const struct ieee80211_regdomain *regd,
+				    uint16_t center_freq)
+{
+	const struct reglib_chan_avail *avail;
+	struct reglib_chan_avail chan_avail;
+	enum ieee80211_band band;
+	uint32_t flags = 0;
+	int chan;
+
+	band = reglib_freq_to_band(MHZ_TO_KHZ(center_freq));
+	chan = reglib_freq_to_chan(band, center_freq);
+	if (chan < 0)
+		return IEEE80211_CHAN_NO_HT40;
+
+	if (regd->index)
+		avail = &regd->index->chans[band];
+	else {
+		memset(&chan_avail, 0, sizeof(struct reglib_chan_avail));
+		reg_chan_avail_fill(regd, NULL, band, chan, &chan_avail);
+		avail = &chan_avail;
+	}
+
+	if (!reglib_chan_test(&avail->ht40plus, chan))
+		flags |= IEEE80211_CHAN_NO_HT40PLUS;
+	if (!reglib_chan_test(&avail->ht40minus, chan))
+		flags |= IEEE80211_CHAN_NO_HT40MINUS;
+
+	return flags;
+}
+
+static const struct reg_chan_map_entry *
+reg_chan_map_lookup(const struct ieee80211_regdomain *regd,
+		    uint16_t center_freq)
+{
+	struct reg_chan_map_entry *entry;
+	const struct ieee80211_reg_rule *reg_rule = NULL;
+	const struct ieee80211_power_rule *power_rule;
+
+	entry = &reg_chan_map.entries[reg_chan_map_hash(regd, center_freq)];
+
+	if (entry->generation == reg_chan_map.generation &&
+	    entry->regd == regd &&
+	    entry->center_freq == center_freq)
+		return entry;
+
+	memset(entry, 0, sizeof(struct reg_chan_map_entry));
+	entry->regd = regd;
+	entry->generation = reg_chan_map.generation;
+	entry->center_freq = center_freq;
+
+	entry->r = reg_freq_info(regd,
+				 MHZ_TO_KHZ(center_freq),
+				 REG_CHAN_TARGET_EIRP_MBM,
+				 REG_CHAN_DESIRED_BW_KHZ,
+				 &reg_rule);
+	if (entry->r)
+		return entry;
+
+	entry->reg_rule = reg_rule;
+	power_rule = &reg_rule->power_rule;
+
+	entry->bw_flags = reg_chan_ht40_flags(regd, center_freq);
+
+	entry->max_antenna_gain =
+		(int) MBI_TO_DBI(power_rule->max_antenna_gain);
+	entry->max_power = (int) MBM_TO_DBM(power_rule->max_eirp);
+
+	return entry;
+}
+
+/* Flags each of the &enum reglib_chan_map bitmaps mirror */
+static const uint32_t reg_chan_map_flags[REGLIB_NUM_CHAN_MAPS] = {
+	[REGLIB_CHANS_ENABLED] = IEEE80211_CHAN_DISABLED,
+	[REGLIB_CHANS_PASSIVE_SCAN] = IEEE80211_CHAN_PASSIVE_SCAN,
+	[REGLIB_CHANS_NO_IBSS] = IEEE80211_CHAN_NO_IBSS,
+	[REGLIB_CHANS_RADAR] = IEEE80211_CHAN_RADAR,
+	[REGLIB_CHANS_NO_HT40PLUS] = IEEE80211_CHAN_NO_HT40PLUS,
+	[REGLIB_CHANS_NO_HT40MINUS] = IEEE80211_CHAN_NO_HT40MINUS,
+};
+
+/* Brings a device's channel bitmaps in line with a channel's flags */
+static void reg_dev_chans_update(struct ieee80211_dev_regulatory *reg,
+				 const struct ieee80211_channel *chan)
+{
+	struct reglib_chan_bitmap *maps;
+	unsigned int i;
+	bool set;
+	int nr;
+
+	nr = reglib_freq_to_chan(chan->band, chan->center_freq);
+	if (nr < 0)
+		return;
+
+	maps = reg->chans[chan->band];
+
+	for (i = 0; i < REGLIB_NUM_CHAN_MAPS; i++) {
+		set = chan->flags & reg_chan_map_flags[i];
+		if (i == REGLIB_CHANS_ENABLED)
+			set = !set;
+		if (set)
+			reglib_chan_set(&maps[i], nr);
+		else
+			reglib_chan_clear(&maps[i], nr);
+	}
+}
+
+/* Builds a device's channel bitmaps from scratch */
+static void reg_dev_chans_init(struct ieee80211_dev_regulatory *reg)
+{
+	struct ieee80211_supported_band *sband;
+	enum ieee80211_band band;
+	unsigned int i;
+
+	memset(reg->chans, 0, sizeof(reg->chans));
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		sband = reg->bands[band];
+		if (!sband)
+			continue;
+		for (i = 0; i < sband->n_channels; i++)
+			reg_dev_chans_update(reg, &sband->channels[i]);
+	}
+}
+
 static void reglib_handle_channel(struct ieee80211_dev_regulatory *reg,
 				  enum ieee80211_reg_initiator initiator,
 				  enum ieee80211_band band,
 				  unsigned int chan_idx)
 {
-	int r;
-	uint32_t flags, bw_flags = 0;
-	uint32_t desired_bw_khz = MHZ_TO_KHZ(20);
-	const struct ieee80211_reg_rule *reg_rule = NULL;
-	const struct ieee80211_power_rule *power_rule = NULL;
-	const struct ieee80211_freq_range *freq_range = NULL;
-	struct ieee80211_supported_band *sband;
-	struct ieee80211_channel *chan;
-	struct ieee80211_dev_regulatory *request_reg= NULL;
+	uint32_t flags;
+	const struct reg_chan_map_entry *entry;
+	struct ieee80211_supported_band *sband;
+	struct ieee80211_channel *chan;
+	struct ieee80211_dev_regulatory *request_reg= NULL;
+
+	request_reg = regcore->last_request->reg;
+
+	sband = reg->bands[band];
+	BUG_ON(chan_idx >= sband->n_channels);
+	chan = &sband->channels[chan_idx];
+
+	flags = chan->orig_flags;
+
+	entry = reg_chan_map_lookup(reg_get_regd(reg, NULL), chan->center_freq);
+
+	if (entry->r) {
+		/*
+		 * We will disable all channels that do not match our
+		 * received regulatory rule unless the hint is coming
+		 * from a Country IE and the Country IE had no information
+		 * about a band. The IEEE 802.11 spec allows for an AP
+		 * to send only a subset of the regulatory rules allowed,
+		 * so an AP in the US that only supports 2.4 GHz may only send
+		 * a country IE with information for the 2.4 GHz band
+		 * while 5 GHz is still supported.
+		 */
+		if (initiator == IEEE80211_REGDOM_SET_BY_COUNTRY_IE &&
+		    entry->r == -ERANGE)
+			return;
+
+		REG_DBG_PRINT("Disabling freq %d MHz\n", chan->center_freq);
+		chan->flags = IEEE80211_CHAN_DISABLED;
+		goto out;
+	}
+
+	chan_reg_rule_print_dbg(chan, REG_CHAN_DESIRED_BW_KHZ, entry->reg_rule);
+
+	if (regcore->last_request->initiator == IEEE80211_REGDOM_SET_BY_DRIVER &&
+	    request_reg && request_reg == reg &&
+	    request_reg->flags & IEEE80211_REGD_STRICT_REGULATORY) {
+		/*
+		 * This guarantees the driver's requested regulatory domain
+		 * will always be used as a base for further regulatory
+		 * settings
+		 */
+		chan->flags = chan->orig_flags =
+			entry->reg_rule->flags | entry->bw_flags;
+		chan->max_antenna_gain = chan->orig_mag =
+			entry->max_antenna_gain;
+		chan->max_power = chan->orig_mpwr = entry->max_power;
+		goto out;
+	}
+
+	chan->beacon_found = false;
+	chan->flags = flags | entry->bw_flags | entry->reg_rule->flags;
+	chan->max_antenna_gain = min(chan->orig_mag, entry->max_antenna_gain);
+	if (chan->orig_mpwr)
+		chan->max_power = min(chan->orig_mpwr, entry->max_power);
+	else
+		chan->max_power = entry->max_power;
+out:
+	reg_dev_chans_update(reg, chan);
+}
+
+static void reglib_handle_band(struct ieee80211_dev_regulatory *reg,
+			       enum ieee80211_band band,
+			       enum ieee80211_reg_initiator initiator)
+{
+	unsigned int i;
+	struct ieee80211_supported_band *sband;
+
+	BUG_ON(!reg->bands[band]);
+	sband = reg->bands[band];
+
+	for (i = 0; i < sband->n_channels; i++)
+		reglib_handle_channel(reg, initiator, band, i);
+}
+
+static struct reg_pending *
+reg_pending_find(struct reg_request_queue *queue,
+		 const struct regulatory_request *request)
+{
+	uint32_t h;
+
+	h = (uint32_t) ((uintptr_t) request->reg >> 4);
+	h ^= request->initiator << 16 |
+	     (uint8_t) request->alpha2[0] << 8 |
+	     (uint8_t) request->alpha2[1];
+	h *= 0x9e3779b1;
+
+	return &queue->pending[h >> (32 - REG_PENDING_BITS)];
+}
+
+/*
+ * Whether a request like request is in pending, not yet taken and the
+ * newest request of its queue. Merging into one with others queued after
+ * it would have request processed before those, though it came after.
+ */
+static bool reg_pending_merge(struct reg_request_queue *queue,
+			      struct reg_pending *pending,
+			      const struct regulatory_request *request)
+{
+	unsigned long state, pos;
+	bool same;
+
+	state = __atomic_load_n(&pending->state, __ATOMIC_ACQUIRE);
+	if ((state & REG_PENDING_MASK) != REG_PENDING_QUEUED)
+		return false;
+
+	pos = __atomic_load_n(&pending->pos, __ATOMIC_RELAXED);
+	same = __atomic_load_n(&pending->reg, __ATOMIC_RELAXED) ==
+	       request->reg &&
+	       __atomic_load_n(&pending->initiator, __ATOMIC_RELAXED) ==
+	       request->initiator &&
+	       __atomic_load_n(&pending->alpha2[0], __ATOMIC_RELAXED) ==
+	       request->alpha2[0] &&
+	       __atomic_load_n(&pending->alpha2[1], __ATOMIC_RELAXED) ==
+	       request->alpha2[1];
+
+	/* Pairs with the one in reg_pending_claim() */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (!same || __atomic_load_n(&pending->state, __ATOMIC_RELAXED) != state)
+		return false;
+
+	/* A request set aside is newer than all queued */
+	return pos == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - 1 &&
+	       !__atomic_load_n(&queue->overflow, __ATOMIC_RELAXED);
+}
+
+/*
+ * Records request, queued at pos, in pending in place of any older
+ * request recorded there, so that requests like it are merged into it
+ * while it is the newest queued.
+ */
+static void reg_pending_claim(struct reg_request_queue *queue,
+			      struct reg_pending *pending,
+			      struct regulatory_request *request,
+			      unsigned long pos)
+{
+	unsigned long state;
+
+	request->pending = -1;
+
+	state = __atomic_load_n(&pending->state, __ATOMIC_RELAXED);
+	do {
+		/* Another request is being recorded there, leave it be */
+		if ((state & REG_PENDING_MASK) == REG_PENDING_CLAIMED)
+			return;
+	} while (!__atomic_compare_exchange_n(&pending->state, &state,
+					      (state & ~REG_PENDING_MASK) +
+					      REG_PENDING_GEN +
+					      REG_PENDING_CLAIMED,
+					      false, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	/* Pairs with the one in reg_pending_merge() */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&pending->pos, pos, __ATOMIC_RELAXED);
+	__atomic_store_n(&pending->reg, request->reg, __ATOMIC_RELAXED);
+	__atomic_store_n(&pending->initiator, request->initiator,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&pending->alpha2[0], request->alpha2[0],
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&pending->alpha2[1], request->alpha2[1],
+			 __ATOMIC_RELAXED);
+
+	request->pending = pending - queue->pending;
+	request->pending_state = (state & ~REG_PENDING_MASK) +
+				 2 * REG_PENDING_GEN + REG_PENDING_QUEUED;
+	__atomic_store_n(&pending->state, request->pending_state,
+			 __ATOMIC_RELEASE);
+}
+
+/* Raises the high water mark of the queue's depth to depth */
+static void reg_queue_stats_depth(struct reg_request_queue *queue,
+				  unsigned int depth)
+{
+	unsigned int max_depth;
+
+	max_depth = __atomic_load_n(&queue->stats.max_depth, __ATOMIC_RELAXED);
+	while (max_depth < depth &&
+	       !__atomic_compare_exchange_n(&queue->stats.max_depth,
+					    &max_depth, depth, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Sets request aside in place of the one set aside before, if any */
+static void reg_queue_coalesce(struct reg_request_queue *queue,
+			       struct regulatory_request *request)
+{
+	struct regulatory_request *dropped;
+
+	request->pending = -1;
+
+	dropped = __atomic_exchange_n(&queue->overflow, request,
+				      __ATOMIC_ACQ_REL);
+	if (!dropped)
+		return;
+
+	reg_request_free(dropped);
+	__atomic_add_fetch(&queue->stats.coalesced, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * reglib_queue_request - queue a regulatory request for processing
+ * @request: the request
+ *
+ * May be called from any number of threads at once, without locks. A
+ * request from the same initiator and device for the same alpha2 as the
+ * newest request queued for that initiator is merged into that one: it
+ * would only be processed right after it, to the same effect. Requests
+ * queued in between keep it from being merged, as it would then be
+ * processed before them. What becomes of a request for a full queue
+ * depends on the initiator's &struct reglib_queue_params, at most one
+ * request of each initiator is set aside beyond its limit.
+ *
+ * Returns 0 if @request was queued or set aside, in which case it is
+ * the regulatory core's from then on, -EALREADY if it was merged into a
+ * queued request, -ENOSPC if the queue is full and -EINVAL if the
+ * initiator is invalid.
+ */
+int reglib_queue_request(struct regulatory_request *request)
+{
+	struct reg_request_queue *queue;
+	struct reg_pending *pending;
+	struct reg_request_cell *cell;
+	unsigned long pos, seq;
+	unsigned int depth;
 
-	request_reg = regcore->last_request->reg;
+	if (request->initiator >= REGLIB_NUM_INITIATORS)
+		return -EINVAL;
 
-	sband = reg->bands[band];
-	BUG_ON(chan_idx >= sband->n_channels);
-	chan = &sband->channels[chan_idx];
+	queue = &regcore->requests[request->initiator];
 
-	flags = chan->orig_flags;
+	pending = reg_pending_find(queue, request);
+	if (reg_pending_merge(queue, pending, request)) {
+		__atomic_add_fetch(&queue->stats.merged, 1, __ATOMIC_RELAXED);
+		return -EALREADY;
+	}
 
-	/*
-	 * XXX: add support for keeping track of target EIRP and
-	 * cache that into the ieee80211_channel data structure.
-	 * This will require updating the target EIRP on any power
-	 * change if want to optimize for seeking the best rule
-	 * depending on both target power and bandwidth. For now use
-	 * an arbitrary max high value.
-	 */
-	r = reglib_freq_info(reg,
-			     MHZ_TO_KHZ(chan->center_freq),
-			     DBM_TO_MBM(31.5),
-			     desired_bw_khz,
-			     &reg_rule);
+	depth = __atomic_add_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+	if (depth > __atomic_load_n(&queue->params.limit, __ATOMIC_RELAXED)) {
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&queue->params.policy, __ATOMIC_RELAXED) ==
+		    REGLIB_QUEUE_COALESCE) {
+			reg_queue_coalesce(queue, request);
+			return 0;
+		}
+		__atomic_add_fetch(&queue->stats.rejected, 1, __ATOMIC_RELAXED);
+		return -ENOSPC;
+	}
 
-	if (r) {
-		/*
-		 * We will disable all channels that do not match our
-		 * received regulatory rule unless the hint is coming
-		 * from a Country IE and the Country IE had no information
-		 * about a band. The IEEE 802.11 spec allows for an AP
-		 * to send only a subset of the regulatory rules allowed,
-		 * so an AP in the US that only supports 2.4 GHz may only send
-		 * a country IE with information for the 2.4 GHz band
-		 * while 5 GHz is still supported.
-		 */
-		if (initiator == IEEE80211_REGDOM_SET_BY_COUNTRY_IE &&
-		    r == -ERANGE)
-			return;
+	reg_queue_stats_depth(queue, depth);
 
-		REG_DBG_PRINT("Disabling freq %d MHz\n", chan->center_freq);
-		chan->flags = IEEE80211_CHAN_DISABLED;
-		return;
+	pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	while (true) {
+		cell = &queue->cells[pos & (REG_REQUEST_QUEUE_SIZE - 1)];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&queue->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((long) (seq - pos) < 0) {
+			/* Being taken off, as count had room for us */
+			sched_yield();
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
 	}
 
-	chan_reg_rule_print_dbg(chan, desired_bw_khz, reg_rule);
+	reg_pending_claim(queue, pending, request, pos);
 
-	power_rule = &reg_rule->power_rule;
-	freq_range = &reg_rule->freq_range;
+	cell->request = request;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-	if (freq_range->max_bandwidth_khz < MHZ_TO_KHZ(40))
-		bw_flags = IEEE80211_CHAN_NO_HT40;
+	__atomic_add_fetch(&queue->stats.queued, 1, __ATOMIC_RELAXED);
 
-	if (regcore->last_request->initiator == IEEE80211_REGDOM_SET_BY_DRIVER &&
-	    request_reg && request_reg == reg &&
-	    request_reg->flags & IEEE80211_REGD_STRICT_REGULATORY) {
-		/*
-		 * This guarantees the driver's requested regulatory domain
-		 * will always be used as a base for further regulatory
-		 * settings
-		 */
-		chan->flags = chan->orig_flags = reg_rule->flags | bw_flags;
-		chan->max_antenna_gain = chan->orig_mag =
-			(int) MBI_TO_DBI(power_rule->max_antenna_gain);
-		chan->max_power = chan->orig_mpwr =
-			(int) MBM_TO_DBM(power_rule->max_eirp);
-		return;
+	return 0;
+}
+
+static struct regulatory_request *
+reg_queue_take(struct reg_request_queue *queue)
+{
+	struct regulatory_request *request;
+	struct reg_request_cell *cell;
+	struct reg_pending *pending;
+	unsigned long state;
+
+	cell = &queue->cells[queue->head & (REG_REQUEST_QUEUE_SIZE - 1)];
+	if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != queue->head + 1) {
+		if (!__atomic_load_n(&queue->overflow, __ATOMIC_RELAXED))
+			return NULL;
+		return __atomic_exchange_n(&queue->overflow, NULL,
+					   __ATOMIC_ACQUIRE);
 	}
 
-	chan->beacon_found = false;
-	chan->flags = flags | bw_flags | reg_rule->flags;
-	chan->max_antenna_gain = min(chan->orig_mag,
-		(int) MBI_TO_DBI(power_rule->max_antenna_gain));
-	if (chan->orig_mpwr)
-		chan->max_power = min(chan->orig_mpwr,
-			(int) MBM_TO_DBM(power_rule->max_eirp));
-	else
-		chan->max_power = (int) MBM_TO_DBM(power_rule->max_eirp);
+	request = cell->request;
+
+	/*
+	 * Requests like it are no longer merged into it, unless a newer
+	 * request took its place in the table already.
+	 */
+	if (request->pending >= 0) {
+		pending = &queue->pending[request->pending];
+		state = request->pending_state;
+		__atomic_compare_exchange_n(&pending->state, &state,
+					    state + REG_PENDING_GEN -
+					    REG_PENDING_QUEUED + REG_PENDING_FREE,
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&cell->seq, queue->head + REG_REQUEST_QUEUE_SIZE,
+			 __ATOMIC_RELEASE);
+	queue->head++;
+	__atomic_sub_fetch(&queue->count, 1, __ATOMIC_RELEASE);
+
+	return request;
 }
 
-static void reglib_handle_band(struct ieee80211_dev_regulatory *reg,
-			       enum ieee80211_band band,
-			       enum ieee80211_reg_initiator initiator)
+/**
+ * reglib_next_request - take the next request to process off its queue
+ *
+ * That is the oldest request of the initiator with the highest priority
+ * which has any queued. Only one thread at a time may take requests off
+ * the queues, which the caller's lock of the regulatory core takes care
+ * of. A request still being queued by another thread may not be found
+ * yet, whoever queues it has to have this called again afterwards.
+ *
+ * Returns the request, which is the caller's from then on, or %NULL if
+ * there is none.
+ */
+struct regulatory_request *reglib_next_request(void)
 {
+	struct regulatory_request *request;
+	struct reg_request_queue *queue;
 	unsigned int i;
-	struct ieee80211_supported_band *sband;
 
-	BUG_ON(!reg->bands[band]);
-	sband = reg->bands[band];
+	for (i = 0; i < REGLIB_NUM_INITIATORS; i++) {
+		queue = &regcore->requests[regcore->request_order[i]];
+		request = reg_queue_take(queue);
+		if (request)
+			return request;
+	}
 
-	for (i = 0; i < sband->n_channels; i++)
-		reglib_handle_channel(reg, initiator, band, i);
+	return NULL;
 }
 
-void reglib_queue_request(struct regulatory_request *request)
+/* Sorts the initiators by priority, stable to keep ties in enum order */
+static void reg_queue_order(void)
 {
-	dl_list_add_tail(&regcore->requests_list, &request->list);
+	enum ieee80211_reg_initiator *order = regcore->request_order;
+	struct reg_request_queue *queues = regcore->requests;
+	unsigned int i, j;
+
+	for (i = 0; i < REGLIB_NUM_INITIATORS; i++) {
+		for (j = i; j > 0; j--) {
+			if (queues[order[j - 1]].params.priority >=
+			    queues[i].params.priority)
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
 }
 
-struct regulatory_request *reglib_next_request(void)
+/**
+ * reglib_set_queue_params - change how the requests of an initiator queue
+ * @initiator: the initiator
+ * @params: how its requests are to be queued from now on
+ *
+ * Requests queued already stay queued, even if that is more than the new
+ * limit. Only one thread at a time may change the parameters or take
+ * requests off the queues.
+ *
+ * Returns 0 on success or -EINVAL if @initiator or @params is invalid.
+ */
+int reglib_set_queue_params(enum ieee80211_reg_initiator initiator,
+			    const struct reglib_queue_params *params)
 {
-	struct regulatory_request *request, *tmp;
+	struct reg_request_queue *queue;
 
-	if (dl_list_empty(&regcore->requests_list))
-		return NULL;
+	if (initiator >= REGLIB_NUM_INITIATORS ||
+	    !params->limit || params->limit > REGLIB_MAX_QUEUED ||
+	    (params->policy != REGLIB_QUEUE_REJECT &&
+	     params->policy != REGLIB_QUEUE_COALESCE))
+		return -EINVAL;
+
+	queue = &regcore->requests[initiator];
+
+	queue->params.priority = params->priority;
+	__atomic_store_n(&queue->params.limit, params->limit,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&queue->params.policy, params->policy,
+			 __ATOMIC_RELAXED);
+
+	reg_queue_order();
 
-	dl_list_for_each_safe(request, tmp, &regcore->requests_list,
-			      struct regulatory_request, list) {
-		dl_list_del(&request->list);
-		return request;
+	return 0;
+}
+
+/**
+ * reglib_get_queue_params - tell how the requests of an initiator queue
+ * @initiator: the initiator
+ * @params: filled in with the parameters of its queue
+ */
+void reglib_get_queue_params(enum ieee80211_reg_initiator initiator,
+			     struct reglib_queue_params *params)
+{
+	if (initiator >= REGLIB_NUM_INITIATORS) {
+		memset(params, 0, sizeof(struct reglib_queue_params));
+		return;
 	}
 
-	return NULL;
+	*params = regcore->requests[initiator].params;
+}
+
+/**
+ * reglib_get_queue_stats - tell how the queue of an initiator is doing
+ * @initiator: the initiator
+ * @stats: filled in with the queue's counters
+ *
+ * Takes no locks, the counters are each as they were at some point
+ * during the call.
+ */
+void reglib_get_queue_stats(enum ieee80211_reg_initiator initiator,
+			    struct reglib_queue_stats *stats)
+{
+	struct reg_request_queue *queue;
+
+	memset(stats, 0, sizeof(struct reglib_queue_stats));
+
+	if (initiator >= REGLIB_NUM_INITIATORS)
+		return;
+
+	queue = &regcore->requests[initiator];
+
+	stats->depth = __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+	stats->max_depth = __atomic_load_n(&queue->stats.max_depth,
+					   __ATOMIC_RELAXED);
+	stats->queued = __atomic_load_n(&queue->stats.queued,
+					__ATOMIC_RELAXED);
+	stats->merged = __atomic_load_n(&queue->stats.merged,
+					__ATOMIC_RELAXED);
+	stats->rejected = __atomic_load_n(&queue->stats.rejected,
+					  __ATOMIC_RELAXED);
+	stats->coalesced = __atomic_load_n(&queue->stats.coalesced,
+					   __ATOMIC_RELAXED);
 }
 
 static bool reglib_dev_ignores_update(struct ieee80211_dev_regulatory *reg,
@@ -721,6 +3843,158 @@ static bool reglib_dev_ignores_update(struct ieee80211_dev_regulatory *reg,
 	return false;
 }
 
+/*
+ * Rebuilds the copy of a device's TX table readers are not looking at
+ * from the device's channels as reglib_handle_channel() left them and
+ * publishes it. Whether a channel may be used as a 20 MHz channel is up
+ * to its flags, the other widths follow from what the regulatory domain
+ * permits and, from 40 MHz on, the channel's HT40 flags.
+ *
+ * There is one writer at a time, the callers of reglib_regdev_update()
+ * hold the regulatory core's lock. Readers do not, and one which loaded
+ * the generation before last may still be reading the copy rewritten
+ * here.
+ */
+static void reg_dev_tx_publish(struct ieee80211_dev_regulatory *reg)
+{
+	const struct ieee80211_regdomain *regd;
+	const struct reglib_chan_avail *avail;
+	struct reglib_chan_avail chan_avail;
+	struct ieee80211_supported_band *sband;
+	struct ieee80211_channel *chan;
+	struct reglib_tx_table *tx;
+	unsigned int generation, i;
+	enum ieee80211_band band;
+	enum reglib_bw bw;
+	uint8_t bws;
+	int nr, power;
+
+	generation = reg->tx_generation + 1;
+	tx = &reg->tx[generation & 1];
+	regd = reg_get_regd(reg, NULL);
+
+	/*
+	 * Keeps the stores below from being seen before the generation
+	 * published last time, a reader still on the copy would not notice
+	 * it changed otherwise. Pairs with the one in reglib_tx_allowed().
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
+		for (nr = 0; nr < REGLIB_NUM_CHANS; nr++)
+			__atomic_store_n(&tx->bws[band][nr], 0,
+					 __ATOMIC_RELAXED);
+
+		sband = reg->bands[band];
+		if (!sband)
+			continue;
+
+		if (regd->index)
+			avail = &regd->index->chans[band];
+		else {
+			reg_chan_avail_build(regd, NULL, band, &chan_avail);
+			avail = &chan_avail;
+		}
+
+		for (i = 0; i < sband->n_channels; i++) {
+			chan = &sband->channels[i];
+			nr = reglib_freq_to_chan(band, chan->center_freq);
+			if (nr < 0 || chan->flags & IEEE80211_CHAN_DISABLED)
+				continue;
+
+			bws = 1 << REGLIB_BW_20;
+			for (bw = 0; bw < REGLIB_NUM_BWS; bw++) {
+				if (bw >= REGLIB_BW_40 &&
+				    (chan->flags & IEEE80211_CHAN_NO_HT40) ==
+				    IEEE80211_CHAN_NO_HT40)
+					break;
+				if (reglib_chan_test(&avail->primary[bw], nr))
+					bws |= 1 << bw;
+			}
+
+			power = chan->max_power;
+			if (power > INT8_MAX)
+				power = INT8_MAX;
+			if (power < INT8_MIN)
+				power = INT8_MIN;
+
+			__atomic_store_n(&tx->max_power[band][nr], power,
+					 __ATOMIC_RELAXED);
+			__atomic_store_n(&tx->bws[band][nr], bws,
+					 __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(&reg->tx_generation, generation, __ATOMIC_RELEASE);
+}
+
+/**
+ * reglib_tx_allowed - tell if a device may transmit on a channel
+ * @reg: the device's regulatory data
+ * @band: the band of the channel
+ * @chan: the IEEE channel number of the primary channel
+ * @tx_power: the TX power in dBm
+ * @bw: the width of the channel
+ *
+ * This is meant to be asked for every frame. It only reads the decisions
+ * reglib_regdev_update() made for the device last, takes no locks and
+ * can be called at any time, also while the regulatory core is updating
+ * the device. Readers racing with an update retry against the newly
+ * published decisions, they never wait for one to finish. Whether the
+ * device may initiate radiation on a channel requiring passive scanning
+ * is left to the caller, see %REGLIB_CHANS_PASSIVE_SCAN.
+ */
+bool reglib_tx_allowed(const struct ieee80211_dev_regulatory *reg,
+		       enum ieee80211_band band,
+		       unsigned int chan,
+		       int tx_power,
+		       enum reglib_bw bw)
+{
+	const struct reglib_tx_table *tx;
+	unsigned int generation;
+	uint8_t bws;
+	int max_power;
+
+	if (band >= IEEE80211_NUM_BANDS || chan >= REGLIB_NUM_CHANS ||
+	    bw >= REGLIB_NUM_BWS)
+		return false;
+
+	do {
+		generation = __atomic_load_n(&reg->tx_generation,
+					     __ATOMIC_ACQUIRE);
+		tx = &reg->tx[generation & 1];
+		bws = __atomic_load_n(&tx->bws[band][chan], __ATOMIC_RELAXED);
+		max_power = __atomic_load_n(&tx->max_power[band][chan],
+					    __ATOMIC_RELAXED);
+		/* Pairs with the one in reg_dev_tx_publish() */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&reg->tx_generation, __ATOMIC_RELAXED) !=
+		 generation);
+
+	return (bws & (1 << bw)) && tx_power <= max_power;
+}
+
+/**
+ * reglib_tx_generation - tell which TX decisions a device is on
+ * @reg: the device's regulatory data
+ *
+ * The value changes each time the decisions reglib_tx_allowed() reads
+ * are updated, callers keeping their own results around can compare it
+ * to notice a regulatory change.
+ */
+unsigned int reglib_tx_generation(const struct ieee80211_dev_regulatory *reg)
+{
+	return __atomic_load_n(&reg->tx_generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * reglib_regdev_update - apply the regulatory domain to a device
+ * @reg: the device's regulatory data
+ * @initiator: who asked for the regulatory domain
+ *
+ * The caller has to hold the regulatory core's lock: the channel cache
+ * and the device's TX decisions are written with one writer at a time.
+ */
 void reglib_regdev_update(struct ieee80211_dev_regulatory *reg,
 			  enum ieee80211_reg_initiator initiator)
 {
@@ -731,17 +4005,281 @@ void reglib_regdev_update(struct ieee80211_dev_regulatory *reg,
 	if (reglib_dev_ignores_update(reg, initiator))
 		return;
 
+	reg_chan_map_validate();
+
 	for (band = 0; band < IEEE80211_NUM_BANDS; band++) {
 		if (reg->bands[band])
 			reglib_handle_band(reg, band, initiator);
 	}
+
+	reg_dev_tx_publish(reg);
+}
+
+/**
+ * reglib_regdevs_chans_union - channels in a bitmap of any of the devices
+ * @regs: the devices
+ * @n_regs: number of devices in @regs
+ * @band: the band
+ * @map: the bitmap to look at
+ * @result: set to the channels in @map of at least one of the devices
+ */
+void reglib_regdevs_chans_union(struct ieee80211_dev_regulatory **regs,
+				unsigned int n_regs,
+				enum ieee80211_band band,
+				enum reglib_chan_map map,
+				struct reglib_chan_bitmap *result)
+{
+	unsigned int i;
+
+	memset(result, 0, sizeof(struct reglib_chan_bitmap));
+
+	for (i = 0; i < n_regs; i++)
+		reglib_chan_or(result, result, &regs[i]->chans[band][map]);
+}
+
+/**
+ * reglib_regdevs_chans_intersect - channels in a bitmap of all the devices
+ * @regs: the devices
+ * @n_regs: number of devices in @regs
+ * @band: the band
+ * @map: the bitmap to look at
+ * @result: set to the channels in @map of every one of the devices, for
+ *	example the channels all of them can use for %REGLIB_CHANS_ENABLED.
+ *	Empty if @n_regs is 0.
+ */
+void reglib_regdevs_chans_intersect(struct ieee80211_dev_regulatory **regs,
+				    unsigned int n_regs,
+				    enum ieee80211_band band,
+				    enum reglib_chan_map map,
+				    struct reglib_chan_bitmap *result)
+{
+	unsigned int i;
+
+	if (!n_regs) {
+		memset(result, 0, sizeof(struct reglib_chan_bitmap));
+		return;
+	}
+
+	*result = regs[0]->chans[band][map];
+
+	for (i = 1; i < n_regs; i++)
+		reglib_chan_and(result, result, &regs[i]->chans[band][map]);
+}
+
+/**
+ * reglib_regdev_chans_diff - channels in a bitmap of one device only
+ * @reg1: the device whose channels to keep
+ * @reg2: the device whose channels to remove
+ * @band: the band
+ * @map: the bitmap to look at
+ * @result: set to the channels in @map of @reg1 but not of @reg2
+ */
+void reglib_regdev_chans_diff(struct ieee80211_dev_regulatory *reg1,
+			      struct ieee80211_dev_regulatory *reg2,
+			      enum ieee80211_band band,
+			      enum reglib_chan_map map,
+			      struct reglib_chan_bitmap *result)
+{
+	reglib_chan_andnot(result, &reg1->chans[band][map],
+			   &reg2->chans[band][map]);
+}
+
+void reglib_regdev_register(struct ieee80211_dev_regulatory *reg)
+{
+	reg_dev_chans_init(reg);
+	/* Nothing may be transmitted until the device is first updated */
+	memset(reg->tx, 0, sizeof(reg->tx));
+	dl_list_add_tail(&regcore->dev_regd_list, &reg->list);
+}
+
+void reglib_regdev_unregister(struct ieee80211_dev_regulatory *reg)
+{
+	const struct ieee80211_regdomain *old_rd = reg->regd;
+
+	dl_list_del(&reg->list);
+	__atomic_store_n(&reg->regd, NULL, __ATOMIC_RELEASE);
+	reg_regd_put(old_rd);
+}
+
+/**
+ * reglib_set_regdom - apply the regulatory domain for the last request
+ * @rd: the regulatory domain CRDA came up with for the last request
+ *
+ * If the last request asked for it the new regulatory domain is the
+ * intersection of @rd and the one currently set. All registered devices
+ * are updated accordingly. @rd has to outlive the regulatory core.
+ *
+ * Returns 0 on success, -EINVAL if @rd is invalid or does not apply to
+ * the last request, or if its intersection with the current regulatory
+ * domain is empty.
+ */
+int reglib_set_regdom(const struct ieee80211_regdomain *rd)
+{
+	struct ieee80211_dev_regulatory *reg;
+
+	if (!regcore->last_request || regcore->last_request->processed)
+		return -EINVAL;
+
+	if (!reglib_is_valid_rd(rd))
+		return -EINVAL;
+
+	if (regcore->last_request->alpha2[0] != rd->alpha2[0] ||
+	    regcore->last_request->alpha2[1] != rd->alpha2[1])
+		return -EINVAL;
+
+	if (regcore->last_request->intersect &&
+	    !reglib_is_world_regdom(regcore->regd->alpha2)) {
+		rd = reglib_intersect_regdoms(rd, regcore->regd);
+		if (!rd)
+			return -EINVAL;
+	}
+
+	__atomic_store_n(&regcore->regd, rd, __ATOMIC_RELEASE);
+
+	reglib_print_regdomain(rd);
+	regcore->ops->send_reg_change_event(regcore->last_request);
+	reg_set_request_processed();
+
+	dl_list_for_each(reg, &regcore->dev_regd_list,
+			 struct ieee80211_dev_regulatory, list)
+		reglib_regdev_update(reg, regcore->last_request->initiator);
+
+	return 0;
+}
+
+static bool reg_regd_rules_equal(const struct ieee80211_regdomain *rd1,
+				 const struct ieee80211_regdomain *rd2)
+{
+	return rd1->n_reg_rules == rd2->n_reg_rules &&
+	       !memcmp(rd1->reg_rules, rd2->reg_rules,
+		       rd1->n_reg_rules * sizeof(struct ieee80211_reg_rule));
+}
+
+/* What rd becomes with a reloaded database, see reglib_reload_regdom() */
+static const struct ieee80211_regdomain *
+reg_reload_find(const struct ieee80211_regdomain *rd,
+		reglib_regd_find_fn find, void *priv)
+{
+	const struct ieee80211_regdomain *new_rd;
+
+	new_rd = find(rd->alpha2, priv);
+	if (!new_rd || !reglib_is_valid_rd(new_rd))
+		return &world_regdom;
+
+	return new_rd;
+}
+
+/**
+ * reglib_reload_regdom - switch over to a reloaded regulatory database
+ * @find: looks up the regulatory domain of an alpha2 in the new database
+ * @priv: passed to @find
+ *
+ * The current regulatory domain and the domains devices have of their
+ * own are replaced with what @find has for their alpha2. A domain @find
+ * no longer has, or has an invalid one for, becomes the world regulatory
+ * domain. Domains built by intersection are kept as they are.
+ *
+ * Only devices whose lookups end up on different rules, see
+ * reg_get_regd(), are updated. Afterwards nothing in the regulatory core
+ * refers to the old database anymore, the domains @find returns have to
+ * outlive the regulatory core, just like those given to
+ * reglib_set_regdom().
+ *
+ * Returns the number of devices updated or -ENOMEM.
+ */
+int reglib_reload_regdom(reglib_regd_find_fn find, void *priv)
+{
+	const struct ieee80211_regdomain *rd, *old_rd, *old_core_rd;
+	struct ieee80211_dev_regulatory *reg;
+	struct dl_list dead;
+	int n_updated = 0, r = 0;
+
+	dl_list_init(&dead);
+
+	old_core_rd = regcore->regd;
+	if (old_core_rd->alpha2[0] != '9' || old_core_rd->alpha2[1] != '8') {
+		rd = reg_reload_find(old_core_rd, find, priv);
+		__atomic_store_n(&regcore->regd, rd, __ATOMIC_RELEASE);
+	}
+
+	if (!reg_regd_rules_equal(old_core_rd, regcore->regd)) {
+		reglib_print_regdomain(regcore->regd);
+		regcore->ops->send_reg_change_event(regcore->last_request);
+	}
+
+	dl_list_for_each(reg, &regcore->dev_regd_list,
+			 struct ieee80211_dev_regulatory, list) {
+		old_rd = reg->regd;
+		rd = NULL;
+		if (old_rd) {
+			rd = reg_regd_intern(reg_reload_find(old_rd,
+							     find, priv));
+			if (!rd) {
+				r = -ENOMEM;
+				break;
+			}
+
+			__atomic_store_n(&reg->regd, rd, __ATOMIC_RELEASE);
+			/* Not freed before the grace period below */
+			reg_regd_release(old_rd, &dead);
+		}
+
+		if (reg_regd_rules_equal(reg_dev_regd(old_core_rd, old_rd),
+					 reg_dev_regd(regcore->regd, rd)))
+			continue;
+
+		reglib_regdev_update(reg, regcore->last_request->initiator);
+		n_updated++;
+	}
+
+	/* Lookups may still be on the old database */
+	reglib_synchronize();
+	reg_interned_free(&dead);
+
+	if (r)
+		return r;
+
+	return n_updated;
 }
 
 int reglib_core_init(struct regcore_ops *ops)
 {
+	struct reg_request_queue *queue;
+	unsigned int i, j;
+	int r;
+
 	dl_list_init(&regcore->dev_regd_list);
-	dl_list_init(&regcore->requests_list);
 	regcore->ops = ops;
 
+	for (i = 0; i < REGLIB_NUM_INITIATORS; i++) {
+		queue = &regcore->requests[i];
+		for (j = 0; j < REG_REQUEST_QUEUE_SIZE; j++)
+			queue->cells[j].seq = j;
+		queue->params = reg_queue_defaults[i];
+	}
+	reg_queue_order();
+
+	reg_intersections_init();
+	reg_interned_init();
+
+	r = reglib_index_regd(&world_regdom);
+	if (r)
+		return r;
+
 	return 0;
 }
+
+void reglib_core_exit(void)
+{
+	struct regulatory_request *request;
+
+	while ((request = reglib_next_request()))
+		reg_request_free(request);
+
+	if (regcore->last_request != &core_request_world)
+		reg_request_free(regcore->last_request);
+	regcore->last_request = &core_request_world;
+
+	reg_intersections_free();
+	reglib_unindex_regd(&world_regdom);
+}
@@ -133,12 +133,151 @@ struct ieee80211_reg_rule {
 	uint32_t flags;
 };
 
+/* Maximum number of rules a valid regulatory domain can have */
+#define REGLIB_MAX_REG_RULES	4096
+
+struct reglib_regd_index;
+
+/**
+ * struct ieee80211_regdomain - a regulatory domain
+ *
+ * @n_reg_rules: number of regulatory rules in @reg_rules
+ * @alpha2: the ISO / IEC 3166 alpha2 this domain applies to
+ * @index: lookup index built by reglib_index_regd(), or %NULL if this
+ *	domain has never been indexed. Lookups on unindexed domains
+ *	scan @reg_rules linearly.
+ * @reg_rules: the regulatory rules, in order of precedence
+ */
 struct ieee80211_regdomain {
 	uint32_t n_reg_rules;
 	char alpha2[2];
+	const struct reglib_regd_index *index;
 	struct ieee80211_reg_rule reg_rules[];
 };
 
+/* Channel numbers of a band go up to 255 */
+#define REGLIB_CHAN_BITMAP_WORDS	4
+
+/**
+ * struct reglib_chan_bitmap - a set of channels of one band
+ *
+ * @bits: bit n is set if IEEE channel number n is part of the set
+ */
+struct reglib_chan_bitmap {
+	uint64_t bits[REGLIB_CHAN_BITMAP_WORDS];
+};
+
+static inline bool reglib_chan_test(const struct reglib_chan_bitmap *map,
+				    unsigned int chan)
+{
+	if (chan >= 64 * REGLIB_CHAN_BITMAP_WORDS)
+		return false;
+	return (map->bits[chan / 64] >> (chan % 64)) & 1;
+}
+
+static inline void reglib_chan_set(struct reglib_chan_bitmap *map,
+				   unsigned int chan)
+{
+	if (chan < 64 * REGLIB_CHAN_BITMAP_WORDS)
+		map->bits[chan / 64] |= (uint64_t) 1 << (chan % 64);
+}
+
+static inline void reglib_chan_clear(struct reglib_chan_bitmap *map,
+				     unsigned int chan)
+{
+	if (chan < 64 * REGLIB_CHAN_BITMAP_WORDS)
+		map->bits[chan / 64] &= ~((uint64_t) 1 << (chan % 64));
+}
+
+/* dst = a | b */
+static inline void reglib_chan_or(struct reglib_chan_bitmap *dst,
+				  const struct reglib_chan_bitmap *a,
+				  const struct reglib_chan_bitmap *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < REGLIB_CHAN_BITMAP_WORDS; i++)
+		dst->bits[i] = a->bits[i] | b->bits[i];
+}
+
+/* dst = a & b */
+static inline void reglib_chan_and(struct reglib_chan_bitmap *dst,
+				   const struct reglib_chan_bitmap *a,
+				   const struct reglib_chan_bitmap *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < REGLIB_CHAN_BITMAP_WORDS; i++)
+		dst->bits[i] = a->bits[i] & b->bits[i];
+}
+
+/* dst = a & ~b */
+static inline void reglib_chan_andnot(struct reglib_chan_bitmap *dst,
+				      const struct reglib_chan_bitmap *a,
+				      const struct reglib_chan_bitmap *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < REGLIB_CHAN_BITMAP_WORDS; i++)
+		dst->bits[i] = a->bits[i] & ~b->bits[i];
+}
+
+/* Number of channels in the set */
+static inline unsigned int
+reglib_chan_weight(const struct reglib_chan_bitmap *map)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < REGLIB_CHAN_BITMAP_WORDS; i++)
+		n += __builtin_popcountll(map->bits[i]);
+
+	return n;
+}
+
+/**
+ * enum reglib_chan_map - the channel bitmaps kept for each device
+ *
+ * Each bitmap has the channels of a band in it which currently have the
+ * respective &enum ieee80211_channel_flags, or for
+ * %REGLIB_CHANS_ENABLED those that are not disabled. Channels off the
+ * band's channel grid are in none of them, see reglib_freq_to_chan().
+ *
+ * @REGLIB_CHANS_ENABLED: channels which are not disabled
+ * @REGLIB_CHANS_PASSIVE_SCAN: channels with passive scanning only
+ * @REGLIB_CHANS_NO_IBSS: channels on which IBSS is not allowed
+ * @REGLIB_CHANS_RADAR: channels which require radar detection
+ * @REGLIB_CHANS_NO_HT40PLUS: channels which can not be HT40+ primary
+ * @REGLIB_CHANS_NO_HT40MINUS: channels which can not be HT40- primary
+ * @REGLIB_NUM_CHAN_MAPS: number of channel bitmaps
+ */
+enum reglib_chan_map {
+	REGLIB_CHANS_ENABLED,
+	REGLIB_CHANS_PASSIVE_SCAN,
+	REGLIB_CHANS_NO_IBSS,
+	REGLIB_CHANS_RADAR,
+	REGLIB_CHANS_NO_HT40PLUS,
+	REGLIB_CHANS_NO_HT40MINUS,
+
+	/* keep last */
+	REGLIB_NUM_CHAN_MAPS,
+};
+
+/* Number of channel numbers a band's bitmaps and tables have room for */
+#define REGLIB_NUM_CHANS	(64 * REGLIB_CHAN_BITMAP_WORDS)
+
+/**
+ * struct reglib_tx_table - what a device may transmit with on each channel
+ *
+ * @max_power: for each band and channel number the max TX power in dBm
+ * @bws: for each band and channel number a bitmask of BIT(&enum reglib_bw)
+ *	for the widths of the channels the channel may be the primary
+ *	channel of, 0 if the device may not transmit on it at all
+ */
+struct reglib_tx_table {
+	int8_t max_power[IEEE80211_NUM_BANDS][REGLIB_NUM_CHANS];
+	uint8_t bws[IEEE80211_NUM_BANDS][REGLIB_NUM_CHANS];
+};
+
 /**
  * enum ieee80211_dev_reg_flags - device regulatory flags
  *
@@ -174,16 +313,30 @@ enum ieee80211_dev_reg_flags {
  * This structure provides regulatory data that is specific to an
  * 802.11 device.
  *
- * @regd: pointer to the device's own regulatory domain if one set
+ * @regd: pointer to the device's own regulatory domain if one set. This
+ *	is a reference to an interned domain shared with all devices which
+ *	have one with the same contents, so two devices have the same
+ *	domain if and only if their @regd are the same pointer. Lookups
+ *	read it without the regulatory core's lock, see reglib_read_lock().
  * @bands: set of supported bands.
  * @flags: modifiers to regulatory behaviour
  * @list: for inclusion as part of the regcore's dev_regd_list
+ * @chans: for each band the device's channels as bitmaps, indexed by
+ *	&enum reglib_chan_map. These mirror the flags of the channels in
+ *	@bands and are kept up to date by the regulatory core.
+ * @tx_generation: bumped each time the regulatory core publishes a new
+ *	@tx table, the one in use is @tx[@tx_generation & 1]
+ * @tx: the TX decisions reglib_tx_allowed() reads, double buffered so
+ *	that readers never see one while it is being rebuilt
  */
 struct ieee80211_dev_regulatory {
 	uint32_t flags;
 	const struct ieee80211_regdomain *regd;
 	struct ieee80211_supported_band *bands[IEEE80211_NUM_BANDS];
 	struct dl_list list;
+	struct reglib_chan_bitmap chans[IEEE80211_NUM_BANDS][REGLIB_NUM_CHAN_MAPS];
+	unsigned int tx_generation;
+	struct reglib_tx_table tx[2];
 };
 
 /**
@@ -215,7 +368,10 @@ struct ieee80211_dev_regulatory {
  * 	country IE
  * @country_ie_env: lets us know if the AP is telling us we are outdoor,
  * 	indoor, or if it doesn't matter
- * @list: used to insert into the reg_requests_list linked list
+ * @pending: private to the regulatory core, where the request is recorded
+ *	for requests like it to be merged into it while it is queued
+ * @pending_state: private to the regulatory core, the state it is
+ *	recorded in there with
  */
 struct regulatory_request {
 	struct ieee80211_dev_regulatory *reg;
@@ -224,7 +380,63 @@ struct regulatory_request {
 	bool intersect;
 	bool processed;
 	enum environment_cap country_ie_env;
-	struct dl_list list;
+	int pending;
+	unsigned long pending_state;
+};
+
+#define REGLIB_NUM_INITIATORS	(IEEE80211_REGDOM_SET_BY_COUNTRY_IE + 1)
+
+/* Most requests of an initiator which can be queued at once */
+#define REGLIB_MAX_QUEUED	256
+
+/**
+ * enum reglib_queue_policy - what becomes of requests for a full queue
+ *
+ * @REGLIB_QUEUE_REJECT: the request is refused
+ * @REGLIB_QUEUE_COALESCE: the request is set aside, taking the place of
+ *	the one set aside before, which is dropped. It is processed once
+ *	the queue is empty.
+ */
+enum reglib_queue_policy {
+	REGLIB_QUEUE_REJECT,
+	REGLIB_QUEUE_COALESCE,
+};
+
+/**
+ * struct reglib_queue_params - how the requests of an initiator are queued
+ *
+ * Each initiator has a queue of its own, so that requests of one are not
+ * held up behind many of another.
+ *
+ * @priority: queued requests of initiators with a higher priority are
+ *	processed first, those of initiators with the same one in the
+ *	order of &enum ieee80211_reg_initiator
+ * @limit: most requests queued at once, from 1 to %REGLIB_MAX_QUEUED
+ * @policy: what becomes of requests once @limit are queued
+ */
+struct reglib_queue_params {
+	unsigned int priority;
+	unsigned int limit;
+	enum reglib_queue_policy policy;
+};
+
+/**
+ * struct reglib_queue_stats - how the queue of an initiator is doing
+ *
+ * @depth: requests queued right now
+ * @max_depth: most requests queued at once so far
+ * @queued: requests queued so far
+ * @merged: requests merged into a like one queued
+ * @rejected: requests refused as the queue was full
+ * @coalesced: requests dropped for a later one as the queue was full
+ */
+struct reglib_queue_stats {
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned long queued;
+	unsigned long merged;
+	unsigned long rejected;
+	unsigned long coalesced;
 };
 
 /*
@@ -234,8 +446,13 @@ struct regulatory_request {
 struct regcore_ops {
 	int (*call_crda)(const char *alpha2);
 	void (*send_reg_change_event)(struct regulatory_request *request);
+	void (*free_request)(struct regulatory_request *request);
 };
 
+/* Looks up the regulatory domain of @alpha2 in a regulatory database */
+typedef const struct ieee80211_regdomain *
+(*reglib_regd_find_fn)(const char *alpha2, void *priv);
+
 #define MHZ_TO_KHZ(freq) ((freq) * 1000)
 #define KHZ_TO_MHZ(freq) ((freq) / 1000)
 #define DBI_TO_MBI(gain) ((gain) * 100)
@@ -243,6 +460,71 @@ struct regcore_ops {
 #define DBM_TO_MBM(gain) ((gain) * 100)
 #define MBM_TO_DBM(gain) ((gain) / 100)
 
+/**
+ * enum reglib_bw - channel bandwidth classes
+ *
+ * The channel widths the regulatory library precomputes results for when
+ * a regulatory domain is indexed.
+ *
+ * @REGLIB_BW_5: 5 MHz wide channels
+ * @REGLIB_BW_10: 10 MHz wide channels
+ * @REGLIB_BW_20: 20 MHz wide channels
+ * @REGLIB_BW_40: 40 MHz wide channels
+ * @REGLIB_BW_80: 80 MHz wide channels
+ * @REGLIB_BW_160: 160 MHz wide channels
+ * @REGLIB_NUM_BWS: number of bandwidth classes
+ */
+enum reglib_bw {
+	REGLIB_BW_5,
+	REGLIB_BW_10,
+	REGLIB_BW_20,
+	REGLIB_BW_40,
+	REGLIB_BW_80,
+	REGLIB_BW_160,
+
+	/* keep last */
+	REGLIB_NUM_BWS,
+};
+
+#define REGLIB_BW_KHZ(bw) (MHZ_TO_KHZ(5) << (bw))
+
+/**
+ * struct reglib_freq_caps - what is permitted on a center frequency
+ *
+ * @reg_rule: for each &enum reglib_bw the rule allowing the highest EIRP
+ *	for a channel of that width, or %NULL if no rule fits one
+ * @max_eirp: for each &enum reglib_bw the max EIRP in mBm of @reg_rule,
+ *	or 0 if no rule fits a channel of that width
+ */
+struct reglib_freq_caps {
+	const struct ieee80211_reg_rule *reg_rule[REGLIB_NUM_BWS];
+	uint32_t max_eirp[REGLIB_NUM_BWS];
+};
+
+/**
+ * struct reglib_chan_avail - wide channel availability in one band
+ *
+ * Describes which channels of a band a regulatory domain permits as the
+ * primary 20 MHz channel of a channel of each width. A channel wider
+ * than 20 MHz is permitted when a single rule covers all of it and the
+ * rule's max bandwidth allows that width. Wide channels follow the
+ * band's channel grid: HT40 pairs anywhere on 2.4 GHz, 40/80/160 MHz
+ * blocks aligned to the 5 GHz and 6 GHz channelization otherwise.
+ *
+ * @primary: for each &enum reglib_bw the channels that can be the primary
+ *	channel of a permitted channel of that width. For widths up to
+ *	20 MHz that is the channel itself.
+ * @ht40plus: channels usable as HT40 primary with the secondary channel
+ *	above them
+ * @ht40minus: channels usable as HT40 primary with the secondary channel
+ *	below them
+ */
+struct reglib_chan_avail {
+	struct reglib_chan_bitmap primary[REGLIB_NUM_BWS];
+	struct reglib_chan_bitmap ht40plus;
+	struct reglib_chan_bitmap ht40minus;
+};
+
 #define REG_RULE(start, end, bw, gain, eirp, reg_flags) \
 {							\
 	.freq_range.start_freq_khz = MHZ_TO_KHZ(start),	\
@@ -254,6 +536,7 @@ struct regcore_ops {
 }
 
 int reglib_frequency_to_channel(int freq);
+enum ieee80211_band reglib_freq_to_band(uint32_t freq_khz);
 bool reglib_is_world_regdom(const char *alpha2);
 
 int reglib_freq_info_regd(struct ieee80211_dev_regulatory *reg,
@@ -267,16 +550,92 @@ int reglib_freq_info(struct ieee80211_dev_regulatory *reg,
 		     int target_eirp_mbm,
 		     uint32_t desired_bw_khz,
 		     const struct ieee80211_reg_rule **reg_rule);
+int reglib_freq_info_batch(struct ieee80211_dev_regulatory *reg,
+			   const uint32_t *center_freqs,
+			   const int *target_eirps_mbm,
+			   const uint32_t *desired_bws_khz,
+			   unsigned int n,
+			   int *results,
+			   const struct ieee80211_regdomain *custom_regd);
+int reglib_freq_best_regd(struct ieee80211_dev_regulatory *reg,
+			  uint32_t center_freq,
+			  uint32_t desired_bw_khz,
+			  const struct ieee80211_reg_rule **reg_rule,
+			  const struct ieee80211_regdomain *custom_regd);
+int reglib_freq_caps_regd(struct ieee80211_dev_regulatory *reg,
+			  uint32_t center_freq,
+			  struct reglib_freq_caps *caps,
+			  const struct ieee80211_regdomain *custom_regd);
+int reglib_chan_to_freq(enum ieee80211_band band, unsigned int chan);
+int reglib_freq_to_chan(enum ieee80211_band band, int freq);
+int reglib_wide_chan_center(enum ieee80211_band band, unsigned int chan,
+			    enum reglib_bw bw);
+int reglib_chan_avail_regd(struct ieee80211_dev_regulatory *reg,
+			   enum ieee80211_band band,
+			   struct reglib_chan_avail *avail,
+			   const struct ieee80211_regdomain *custom_regd);
+bool reglib_chan_bw_allowed(struct ieee80211_dev_regulatory *reg,
+			    enum ieee80211_band band,
+			    unsigned int chan,
+			    enum reglib_bw bw,
+			    const struct ieee80211_regdomain *custom_regd);
+void reglib_read_lock(void);
+void reglib_read_unlock(void);
+void reglib_synchronize(void);
 const struct ieee80211_regdomain *reglib_get_regd(void);
+bool reglib_is_valid_reg_rule(const struct ieee80211_reg_rule *rule);
+bool reglib_does_bw_fit(const struct ieee80211_freq_range *freq_range,
+			uint32_t center_freq_khz,
+			uint32_t bw_khz);
+bool reglib_freq_in_rule_band(const struct ieee80211_freq_range *freq_range,
+			      uint32_t freq_khz);
 bool reglib_is_valid_rd(const struct ieee80211_regdomain *rd);
+int reglib_index_regd(struct ieee80211_regdomain *rd);
+int reglib_reload_regdom(reglib_regd_find_fn find, void *priv);
+void reglib_unindex_regd(struct ieee80211_regdomain *rd);
 void reglib_print_regdomain(const struct ieee80211_regdomain *rd);
+const struct ieee80211_regdomain *
+reglib_intersect_regdoms(const struct ieee80211_regdomain *rd1,
+			 const struct ieee80211_regdomain *rd2);
+int reglib_set_regdom(const struct ieee80211_regdomain *rd);
 
-void reglib_queue_request(struct regulatory_request *request);
+int reglib_queue_request(struct regulatory_request *request);
+int reglib_set_queue_params(enum ieee80211_reg_initiator initiator,
+			    const struct reglib_queue_params *params);
+void reglib_get_queue_params(enum ieee80211_reg_initiator initiator,
+			     struct reglib_queue_params *params);
+void reglib_get_queue_stats(enum ieee80211_reg_initiator initiator,
+			    struct reglib_queue_stats *stats);
 struct regulatory_request *reglib_next_request(void);
 void reglib_process_hint(struct regulatory_request *reg_request);
+unsigned int reglib_process_hints(void);
 
 void reglib_regdev_update(struct ieee80211_dev_regulatory *reg,
 			  enum ieee80211_reg_initiator);
+void reglib_regdevs_chans_union(struct ieee80211_dev_regulatory **regs,
+				unsigned int n_regs,
+				enum ieee80211_band band,
+				enum reglib_chan_map map,
+				struct reglib_chan_bitmap *result);
+void reglib_regdevs_chans_intersect(struct ieee80211_dev_regulatory **regs,
+				    unsigned int n_regs,
+				    enum ieee80211_band band,
+				    enum reglib_chan_map map,
+				    struct reglib_chan_bitmap *result);
+void reglib_regdev_chans_diff(struct ieee80211_dev_regulatory *reg1,
+			      struct ieee80211_dev_regulatory *reg2,
+			      enum ieee80211_band band,
+			      enum reglib_chan_map map,
+			      struct reglib_chan_bitmap *result);
+bool reglib_tx_allowed(const struct ieee80211_dev_regulatory *reg,
+		       enum ieee80211_band band,
+		       unsigned int chan,
+		       int tx_power,
+		       enum reglib_bw bw);
+unsigned int reglib_tx_generation(const struct ieee80211_dev_regulatory *reg);
+void reglib_regdev_register(struct ieee80211_dev_regulatory *reg);
+void reglib_regdev_unregister(struct ieee80211_dev_regulatory *reg);
 int reglib_core_init(struct regcore_ops *ops);
+void reglib_core_exit(void);
 
 #endif /* __REGLIB_H */
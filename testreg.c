@@ -1,8 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <os/slab.h>
+#include <os/workqueue.h>
 
 #include "reglib.h"
+#include "regdb.h"
+#include "acs.h"
+#include "testreg.h"
 
 /*
  * Purpose: test a regulatory domain with overlapping frequency
@@ -20,38 +30,39 @@ static const struct ieee80211_regdomain test_regdom_01 = {
 	}
 };
 
+/*
+ * Whether or not HT40 is supported depends on HT40+ or HT40- and on
+ * the channel grid, see __test_regdom_chans() for that and for the
+ * wider 802.11ac channels.
+ */
+static const uint32_t desired_bws_khz[] = {
+	MHZ_TO_KHZ(5),
+	MHZ_TO_KHZ(10),
+	MHZ_TO_KHZ(20),
+	MHZ_TO_KHZ(40),
+};
+
+/*
+ * Prints the bandwidths that work for a frequency and target EIRP given
+ * the results reglib_freq_info_batch() gave for each of desired_bws_khz[]
+ */
 static int test_freq_khz_on_rd(uint32_t center_freq_khz,
 			       int target_eirp_mbm,
+			       const int *results,
 			       const struct ieee80211_regdomain *rd)
 {
-	/*
-	 * XXX: Whether or not we support HT40 will depend on HT+ or HT-
-	 * so a channel map will need to be built, the same will be required
-	 * for new 802.11ac HT80 and so on
-	 */
-	const uint32_t desired_bws_khz[] = {
-		MHZ_TO_KHZ(5),
-		MHZ_TO_KHZ(10),
-		MHZ_TO_KHZ(20),
-		MHZ_TO_KHZ(40),
-	};
 	uint32_t desired_bw_khz;
 	const struct ieee80211_reg_rule *reg_rule = NULL;
 	unsigned int x;
 	bool one_bw_works = false, last_bw_worked = false;
-	int r;
 
 	for (x = 0; x < ARRAY_SIZE(desired_bws_khz); x++) {
 		desired_bw_khz = desired_bws_khz[x];
-		r = reglib_freq_info_regd(NULL,
-					  center_freq_khz,
-					  target_eirp_mbm,
-					  desired_bw_khz,
-					  &reg_rule,
-					  rd);
-		if (r)
+		if (results[x] < 0)
 			continue;
 
+		reg_rule = &rd->reg_rules[results[x]];
+
 		if (last_bw_worked)
 			printf(" ");
 
@@ -79,49 +90,49 @@ static int test_freq_khz_on_rd(uint32_t center_freq_khz,
 	return 0;
 }
 
+static const uint32_t center_freqs_khz[] = {
+	MHZ_TO_KHZ(2412),
+	MHZ_TO_KHZ(2417),
+	MHZ_TO_KHZ(2422),
+	MHZ_TO_KHZ(2427),
+	MHZ_TO_KHZ(2432),
+	MHZ_TO_KHZ(2437),
+	MHZ_TO_KHZ(2442),
+	MHZ_TO_KHZ(2447),
+	MHZ_TO_KHZ(2452),
+	MHZ_TO_KHZ(2457),
+	MHZ_TO_KHZ(2462),
+	MHZ_TO_KHZ(2467),
+	MHZ_TO_KHZ(2472),
+	MHZ_TO_KHZ(5180),
+	MHZ_TO_KHZ(5200),
+	MHZ_TO_KHZ(5220),
+	MHZ_TO_KHZ(5240),
+	MHZ_TO_KHZ(5260),
+	MHZ_TO_KHZ(5280),
+	MHZ_TO_KHZ(5300),
+	MHZ_TO_KHZ(5320),
+	MHZ_TO_KHZ(5500),
+	MHZ_TO_KHZ(5520),
+	MHZ_TO_KHZ(5540),
+	MHZ_TO_KHZ(5560),
+	MHZ_TO_KHZ(5580),
+	MHZ_TO_KHZ(5600),
+	MHZ_TO_KHZ(5620),
+	MHZ_TO_KHZ(5640),
+	MHZ_TO_KHZ(5660),
+	MHZ_TO_KHZ(5680),
+	MHZ_TO_KHZ(5700),
+	MHZ_TO_KHZ(5745),
+	MHZ_TO_KHZ(5765),
+	MHZ_TO_KHZ(5785),
+	MHZ_TO_KHZ(5805),
+	MHZ_TO_KHZ(5825),
+};
+
 /* Sweep test on all possible combinations */
 static void __test_regdom(const struct ieee80211_regdomain *rd)
 {
-	const uint32_t center_freqs_khz[] = {
-		MHZ_TO_KHZ(2412),
-		MHZ_TO_KHZ(2417),
-		MHZ_TO_KHZ(2422),
-		MHZ_TO_KHZ(2427),
-		MHZ_TO_KHZ(2432),
-		MHZ_TO_KHZ(2437),
-		MHZ_TO_KHZ(2442),
-		MHZ_TO_KHZ(2447),
-		MHZ_TO_KHZ(2452),
-		MHZ_TO_KHZ(2457),
-		MHZ_TO_KHZ(2462),
-		MHZ_TO_KHZ(2467),
-		MHZ_TO_KHZ(2472),
-		MHZ_TO_KHZ(5180),
-		MHZ_TO_KHZ(5200),
-		MHZ_TO_KHZ(5220),
-		MHZ_TO_KHZ(5240),
-		MHZ_TO_KHZ(5260),
-		MHZ_TO_KHZ(5280),
-		MHZ_TO_KHZ(5300),
-		MHZ_TO_KHZ(5320),
-		MHZ_TO_KHZ(5500),
-		MHZ_TO_KHZ(5520),
-		MHZ_TO_KHZ(5540),
-		MHZ_TO_KHZ(5560),
-		MHZ_TO_KHZ(5580),
-		MHZ_TO_KHZ(5600),
-		MHZ_TO_KHZ(5620),
-		MHZ_TO_KHZ(5640),
-		MHZ_TO_KHZ(5660),
-		MHZ_TO_KHZ(5680),
-		MHZ_TO_KHZ(5700),
-		MHZ_TO_KHZ(5745),
-		MHZ_TO_KHZ(5765),
-		MHZ_TO_KHZ(5785),
-		MHZ_TO_KHZ(5805),
-		MHZ_TO_KHZ(5825),
-	};
-	uint32_t center_freq_khz;
 	const uint32_t target_eirps_mbm[] = {
 		DBM_TO_MBM(5),
 		DBM_TO_MBM(20), /* typical */
@@ -133,26 +144,117 @@ static void __test_regdom(const struct ieee80211_regdomain *rd)
 		DBM_TO_MBM(31.5), /* MAX_RATE_POWER from Atheros hardware */
 		DBM_TO_MBM(36),
 	};
-	int target_eirp_mbm;
-	unsigned int i, j;
+	const unsigned int n_bws = ARRAY_SIZE(desired_bws_khz);
+	const unsigned int n_eirps = ARRAY_SIZE(target_eirps_mbm);
+	const unsigned int n = ARRAY_SIZE(center_freqs_khz) * n_eirps * n_bws;
+	uint32_t freqs[n], bws[n];
+	int eirps[n], results[n];
+	unsigned int i, j, x, q;
 	int r;
 
+	/* Ask for every combination in one go */
+	q = 0;
+	for (i = 0; i < ARRAY_SIZE(center_freqs_khz); i++) {
+		for (j = 0; j < n_eirps; j++) {
+			for (x = 0; x < n_bws; x++, q++) {
+				freqs[q] = center_freqs_khz[i];
+				eirps[q] = target_eirps_mbm[j];
+				bws[q] = desired_bws_khz[x];
+			}
+		}
+	}
+
+	r = reglib_freq_info_batch(NULL, freqs, eirps, bws, n, results, rd);
+	if (r) {
+		printf("Failed to query the regulatory domain: %d\n", r);
+		return;
+	}
+
 	printf("%12s\t%15s\t\t%15s\t\t%16s\n",
 	       "IEEE-Channel",
 	       "Center-freq-MHz",
 	       "Target EIRP dBm",
 	       "(@Bandwidth MHz, Max EIRP dBm)");
 
+	for (q = 0; q < n; q += n_bws) {
+		r = test_freq_khz_on_rd(freqs[q],
+					eirps[q],
+					&results[q],
+					rd);
+		if (!r)
+			printf("\n");
+	}
+}
+
+/* What each center frequency permits at all of the bandwidths */
+static void __test_regdom_caps(const struct ieee80211_regdomain *rd)
+{
+	struct reglib_freq_caps caps;
+	uint32_t center_freq_mhz;
+	unsigned int i, k;
+	int r;
+
+	printf("%12s\t%15s\t\t%16s\n",
+	       "IEEE-Channel",
+	       "Center-freq-MHz",
+	       "(@Bandwidth MHz, Max EIRP dBm)");
+
 	for (i = 0; i < ARRAY_SIZE(center_freqs_khz); i++) {
-		center_freq_khz = center_freqs_khz[i];
-		for (j = 0; j < ARRAY_SIZE(target_eirps_mbm); j++) {
-			target_eirp_mbm = target_eirps_mbm[j];
-			r = test_freq_khz_on_rd(center_freq_khz,
-						target_eirp_mbm,
-						rd);
-			if (!r)
-				printf("\n");
+		r = reglib_freq_caps_regd(NULL, center_freqs_khz[i], &caps, rd);
+		if (r)
+			continue;
+
+		center_freq_mhz = KHZ_TO_MHZ(center_freqs_khz[i]);
+		printf("%12d\t%15d\t\t",
+		       reglib_frequency_to_channel(center_freq_mhz),
+		       center_freq_mhz);
+
+		for (k = 0; k < REGLIB_NUM_BWS; k++) {
+			if (!caps.reg_rule[k])
+				continue;
+			printf("%s(@%d, %d)", k ? " " : "",
+			       KHZ_TO_MHZ(REGLIB_BW_KHZ(k)),
+			       MBM_TO_DBM(caps.max_eirp[k]));
 		}
+		printf("\n");
+	}
+}
+
+/* Which channels can be the primary of each wide channel */
+static void __test_regdom_chans(const struct ieee80211_regdomain *rd)
+{
+	struct reglib_chan_avail avail[IEEE80211_NUM_BANDS];
+	enum ieee80211_band band;
+	uint32_t center_freq_mhz;
+	unsigned int i;
+	int chan;
+
+	for (band = 0; band < IEEE80211_NUM_BANDS; band++)
+		reglib_chan_avail_regd(NULL, band, &avail[band], rd);
+
+	printf("%12s\t%15s\t\t%16s\n",
+	       "IEEE-Channel",
+	       "Center-freq-MHz",
+	       "Wide channels");
+
+	for (i = 0; i < ARRAY_SIZE(center_freqs_khz); i++) {
+		center_freq_mhz = KHZ_TO_MHZ(center_freqs_khz[i]);
+		band = reglib_freq_to_band(center_freqs_khz[i]);
+		chan = reglib_freq_to_chan(band, center_freq_mhz);
+		if (chan < 0 ||
+		    !reglib_chan_test(&avail[band].primary[REGLIB_BW_40], chan))
+			continue;
+
+		printf("%12d\t%15d\t\t", chan, center_freq_mhz);
+		if (reglib_chan_test(&avail[band].ht40plus, chan))
+			printf("HT40+ ");
+		if (reglib_chan_test(&avail[band].ht40minus, chan))
+			printf("HT40- ");
+		if (reglib_chan_test(&avail[band].primary[REGLIB_BW_80], chan))
+			printf("VHT80 ");
+		if (reglib_chan_test(&avail[band].primary[REGLIB_BW_160], chan))
+			printf("VHT160");
+		printf("\n");
 	}
 }
 
@@ -167,6 +269,1155 @@ static void test_regdom(const struct ieee80211_regdomain *rd)
 	reglib_print_regdomain(rd);
 	printf("---------------------------------------------------------------------------------\n");
 	__test_regdom(rd);
+	printf("---------------------------------------------------------------------------------\n");
+	__test_regdom_caps(rd);
+	printf("---------------------------------------------------------------------------------\n");
+	__test_regdom_chans(rd);
+}
+
+/*
+ * Purpose: give a test device a regulatory domain of its own which permits
+ * more than the device can do, so that its channels keep their own limits.
+ */
+static const struct ieee80211_regdomain test_regdom_tx = {
+	.n_reg_rules = 2,
+	.alpha2 =  "02",
+	.reg_rules = {
+		/* Channels 1..11, HT40 in either direction where it fits */
+		REG_RULE(2412-10, 2462+10, 40, 6, 36, 0),
+		/* Channels 36..48, up to VHT80 */
+		REG_RULE(5180-10, 5240+10, 80, 6, 36, 0),
+	}
+};
+
+#define TEST_CHAN(_band, _freq) { \
+	.band = (_band), \
+	.center_freq = (_freq), \
+	.max_power = 20, \
+	.orig_mpwr = 20, \
+}
+
+static struct ieee80211_channel test_chans_2ghz[] = {
+	TEST_CHAN(IEEE80211_BAND_2GHZ, 2412), /* Channel 1 */
+	TEST_CHAN(IEEE80211_BAND_2GHZ, 2437), /* Channel 6 */
+	TEST_CHAN(IEEE80211_BAND_2GHZ, 2472), /* Channel 13 */
+};
+
+static struct ieee80211_channel test_chans_5ghz[] = {
+	TEST_CHAN(IEEE80211_BAND_5GHZ, 5180), /* Channel 36 */
+	TEST_CHAN(IEEE80211_BAND_5GHZ, 5260), /* Channel 52 */
+};
+
+static struct ieee80211_supported_band test_sband_2ghz = {
+	.channels = test_chans_2ghz,
+	.band = IEEE80211_BAND_2GHZ,
+	.n_channels = ARRAY_SIZE(test_chans_2ghz),
+};
+
+static struct ieee80211_supported_band test_sband_5ghz = {
+	.channels = test_chans_5ghz,
+	.band = IEEE80211_BAND_5GHZ,
+	.n_channels = ARRAY_SIZE(test_chans_5ghz),
+};
+
+/**
+ * struct test_tx_case - a frame and whether it may be sent
+ *
+ * @band: the band of the channel
+ * @chan: the IEEE channel number
+ * @tx_power: the TX power in dBm
+ * @bw: the width of the channel
+ * @allowed: what reglib_tx_allowed() has to say to it on test_regdom_tx
+ */
+struct test_tx_case {
+	enum ieee80211_band band;
+	unsigned int chan;
+	int tx_power;
+	enum reglib_bw bw;
+	bool allowed;
+};
+
+static const struct test_tx_case test_tx_cases[] = {
+	{ IEEE80211_BAND_2GHZ, 1, 20, REGLIB_BW_20, true },
+	/* Above what the device can do */
+	{ IEEE80211_BAND_2GHZ, 1, 21, REGLIB_BW_20, false },
+	{ IEEE80211_BAND_2GHZ, 6, 20, REGLIB_BW_40, true },
+	{ IEEE80211_BAND_2GHZ, 6, 20, REGLIB_BW_80, false },
+	/* Not a channel of the device */
+	{ IEEE80211_BAND_2GHZ, 11, 10, REGLIB_BW_20, false },
+	/* No rule covers it */
+	{ IEEE80211_BAND_2GHZ, 13, 10, REGLIB_BW_20, false },
+	{ IEEE80211_BAND_5GHZ, 36, 20, REGLIB_BW_80, true },
+	{ IEEE80211_BAND_5GHZ, 36, 20, REGLIB_BW_160, false },
+	{ IEEE80211_BAND_5GHZ, 52, 10, REGLIB_BW_20, false },
+};
+
+/**
+ * test_tx - check the per frame TX decisions of a device
+ *
+ * Registers a device with test_regdom_tx as its own regulatory domain,
+ * updates it and asks reglib_tx_allowed() about frames on its channels
+ * and others. The caller has to hold the lock of the regulatory core.
+ *
+ * Returns 0 if all answers were as expected, -EINVAL otherwise.
+ */
+int test_tx(void)
+{
+	struct ieee80211_dev_regulatory reg;
+	const struct test_tx_case *test;
+	unsigned int i, generation;
+	bool allowed;
+	int r = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bands[IEEE80211_BAND_2GHZ] = &test_sband_2ghz;
+	reg.bands[IEEE80211_BAND_5GHZ] = &test_sband_5ghz;
+
+	reglib_regdev_register(&reg);
+
+	/* Not interned, so taken back before the device is unregistered */
+	reg.regd = &test_regdom_tx;
+
+	if (reglib_tx_allowed(&reg, IEEE80211_BAND_2GHZ, 1, 0, REGLIB_BW_20)) {
+		printf("TX: allowed before the device was updated: FAILED\n");
+		r = -EINVAL;
+	}
+
+	generation = reglib_tx_generation(&reg);
+	reglib_regdev_update(&reg, IEEE80211_REGDOM_SET_BY_CORE);
+	if (reglib_tx_generation(&reg) == generation) {
+		printf("TX: generation unchanged by an update: FAILED\n");
+		r = -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(test_tx_cases); i++) {
+		test = &test_tx_cases[i];
+		allowed = reglib_tx_allowed(&reg, test->band, test->chan,
+					    test->tx_power, test->bw);
+		if (allowed == test->allowed)
+			continue;
+		printf("TX: channel %u at %d dBm, %u MHz wide: FAILED, "
+		       "%sallowed\n", test->chan, test->tx_power,
+		       KHZ_TO_MHZ(REGLIB_BW_KHZ(test->bw)),
+		       allowed ? "" : "not ");
+		r = -EINVAL;
+	}
+
+	reg.regd = NULL;
+	reglib_regdev_unregister(&reg);
+
+	if (!r)
+		printf("TX: per frame decisions: ok\n");
+
+	return r;
+}
+
+/*
+ * Purpose: rank the channels of an AP which has all four 20 MHz channels
+ * of VHT80 channel 42, with channel 44 busy, on test_regdom_tx.
+ */
+static struct ieee80211_channel test_acs_chans[] = {
+	TEST_CHAN(IEEE80211_BAND_5GHZ, 5180), /* Channel 36 */
+	TEST_CHAN(IEEE80211_BAND_5GHZ, 5200), /* Channel 40 */
+	TEST_CHAN(IEEE80211_BAND_5GHZ, 5220), /* Channel 44 */
+	TEST_CHAN(IEEE80211_BAND_5GHZ, 5240), /* Channel 48 */
+};
+
+static struct ieee80211_supported_band test_acs_sband = {
+	.channels = test_acs_chans,
+	.band = IEEE80211_BAND_5GHZ,
+	.n_channels = ARRAY_SIZE(test_acs_chans),
+};
+
+static void test_acs_cost(struct ieee80211_dev_regulatory *reg,
+			  enum ieee80211_band band,
+			  int32_t *costs,
+			  void *priv)
+{
+	costs[44] = 4;
+}
+
+/*
+ * The best candidates, best first. The 40 MHz channels away from channel
+ * 44 beat the 80 MHz ones, which all share its cost.
+ */
+static const struct acs_candidate test_acs_cands[] = {
+	{ IEEE80211_BAND_5GHZ, 36, REGLIB_BW_40, 5190, 20, 23 },
+	{ IEEE80211_BAND_5GHZ, 40, REGLIB_BW_40, 5190, 20, 23 },
+	{ IEEE80211_BAND_5GHZ, 36, REGLIB_BW_80, 5210, 20, 22 },
+	{ IEEE80211_BAND_5GHZ, 40, REGLIB_BW_80, 5210, 20, 22 },
+	{ IEEE80211_BAND_5GHZ, 44, REGLIB_BW_80, 5210, 20, 22 },
+	{ IEEE80211_BAND_5GHZ, 48, REGLIB_BW_80, 5210, 20, 22 },
+	{ IEEE80211_BAND_5GHZ, 36, REGLIB_BW_20, 5180, 20, 20 },
+};
+
+/* APs acs_rank_many() ranks in the test, more than one batch each */
+#define TEST_ACS_REGS	40
+
+static bool test_acs_same(const struct acs_candidate *cands,
+			  unsigned int n_cands)
+{
+	unsigned int i;
+
+	if (n_cands != ARRAY_SIZE(test_acs_cands))
+		return false;
+
+	for (i = 0; i < n_cands; i++) {
+		if (cands[i].band != test_acs_cands[i].band ||
+		    cands[i].chan != test_acs_cands[i].chan ||
+		    cands[i].bw != test_acs_cands[i].bw ||
+		    cands[i].center_freq != test_acs_cands[i].center_freq ||
+		    cands[i].max_power != test_acs_cands[i].max_power ||
+		    cands[i].score != test_acs_cands[i].score)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * test_acs - check the channels an AP is offered and their order
+ *
+ * Registers a device with test_regdom_tx as its own regulatory domain
+ * and ranks its channels with acs_rank(), and those of several copies
+ * of it with acs_rank_many() on several threads. The caller has to hold
+ * the lock of the regulatory core.
+ *
+ * Returns 0 if the candidates were as expected, -EINVAL otherwise.
+ */
+int test_acs(void)
+{
+	const unsigned int max_cands = ARRAY_SIZE(test_acs_cands);
+	struct acs_candidate cands[TEST_ACS_REGS][ARRAY_SIZE(test_acs_cands)];
+	struct ieee80211_dev_regulatory *regs[TEST_ACS_REGS];
+	int n_cands[TEST_ACS_REGS];
+	struct ieee80211_dev_regulatory reg;
+	struct acs_params params = {
+		.cost = test_acs_cost,
+	};
+	unsigned int i;
+	int r = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bands[IEEE80211_BAND_5GHZ] = &test_acs_sband;
+
+	reglib_regdev_register(&reg);
+
+	/* Not interned, so taken back before the device is unregistered */
+	reg.regd = &test_regdom_tx;
+	reglib_regdev_update(&reg, IEEE80211_REGDOM_SET_BY_CORE);
+
+	for (i = 0; i < TEST_ACS_REGS; i++)
+		regs[i] = &reg;
+
+	reglib_read_lock();
+	n_cands[0] = acs_rank(&reg, &params, cands[0], max_cands);
+	if (!test_acs_same(cands[0], n_cands[0])) {
+		printf("ACS: ranking: FAILED\n");
+		r = -EINVAL;
+	}
+
+	memset(cands, 0, sizeof(cands));
+	acs_rank_many(regs, TEST_ACS_REGS, &params, &cands[0][0], max_cands,
+		      n_cands, 4);
+	for (i = 0; i < TEST_ACS_REGS; i++) {
+		if (test_acs_same(cands[i], n_cands[i]))
+			continue;
+		printf("ACS: ranking AP %u of many: FAILED\n", i);
+		r = -EINVAL;
+		break;
+	}
+	reglib_read_unlock();
+
+	reg.regd = NULL;
+	reglib_regdev_unregister(&reg);
+
+	if (!r)
+		printf("ACS: ranking: ok\n");
+
+	return r;
+}
+
+/*
+ * Purpose: intersect test_regdom_tx with a domain which is narrower on
+ * 2 GHz and wider on 5 GHz, and with one it has nothing in common with.
+ */
+static const struct ieee80211_regdomain test_regdom_isect = {
+	.n_reg_rules = 2,
+	.alpha2 =  "03",
+	.reg_rules = {
+		REG_RULE(2412-10, 2437+10, 20, 3, 20, IEEE80211_RRF_NO_IR),
+		REG_RULE(5180-10, 5320+10, 160, 6, 23, 0),
+	}
+};
+
+static const struct ieee80211_regdomain test_regdom_isect_none = {
+	.n_reg_rules = 1,
+	.alpha2 =  "04",
+	.reg_rules = {
+		REG_RULE(5745-10, 5825+10, 80, 6, 30, 0),
+	}
+};
+
+/* The intersection of test_regdom_tx and test_regdom_isect */
+static const struct ieee80211_regdomain test_regdom_isect_expected = {
+	.n_reg_rules = 2,
+	.alpha2 =  "98",
+	.reg_rules = {
+		REG_RULE(2412-10, 2437+10, 20, 3, 20, IEEE80211_RRF_NO_IR),
+		REG_RULE(5180-10, 5240+10, 80, 6, 23, 0),
+	}
+};
+
+/* More domains than the regulatory library memoizes intersections of */
+#define TEST_ISECT_DOMAINS	40
+
+static struct ieee80211_regdomain *
+test_isect_copy(const struct ieee80211_regdomain *rd)
+{
+	struct ieee80211_regdomain *copy;
+	size_t size;
+
+	size = sizeof(struct ieee80211_regdomain) +
+	       rd->n_reg_rules * sizeof(struct ieee80211_reg_rule);
+	copy = malloc(size);
+	if (copy)
+		memcpy(copy, rd, size);
+
+	return copy;
+}
+
+static bool test_isect_is_expected(const struct ieee80211_regdomain *rd)
+{
+	const struct ieee80211_regdomain *expected;
+
+	expected = &test_regdom_isect_expected;
+
+	return rd && !memcmp(rd->alpha2, expected->alpha2, 2) &&
+	       rd->n_reg_rules == expected->n_reg_rules &&
+	       !memcmp(rd->reg_rules, expected->reg_rules,
+		       rd->n_reg_rules * sizeof(struct ieee80211_reg_rule));
+}
+
+/**
+ * test_intersect - check reglib_intersect_regdoms() and its memo
+ *
+ * The intersection has to be the same in either order and for copies
+ * of the domains, which may go away right after the call. After more
+ * intersections than are memoized it has to come out right again. The
+ * caller has to hold the lock of the regulatory core.
+ *
+ * Returns 0 if the intersections were as expected, -EINVAL otherwise.
+ */
+int test_intersect(void)
+{
+	const struct ieee80211_regdomain *rd;
+	struct ieee80211_regdomain *copy;
+	unsigned int i;
+	int r = 0;
+
+	rd = reglib_intersect_regdoms(&test_regdom_tx, &test_regdom_isect);
+	if (!test_isect_is_expected(rd) ||
+	    reglib_intersect_regdoms(&test_regdom_isect, &test_regdom_tx) != rd)
+		r = -EINVAL;
+
+	copy = test_isect_copy(&test_regdom_isect);
+	if (!copy)
+		return -ENOMEM;
+	if (!r && reglib_intersect_regdoms(&test_regdom_tx, copy) != rd)
+		r = -EINVAL;
+	free(copy);
+
+	if (reglib_intersect_regdoms(&test_regdom_tx, &test_regdom_isect_none))
+		r = -EINVAL;
+
+	for (i = 0; !r && i < TEST_ISECT_DOMAINS; i++) {
+		copy = test_isect_copy(&test_regdom_isect);
+		if (!copy)
+			return -ENOMEM;
+		copy->reg_rules[0].power_rule.max_eirp = DBM_TO_MBM(10 + i);
+		if (!reglib_intersect_regdoms(copy, &test_regdom_tx))
+			r = -EINVAL;
+		free(copy);
+	}
+
+	rd = reglib_intersect_regdoms(&test_regdom_isect, &test_regdom_tx);
+	if (!test_isect_is_expected(rd))
+		r = -EINVAL;
+
+	printf("Intersection: %s\n", r ? "FAILED" : "ok");
+
+	return r;
+}
+
+/*
+ * Purpose: reload the database with a world regulatory domain which
+ * allows the target EIRP of the channel cache on 2 GHz channels, then
+ * with the same rules again and then with the domain the core had
+ * before.
+ */
+static const struct ieee80211_regdomain test_regdom_reload = {
+	.n_reg_rules = 1,
+	.alpha2 =  "00",
+	.reg_rules = {
+		REG_RULE(2402, 2472, 40, 6, 36, 0),
+	}
+};
+
+static const struct ieee80211_regdomain test_regdom_reload_same = {
+	.n_reg_rules = 1,
+	.alpha2 =  "00",
+	.reg_rules = {
+		REG_RULE(2402, 2472, 40, 6, 36, 0),
+	}
+};
+
+static struct ieee80211_channel test_reload_chans[] = {
+	TEST_CHAN(IEEE80211_BAND_2GHZ, 2412), /* Channel 1 */
+};
+
+static struct ieee80211_supported_band test_reload_sband = {
+	.channels = test_reload_chans,
+	.band = IEEE80211_BAND_2GHZ,
+	.n_channels = ARRAY_SIZE(test_reload_chans),
+};
+
+static const struct ieee80211_regdomain *test_reload_find(const char *alpha2,
+							  void *priv)
+{
+	return priv;
+}
+
+static int test_reload_check(const struct ieee80211_regdomain *rd,
+			     int n_updated, bool enabled)
+{
+	bool chan_enabled;
+	int r;
+
+	r = reglib_reload_regdom(test_reload_find, (void *) rd);
+	chan_enabled = !(test_reload_chans[0].flags & IEEE80211_CHAN_DISABLED);
+	if (r == n_updated && reglib_get_regd() == rd &&
+	    chan_enabled == enabled)
+		return 0;
+
+	printf("Reload: updated %d devices, channel 1 %s: FAILED, "
+	       "expected %d devices, channel 1 %s\n",
+	       r, chan_enabled ? "enabled" : "disabled",
+	       n_updated, enabled ? "enabled" : "disabled");
+
+	return -EINVAL;
+}
+
+/**
+ * test_reload - check reglib_reload_regdom()
+ *
+ * Registers a device without a regulatory domain of its own, which has
+ * to follow the world regulatory domain of each reloaded database, and
+ * only be updated if its rules changed. The caller has to hold the lock
+ * of the regulatory core.
+ *
+ * Returns 0 if the device was updated as expected, -EINVAL otherwise.
+ */
+int test_reload(void)
+{
+	const struct ieee80211_regdomain *regd = reglib_get_regd();
+	struct ieee80211_dev_regulatory reg;
+	int r;
+
+	/* Intersections are kept over reloads */
+	if (!reglib_is_world_regdom(regd->alpha2))
+		return 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bands[IEEE80211_BAND_2GHZ] = &test_reload_sband;
+
+	reglib_regdev_register(&reg);
+	reglib_regdev_update(&reg, IEEE80211_REGDOM_SET_BY_CORE);
+
+	r = test_reload_check(&test_regdom_reload, 1, true);
+	if (!r)
+		r = test_reload_check(&test_regdom_reload_same, 0, true);
+	if (test_reload_check(regd, 1, false))
+		r = -EINVAL;
+
+	reglib_regdev_unregister(&reg);
+
+	printf("Reload: %s\n", r ? "FAILED" : "ok");
+
+	return r;
+}
+
+/*
+ * The works of the workqueue tests count how often their callback was
+ * started in what their arg points to, then wait for test_wq_gate to
+ * open. Enough blockers to keep all workers of the pool busy.
+ */
+#define TEST_WQ_BLOCKERS	64
+
+static struct work test_wq_blockers[TEST_WQ_BLOCKERS];
+static struct work test_wq_work;
+static unsigned int test_wq_blocked;
+static unsigned int test_wq_runs;
+static unsigned int test_wq_flushed;
+static unsigned int test_wq_gate;
+
+static void *test_wq_cb(void *arg)
+{
+	__atomic_add_fetch((unsigned int *) arg, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&test_wq_gate, __ATOMIC_ACQUIRE))
+		usleep(1000);
+
+	return NULL;
+}
+
+/* Waits up to ms milliseconds for *count to reach val */
+static bool test_wq_wait(unsigned int *count, unsigned int val,
+			 unsigned int ms)
+{
+	while (__atomic_load_n(count, __ATOMIC_SEQ_CST) < val) {
+		if (!ms--)
+			return false;
+		usleep(1000);
+	}
+
+	return true;
+}
+
+static void *test_wq_flush(void *arg)
+{
+	flush_work(&test_wq_work);
+	__atomic_store_n(&test_wq_flushed, 1, __ATOMIC_SEQ_CST);
+
+	return NULL;
+}
+
+/*
+ * Blocks workers until one of the blockers is not started anymore, at
+ * which point all workers are busy. Returns the number of blockers used.
+ */
+static unsigned int test_wq_block(void)
+{
+	unsigned int i;
+
+	__atomic_store_n(&test_wq_gate, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&test_wq_blocked, 0, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < TEST_WQ_BLOCKERS; i++) {
+		schedule_work(&test_wq_blockers[i]);
+		if (!test_wq_wait(&test_wq_blocked, i + 1, 200))
+			return i + 1;
+	}
+
+	return i;
+}
+
+static void test_wq_unblock(unsigned int n_blockers)
+{
+	unsigned int i;
+
+	__atomic_store_n(&test_wq_gate, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n_blockers; i++)
+		flush_work(&test_wq_blockers[i]);
+}
+
+/* Scheduling a work pending already adds nothing to it */
+static int test_wq_coalesce(void)
+{
+	int r = 0;
+
+	__atomic_store_n(&test_wq_gate, 0, __ATOMIC_RELEASE);
+
+	if (!schedule_work(&test_wq_work) ||
+	    !test_wq_wait(&test_wq_runs, 1, 1000))
+		r = -EINVAL;
+
+	/* Running, the first one makes it pending again */
+	if (!r && (!schedule_work(&test_wq_work) ||
+		   schedule_work(&test_wq_work)))
+		r = -EINVAL;
+
+	__atomic_store_n(&test_wq_gate, 1, __ATOMIC_RELEASE);
+	flush_work(&test_wq_work);
+
+	if (!r && (test_wq_runs != 2 || flush_work(&test_wq_work)))
+		r = -EINVAL;
+
+	printf("Workqueue: pending works coalesce: %s\n",
+	       r ? "FAILED" : "ok");
+
+	return r;
+}
+
+/* Cancelling a pending work lets those flushing it go */
+static int test_wq_cancel(void)
+{
+	unsigned int n_blockers, runs = test_wq_runs;
+	pthread_t flusher;
+	int r = 0;
+
+	n_blockers = test_wq_block();
+
+	/* All workers are busy, so it stays on its queue */
+	schedule_work(&test_wq_work);
+	__atomic_store_n(&test_wq_flushed, 0, __ATOMIC_SEQ_CST);
+	if (pthread_create(&flusher, NULL, test_wq_flush, NULL)) {
+		test_wq_unblock(n_blockers);
+		cancel_work_sync(&test_wq_work);
+		return -ENOMEM;
+	}
+	usleep(10000);
+
+	if (!cancel_work_sync(&test_wq_work) ||
+	    !test_wq_wait(&test_wq_flushed, 1, 1000))
+		r = -EINVAL;
+
+	test_wq_unblock(n_blockers);
+	pthread_join(flusher, NULL);
+
+	/* Its callback never ran, but it can be scheduled again */
+	if (test_wq_runs != runs || !schedule_work(&test_wq_work) ||
+	    !test_wq_wait(&test_wq_runs, runs + 1, 1000))
+		r = -EINVAL;
+	flush_work(&test_wq_work);
+
+	printf("Workqueue: cancel lets flush go: %s\n", r ? "FAILED" : "ok");
+
+	return r;
+}
+
+/**
+ * test_workqueue - check pending works coalesce and cancel wakes flush
+ *
+ * Blocks the workers of the pool for a while, none of the works the
+ * test does not schedule itself run until it is done.
+ *
+ * Returns 0 if the works behaved as expected, -EINVAL otherwise.
+ */
+int test_workqueue(void)
+{
+	unsigned int i;
+	int r;
+
+	init_work(&test_wq_work);
+	test_wq_work.work_cb = test_wq_cb;
+	test_wq_work.arg = &test_wq_runs;
+
+	for (i = 0; i < TEST_WQ_BLOCKERS; i++) {
+		init_work(&test_wq_blockers[i]);
+		test_wq_blockers[i].work_cb = test_wq_cb;
+		test_wq_blockers[i].arg = &test_wq_blocked;
+	}
+
+	r = test_wq_coalesce();
+	if (!r)
+		r = test_wq_cancel();
+
+	return r;
+}
+
+/*
+ * More readers than the regulatory library has reader slots for, the
+ * ones without a slot keep entering read-side critical sections while
+ * grace periods run. An object is only ever retired after a grace
+ * period, readers must never see one which is retired.
+ */
+#define TEST_RCU_READERS	160
+#define TEST_RCU_GRACE_PERIODS	16
+
+struct test_rcu_obj {
+	bool live;
+};
+
+static struct test_rcu_obj test_rcu_objs[2];
+static struct test_rcu_obj *test_rcu_ptr;
+static unsigned int test_rcu_started;
+static unsigned int test_rcu_stop;
+static unsigned int test_rcu_retired_seen;
+
+static void *test_rcu_reader(void *arg)
+{
+	struct test_rcu_obj *obj;
+
+	__atomic_add_fetch(&test_rcu_started, 1, __ATOMIC_SEQ_CST);
+
+	while (!__atomic_load_n(&test_rcu_stop, __ATOMIC_ACQUIRE)) {
+		reglib_read_lock();
+		obj = __atomic_load_n(&test_rcu_ptr, __ATOMIC_ACQUIRE);
+		sched_yield();
+		if (!__atomic_load_n(&obj->live, __ATOMIC_RELAXED))
+			__atomic_add_fetch(&test_rcu_retired_seen, 1,
+					   __ATOMIC_RELAXED);
+		reglib_read_unlock();
+	}
+
+	return NULL;
+}
+
+/**
+ * test_rcu - check grace periods with more readers than reader slots
+ *
+ * Must not be called in a read-side critical section.
+ *
+ * Returns 0 if all grace periods ended and no reader saw an object
+ * retired, -EINVAL otherwise.
+ */
+int test_rcu(void)
+{
+	pthread_t readers[TEST_RCU_READERS];
+	struct test_rcu_obj *old;
+	unsigned int i, n_readers;
+	int r = 0;
+
+	test_rcu_objs[0].live = true;
+	test_rcu_ptr = &test_rcu_objs[0];
+	test_rcu_started = 0;
+	test_rcu_stop = 0;
+	test_rcu_retired_seen = 0;
+
+	for (n_readers = 0; n_readers < TEST_RCU_READERS; n_readers++)
+		if (pthread_create(&readers[n_readers], NULL, test_rcu_reader,
+				   NULL))
+			break;
+
+	while (__atomic_load_n(&test_rcu_started, __ATOMIC_SEQ_CST) < n_readers)
+		sched_yield();
+
+	for (i = 1; i <= TEST_RCU_GRACE_PERIODS; i++) {
+		__atomic_store_n(&test_rcu_objs[i & 1].live, true,
+				 __ATOMIC_RELAXED);
+		old = __atomic_exchange_n(&test_rcu_ptr, &test_rcu_objs[i & 1],
+					  __ATOMIC_ACQ_REL);
+		reglib_synchronize();
+		__atomic_store_n(&old->live, false, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&test_rcu_stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n_readers; i++)
+		pthread_join(readers[i], NULL);
+
+	if (test_rcu_retired_seen)
+		r = -EINVAL;
+
+	printf("RCU: grace periods with %u readers: %s\n", TEST_RCU_READERS,
+	       r ? "FAILED" : "ok");
+
+	return r;
+}
+
+/*
+ * Requests are written as the initiator's letter followed by the alpha2,
+ * c for the core, u for the user, d for a driver and i for a country IE.
+ */
+static const char test_initiators[REGLIB_NUM_INITIATORS] = {
+	[IEEE80211_REGDOM_SET_BY_CORE] = 'c',
+	[IEEE80211_REGDOM_SET_BY_USER] = 'u',
+	[IEEE80211_REGDOM_SET_BY_DRIVER] = 'd',
+	[IEEE80211_REGDOM_SET_BY_COUNTRY_IE] = 'i',
+};
+
+/* Queues a request such as "uUS" like the regulatory core would */
+static int test_queue_request(struct kmem_cache *cache, const char *hint)
+{
+	struct regulatory_request *request;
+	const char *initiator;
+	int r;
+
+	initiator = memchr(test_initiators, hint[0], REGLIB_NUM_INITIATORS);
+	if (!initiator)
+		return -EINVAL;
+
+	request = kmem_cache_zalloc(cache);
+	if (!request)
+		return -ENOMEM;
+
+	request->initiator = initiator - test_initiators;
+	request->alpha2[0] = hint[1];
+	request->alpha2[1] = hint[2];
+
+	r = reglib_queue_request(request);
+	if (r)
+		kmem_cache_free(cache, request);
+
+	return r;
+}
+
+/* Takes all requests off the queues, in the order they would be processed */
+static void test_queue_drain(struct kmem_cache *cache, char *order,
+			     size_t size)
+{
+	struct regulatory_request *request;
+	size_t n = 0;
+
+	order[0] = '\0';
+	while ((request = reglib_next_request())) {
+		if (n + 5 <= size)
+			n += sprintf(&order[n], "%s%c%c%c", n ? " " : "",
+				     test_initiators[request->initiator],
+				     request->alpha2[0], request->alpha2[1]);
+		kmem_cache_free(cache, request);
+	}
+}
+
+/**
+ * struct test_queue_case - requests to queue and how they come out
+ *
+ * @name: what is tested
+ * @initiator: the initiator whose counters are checked
+ * @params: if set, how the requests of @initiator queue during the test
+ * @hints: the requests, queued one after the other
+ * @order: the requests taken off the queues, in order
+ * @merged: requests of @initiator merged into a queued one
+ * @rejected: requests of @initiator refused as the queue was full
+ * @coalesced: requests of @initiator dropped for a later one
+ */
+struct test_queue_case {
+	const char *name;
+	enum ieee80211_reg_initiator initiator;
+	struct reglib_queue_params params;
+	const char *hints;
+	const char *order;
+	unsigned long merged;
+	unsigned long rejected;
+	unsigned long coalesced;
+};
+
+static const struct test_queue_case test_queue_cases[] = {
+	{
+		.name = "like requests in a row merge",
+		.initiator = IEEE80211_REGDOM_SET_BY_USER,
+		.hints = "uUS uUS uUS",
+		.order = "uUS",
+		.merged = 2,
+	}, {
+		.name = "requests in between keep them apart",
+		.initiator = IEEE80211_REGDOM_SET_BY_USER,
+		.hints = "uUS uDE uUS",
+		.order = "uUS uDE uUS",
+	}, {
+		.name = "only the newest is merged into",
+		.initiator = IEEE80211_REGDOM_SET_BY_USER,
+		.hints = "uUS uDE uUS uUS uDE",
+		.order = "uUS uDE uUS uDE",
+		.merged = 1,
+	}, {
+		.name = "requests beyond the limit are rejected",
+		.initiator = IEEE80211_REGDOM_SET_BY_USER,
+		.params = {
+			.priority = 2,
+			.limit = 2,
+			.policy = REGLIB_QUEUE_REJECT,
+		},
+		.hints = "uUS uDE uFR uGB",
+		.order = "uUS uDE",
+		.rejected = 2,
+	}, {
+		.name = "the latest request beyond the limit is kept",
+		.initiator = IEEE80211_REGDOM_SET_BY_COUNTRY_IE,
+		.params = {
+			.priority = 0,
+			.limit = 2,
+			.policy = REGLIB_QUEUE_COALESCE,
+		},
+		.hints = "iUS iDE iFR iGB iJP",
+		.order = "iUS iDE iJP",
+		.coalesced = 2,
+	}, {
+		.name = "a request set aside is not merged into",
+		.initiator = IEEE80211_REGDOM_SET_BY_COUNTRY_IE,
+		.params = {
+			.priority = 0,
+			.limit = 1,
+			.policy = REGLIB_QUEUE_COALESCE,
+		},
+		.hints = "iUS iDE iUS",
+		.order = "iUS iUS",
+		.coalesced = 1,
+	}, {
+		.name = "initiators are taken by priority",
+		.initiator = IEEE80211_REGDOM_SET_BY_CORE,
+		.hints = "iUS dDE uFR cGB dJP",
+		.order = "cGB uFR dDE dJP iUS",
+	}, {
+		.name = "priorities can be changed",
+		.initiator = IEEE80211_REGDOM_SET_BY_DRIVER,
+		.params = {
+			.priority = 4,
+			.limit = REGLIB_MAX_QUEUED,
+			.policy = REGLIB_QUEUE_REJECT,
+		},
+		.hints = "iUS uFR cGB dDE",
+		.order = "dDE cGB uFR iUS",
+	},
+};
+
+static int test_queue_case(struct kmem_cache *cache,
+			   const struct test_queue_case *test)
+{
+	struct reglib_queue_stats before, after;
+	struct reglib_queue_params params;
+	char order[256];
+	const char *hint;
+	int r = 0;
+
+	reglib_get_queue_params(test->initiator, &params);
+	if (test->params.limit)
+		r = reglib_set_queue_params(test->initiator, &test->params);
+	reglib_get_queue_stats(test->initiator, &before);
+
+	for (hint = test->hints; *hint && !r; hint += 3) {
+		while (*hint == ' ')
+			hint++;
+		r = test_queue_request(cache, hint);
+		if (r == -EALREADY || r == -ENOSPC)
+			r = 0;
+	}
+
+	reglib_get_queue_stats(test->initiator, &after);
+	test_queue_drain(cache, order, sizeof(order));
+	reglib_set_queue_params(test->initiator, &params);
+
+	if (!r && !strcmp(order, test->order) &&
+	    after.merged - before.merged == test->merged &&
+	    after.rejected - before.rejected == test->rejected &&
+	    after.coalesced - before.coalesced == test->coalesced) {
+		printf("Request queue: %s: ok\n", test->name);
+		return 0;
+	}
+
+	printf("Request queue: %s: FAILED, %s came out as %s, "
+	       "%lu merged, %lu rejected, %lu coalesced (%d)\n",
+	       test->name, test->hints, order,
+	       after.merged - before.merged,
+	       after.rejected - before.rejected,
+	       after.coalesced - before.coalesced, r);
+
+	return -EINVAL;
+}
+
+/**
+ * test_reg_queues - check what becomes of requests queued
+ * @cache: where the requests come from
+ *
+ * The queues have to be empty and the caller has to hold the lock of the
+ * regulatory core, which keeps the requests queued here from being
+ * processed. They are all taken off the queues again.
+ *
+ * Returns 0 if the requests came out as expected, -EINVAL otherwise.
+ */
+int test_reg_queues(struct kmem_cache *cache)
+{
+	unsigned int i;
+	int r = 0;
+
+	for (i = 0; i < ARRAY_SIZE(test_queue_cases); i++)
+		if (test_queue_case(cache, &test_queue_cases[i]))
+			r = -EINVAL;
+
+	return r;
+}
+
+/*
+ * Purpose: round trip a database through the compact encoding. 01 and 02
+ * share their rules, 03 has overlapping rules, edges which are not on
+ * the 5 MHz grid and a power which is not a whole dBm.
+ */
+static const char test_regdb_txt[] =
+	"country 01:\n"
+	"\t(2402 - 2482 @ 40), (6, 20)\n"
+	"\t(5170 - 5250 @ 80), (6, 23), NO-IR\n"
+	"country 02:\n"
+	"\t(2402 - 2482 @ 40), (6, 20)\n"
+	"\t(5170 - 5250 @ 80), (6, 23), NO-IR\n"
+	"country 03:\n"
+	"\t(2402 - 2472 @ 40), (6, 20)\n"
+	"\t(2457 - 2482 @ 20), (6, 17.5), PASSIVE-SCAN, NO-IR\n"
+	"\t(5170 - 5330 @ 160), (6, 23)\n"
+	"\t(5250 - 5330 @ 80), (6, 30), PASSIVE-SCAN\n"
+	"\t(5735 - 5835 @ 80), (6, 30)\n";
+
+static const char test_regdb_countries[][2] = {
+	"01", "02", "03",
+};
+
+/* Writes a db.txt compiled or a compact database to a temporary file */
+static int test_regdb_write(char *path, const char *txt,
+			    const uint8_t *blob, size_t len)
+{
+	FILE *in = NULL, *out;
+	unsigned int err_line;
+	int fd, r = 0;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -errno;
+
+	out = fdopen(fd, "wb");
+	if (!out) {
+		r = -errno;
+		close(fd);
+		unlink(path);
+		return r;
+	}
+
+	if (txt) {
+		in = fmemopen((void *) txt, strlen(txt), "r");
+		r = in ? regdb_compile(in, out, &err_line) : -errno;
+		if (in)
+			fclose(in);
+	} else if (fwrite(blob, 1, len, out) != len)
+		r = -EIO;
+
+	if (fclose(out) && !r)
+		r = -EIO;
+	if (r)
+		unlink(path);
+
+	return r;
+}
+
+/* Compares the lookups on a frequency of the compact domain and of @rd */
+static int test_regdb_compact_freq(const struct regdb_compact_regd *regd,
+				   const struct ieee80211_regdomain *rd,
+				   uint32_t center_freq_khz)
+{
+	const int target_eirps_mbm[] = {
+		DBM_TO_MBM(5),
+		DBM_TO_MBM(17.5),
+		DBM_TO_MBM(20),
+		DBM_TO_MBM(30),
+	};
+	const struct ieee80211_reg_rule *rule;
+	struct ieee80211_reg_rule compact_rule;
+	unsigned int j, k;
+	int r, compact_r;
+
+	for (j = 0; j < ARRAY_SIZE(target_eirps_mbm); j++) {
+		for (k = 0; k < REGLIB_NUM_BWS; k++) {
+			r = reglib_freq_info_regd(NULL, center_freq_khz,
+						  target_eirps_mbm[j],
+						  REGLIB_BW_KHZ(k), &rule, rd);
+			compact_r = regdb_compact_freq_info(regd,
+							    center_freq_khz,
+							    target_eirps_mbm[j],
+							    REGLIB_BW_KHZ(k),
+							    &compact_rule);
+			if (r == compact_r &&
+			    (r || !memcmp(rule, &compact_rule, sizeof(*rule))))
+				continue;
+
+			printf("Compact database: %c%c %u MHz at %d mBm, "
+			       "%u MHz wide: FAILED\n", rd->alpha2[0],
+			       rd->alpha2[1], KHZ_TO_MHZ(center_freq_khz),
+			       target_eirps_mbm[j],
+			       KHZ_TO_MHZ(REGLIB_BW_KHZ(k)));
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* Compares the compact domain with @rd, expanded and on every MHz */
+static int test_regdb_compact_regd(const struct regdb_compact_regd *regd,
+				   const struct ieee80211_regdomain *rd)
+{
+	const uint32_t bands_mhz[][2] = {
+		{ 2400, 2500 },
+		{ 5150, 5850 },
+	};
+	struct ieee80211_regdomain *expanded;
+	uint32_t freq_mhz;
+	unsigned int b;
+	int r;
+
+	r = regdb_compact_expand(regd, &expanded);
+	if (r)
+		return r;
+	r = expanded->n_reg_rules != rd->n_reg_rules ||
+	    memcmp(expanded->reg_rules, rd->reg_rules,
+		   rd->n_reg_rules * sizeof(struct ieee80211_reg_rule));
+	free(expanded);
+	if (r) {
+		printf("Compact database: %c%c expanded: FAILED\n",
+		       rd->alpha2[0], rd->alpha2[1]);
+		return -EINVAL;
+	}
+
+	for (b = 0; b < ARRAY_SIZE(bands_mhz); b++) {
+		for (freq_mhz = bands_mhz[b][0];
+		     freq_mhz <= bands_mhz[b][1]; freq_mhz++) {
+			r = test_regdb_compact_freq(regd, rd,
+						    MHZ_TO_KHZ(freq_mhz));
+			if (r)
+				return r;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * test_regdb_compact - round trip a database through the compact encoding
+ *
+ * Compiles test_regdb_txt, encodes it and reads it back the way CRDA
+ * does. Every lookup regdb_compact_freq_info() answers on a country has
+ * to find the same rule reglib_freq_info_regd() finds on the country in
+ * the database, and the country has to expand into the same rules.
+ *
+ * Returns 0 if it all matched, a negative error code otherwise.
+ */
+int test_regdb_compact(void)
+{
+	char db_path[] = "/tmp/regsim-test-db-XXXXXX";
+	char cdb_path[] = "/tmp/regsim-test-cdb-XXXXXX";
+	struct regdb_compact_regd regd;
+	const struct ieee80211_regdomain *rd;
+	struct regdb *db = NULL;
+	uint8_t *buf, *blob = NULL;
+	size_t len, size;
+	unsigned int i;
+	int r;
+
+	buf = malloc(REGDB_COMPACT_MAX_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	r = test_regdb_write(db_path, test_regdb_txt, NULL, 0);
+	if (!r) {
+		r = regdb_load(db_path, &db);
+		unlink(db_path);
+	}
+	if (!r)
+		r = regdb_compact_encode(db, buf, REGDB_COMPACT_MAX_SIZE, &len);
+	if (!r)
+		r = test_regdb_write(cdb_path, NULL, buf, len);
+	if (!r) {
+		r = regdb_compact_load(cdb_path, &blob, &size);
+		unlink(cdb_path);
+	}
+
+	for (i = 0; !r && i < ARRAY_SIZE(test_regdb_countries); i++) {
+		rd = regdb_find(db, test_regdb_countries[i]);
+		r = rd ? regdb_compact_find(blob, size,
+					    test_regdb_countries[i], &regd) :
+			 -ENOENT;
+		if (!r)
+			r = test_regdb_compact_regd(&regd, rd);
+	}
+
+	if (!r && regdb_compact_find(blob, size, "04", &regd) != -ENOENT)
+		r = -EINVAL;
+
+	if (r)
+		printf("Compact database: FAILED: %d\n", r);
+	else
+		printf("Compact database: round trip: ok\n");
+
+	free(blob);
+	regdb_free(db);
+	free(buf);
+
+	return r;
 }
 
 /*
@@ -181,7 +1432,9 @@ void test_regdoms(void)
 	};
 	int i;
 
+	reglib_read_lock();
 	test_regdom(reglib_get_regd());
+	reglib_read_unlock();
 
 	for (i = 0; i < ARRAY_SIZE(regdoms); i++)
 		test_regdom(regdoms[i]);
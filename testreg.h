@@ -1,6 +1,16 @@
 #ifndef __TEST_REG_H
 #define __TEST_REG_H
 
+struct kmem_cache;
+
 void test_regdoms(void);
+int test_reg_queues(struct kmem_cache *cache);
+int test_tx(void);
+int test_acs(void);
+int test_intersect(void);
+int test_reload(void);
+int test_regdb_compact(void);
+int test_workqueue(void);
+int test_rcu(void);
 
 #endif /* ___TEST__REG_H */